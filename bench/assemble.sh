@@ -0,0 +1,48 @@
+#!/bin/sh
+# Time the assembler on generated programs of 100k and 1M instructions, or
+# the sizes given, to check that assembling stays linear in the size of the
+# program. Each program is a long main of small blocks that each declare a
+# label, push words and double words, use a static word, and branch back to
+# the loop at the start, like the output of a compiler would.
+#
+# Run from the project root. Needs a way to run the assembler, which
+# defaults to `lein run` but can be set with LT64_ASM, i.e.
+#   LT64_ASM="java -jar lt64-asm.jar" bench/assemble.sh [instructions...]
+# The time includes starting the JVM, which the smallest size shows.
+
+ASM=${LT64_ASM:-lein run}
+SIZES=${*:-1000 100000 1000000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() { date +%s%N; }
+
+# generate INSTRUCTIONS -> writes a program of about that many ops to stdout
+generate() {
+  awk -v n="$1" 'BEGIN {
+    print "(lt64-asm-prog"
+    print " (static"
+    print "  (:word counter 1 0)"
+    print "  (:str greeting \"generated\"))"
+    print " (main"
+    print "  :label loop"
+    for (i = 0; i < n; i += 13) {
+      printf "  :label b%d :push %d :push counter :store-lb", i, i % 30000
+      printf " :push counter :load-lb :push 1 :add :pop"
+      printf " :dpush %d :dpop :push 0 :push loop :branch\n", i
+    }
+    print "  :halt))"
+  }'
+}
+
+printf "%12s %10s %10s %12s\n" "instructions" "lta (KB)" "ltb (KB)" "time (ms)"
+for size in $SIZES; do
+  generate "$size" > "$WORK/gen.lta"
+  start=$(now)
+  $ASM "$WORK/gen.lta" -o "$WORK/gen.ltb" > /dev/null || exit 1
+  end=$(now)
+  printf "%12d %10d %10d %12d\n" "$size" \
+    $(($(wc -c < "$WORK/gen.lta") / 1024)) \
+    $(($(wc -c < "$WORK/gen.ltb") / 1024)) \
+    $(((end - start) / 1000000))
+done
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Compare the VM engines on the programs in test/lt64_asm/lta_programs. Each
+# engine adds to the one before it, from the portable switch engine through
+# threaded dispatch (-DLT64_THREADED), checking registers only where they
+# change (-DLT64_FAST), caching the top of the stack (-DLT64_TOS), and on
+# x86-64 Linux compiling hot code while it runs (-DLT64_JIT). The last is
+# the program translated ahead of time with the assembler's -a flag.
+#
+# Run from the project root. Needs gcc and a way to run the assembler, which
+# defaults to `lein run` but can be set with LT64_ASM, i.e.
+#   LT64_ASM="java -jar lt64-asm.jar" bench/dispatch.sh [runs]
+
+ASM=${LT64_ASM:-lein run}
+RUNS=${1:-5}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+PROGS=test/lt64_asm/lta_programs
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Inputs big enough for dispatch to dominate process startup
+seq 1000000 | awk 'BEGIN { print 1000000 } { printf "%d ", $1 - 500000 }' \
+  > "$WORK/coldputer.in"
+seq 0 30 899970 | awk 'BEGIN { print 30000 } { print }' > "$WORK/stopwatch.in"
+awk 'BEGIN { for (i = 0; i < 1000; i++) printf "%c", 33 + i % 90; print "" }' \
+  > "$WORK/magic_trick.in"
+
+now() { date +%s%N; }
+
+# run_engine BINARY INPUT -> prints the mean wall time in ms over RUNS runs
+run_engine() {
+  total=0
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    start=$(now)
+    "$1" < "$2" > /dev/null
+    end=$(now)
+    total=$((total + end - start))
+    i=$((i + 1))
+  done
+  echo $((total / RUNS / 1000000))
+}
+
+# engine_flags NAME -> prints the defines for an engine
+engine_flags() {
+  case $1 in
+    switch) echo "" ;;
+    threaded) echo "-DLT64_THREADED" ;;
+    fast) echo "-DLT64_THREADED -DLT64_FAST" ;;
+    cached) echo "-DLT64_THREADED -DLT64_FAST -DLT64_TOS" ;;
+    jit) echo "-DLT64_THREADED -DLT64_FAST -DLT64_TOS -DLT64_JIT" ;;
+    aot) echo "-DLT64_TOS" ;;
+  esac
+}
+ENGINES="switch threaded fast cached"
+[ "$(uname -sm)" = "Linux x86_64" ] && ENGINES="$ENGINES jit"
+ENGINES="$ENGINES aot"
+
+printf "%-14s" "program (ms)"
+for engine in $ENGINES; do printf " %10s" "$engine"; done
+printf "\n"
+
+for prog in coldputer stopwatch magic_trick; do
+  $ASM "$PROGS/$prog.lta" -c "$WORK/$prog.c" > /dev/null || exit 1
+  $ASM "$PROGS/$prog.lta" -a -c "$WORK/$prog.aot.c" > /dev/null || exit 1
+  expected=""
+  for engine in $ENGINES; do
+    src="$WORK/$prog.c"
+    [ "$engine" = aot ] && src="$WORK/$prog.aot.c"
+    $CC $CFLAGS $(engine_flags $engine) "$src" -o "$WORK/$prog.$engine" || exit 1
+    out=$("$WORK/$prog.$engine" < "$WORK/$prog.in" | md5sum)
+    if [ -z "$expected" ]; then
+      expected=$out
+    elif [ "$out" != "$expected" ]; then
+      echo "Error: $engine engine disagrees on the output of $prog" >&2
+      exit 1
+    fi
+  done
+
+  printf "%-14s" "$prog"
+  for engine in $ENGINES; do
+    printf " %10s" "$(run_engine "$WORK/$prog.$engine" "$WORK/$prog.in")"
+  done
+  printf "\n"
+done
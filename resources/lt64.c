@@ -2,6 +2,40 @@
 #include "stdio.h"
 #include "stdbool.h"
 #include "string.h"
+#include "limits.h"
+#include "errno.h"
+#include "unistd.h"
+#include "time.h"
+
+#ifdef LT64_RUNNER
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#endif
+
+#ifdef LT64_BATCH
+#include "pthread.h"
+#include "dirent.h"
+#include "stdatomic.h"
+#include "sys/stat.h"
+#endif
+
+#ifdef LT64_FORK
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/wait.h"
+#endif
+
+#if defined(LT64_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include "x86intrin.h"
+#endif
+
+#ifdef LT64_JIT
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "LT64_JIT only compiles for x86-64 Linux"
+#endif
+#include "sys/mman.h"
+#endif
 
 // ltconst.c /////////////////////////////////////////////////////////////////
 typedef short WORD;
@@ -23,6 +57,42 @@ const char* TEST_FILE = "test.vm";
   const bool DEBUGGING = false;
 #endif
 
+#ifdef LT64_PROFILE
+  const bool PROFILING = true;
+#else
+  const bool PROFILING = false;
+#endif
+const char* PROFILE_FILE = "lt64.prof";
+
+// The JIT is left out when debugging or profiling, which both need to see
+// every instruction run.
+#if defined(LT64_JIT) && !defined(DEBUG) && !defined(LT64_PROFILE)
+  const bool JITTING = true;
+#else
+  const bool JITTING = false;
+#endif
+
+// The fast engine only checks registers in the handlers that change them,
+// rather than before every instruction. Debugging always checks everything.
+#if defined(LT64_FAST) && !defined(DEBUG)
+  const bool CHECK_ALWAYS = false;
+#else
+  const bool CHECK_ALWAYS = true;
+#endif
+
+// A program verified by the assembler (-DLT64_VERIFIED, which lt64-asm puts
+// at the top of the C file for a program it could verify) never takes the
+// stacks out of bounds or jumps anywhere but the start of one of its
+// instructions, so it runs without checking the registers at all. It is
+// only for the program built in with set_program, so it is ignored when
+// loading programs or snapshots from files, and debugging checks everything.
+#if defined(LT64_VERIFIED) && !defined(DEBUG) && !defined(LT64_RUNNER) \
+    && !defined(LT64_LIBRARY)
+  const bool VERIFIED = true;
+#else
+  const bool VERIFIED = false;
+#endif
+
 // Sizes for the various memorys
 const ADDRESS END_MEMORY = 0xffff;
 const ADDRESS END_RETURN = 0x1000;
@@ -52,6 +122,78 @@ const size_t EXIT_STR = 8;
 const size_t EXIT_ARGS = 9;
 const size_t EXIT_RSOF = 10;
 const size_t EXIT_RSUF = 11;
+const size_t EXIT_BUDGET = 12;
+
+// lt64.h ////////////////////////////////////////////////////////////////////
+// The VM can be embedded in another program by building this file with
+// -DLT64_LIBRARY, which leaves out main, and including resources/lt64.h,
+// which has the same declarations as this section. Each LT64_VM has its own
+// memory, stacks, registers, and I/O, so any number can be loaded and run
+// in one process.
+#ifndef LT64_H
+#define LT64_H
+
+typedef struct lt64_vm LT64_VM;
+
+// Called to refill a VM's input and to flush its output, with the user
+// pointer they were set with. They return the number of bytes read or
+// written, 0 at the end of input, or a negative number on an error.
+typedef long (*LT64_READ)(void* user, char* buffer, size_t size);
+typedef long (*LT64_WRITE)(void* user, const char* buffer, size_t size);
+
+// In memory input and output, used as the user pointer for
+// lt64_buffer_read and lt64_buffer_write. Input is read from data up to
+// length. Output is added to the end of data, which is grown as needed and
+// has to be freed by the caller.
+typedef struct lt64_buffer {
+  char* data;
+  size_t length;
+  size_t capacity;
+  size_t pos;
+} LT64_BUFFER;
+
+// lt64_run returns LT64_HALTED when the program halts, LT64_BUDGET when it
+// ran for its whole budget without stopping, LT64_PAUSED when it ran a
+// :snapshot op, and otherwise the exit code of the error that stopped it,
+// the same as the standalone VM.
+enum lt64_status { LT64_HALTED = 0, LT64_BUDGET = 12, LT64_PAUSED = 13 };
+
+// Returns NULL if the VM cannot be allocated
+LT64_VM* lt64_create();
+void lt64_destroy(LT64_VM* vm);
+
+// Copies length words of an assembled program into the VM's memory and
+// sets it to run from the start. Returns 0, or the exit code for a program
+// that is empty or too large.
+size_t lt64_load(LT64_VM* vm, const short* words, size_t length);
+
+// A VM reads stdin and writes stdout until it is given other callbacks
+void lt64_set_input(LT64_VM* vm, LT64_READ reader, void* user);
+void lt64_set_output(LT64_VM* vm, LT64_WRITE writer, void* user);
+
+// Runs the program until it has run budget instructions, or with no limit
+// for a budget of 0. The budget is checked at jumps, branches, calls, and
+// returns, so a run can go a little past it. Running again after
+// LT64_BUDGET carries on where it stopped. Output is flushed before it
+// returns.
+size_t lt64_run(LT64_VM* vm, size_t budget);
+
+// Writes a VM's memory, stacks, and registers to the file at path, and reads
+// them back into a VM so it carries on from where the saved one stopped.
+// Input that was read but not used, and output already written, are not
+// saved. A snapshot can only be restored by a VM built the same way on the
+// same kind of machine. Both return 0, or the exit code for a bad file if
+// it cannot be written or read or is not a snapshot. A VM that could not be
+// restored has to be loaded again.
+size_t lt64_save(LT64_VM* vm, const char* path);
+size_t lt64_restore(LT64_VM* vm, const char* path);
+
+// The number of instructions run since the program was loaded
+size_t lt64_steps(LT64_VM* vm);
+
+long lt64_buffer_read(void* buffer, char* data, size_t size);
+long lt64_buffer_write(void* buffer, const char* data, size_t size);
+#endif
 
 // ltrun.h ///////////////////////////////////////////////////////////////////
 typedef enum op_codes { HALT=0,
@@ -95,10 +237,22 @@ typedef enum op_codes { HALT=0,
   FMULT, FDIV, FMULTSC, FDIVSC,  // 63
 
   PRNPK,
+
+  // Fused ops, emitted by the assembler for common op sequences
+  LOADI, STOREI, DLOADI, DSTOREI,  // 68
+  JUMPI, BRANCHI, CALLI,  // 6B
+  DINCR, NIP,  // 6D
+
+  SNAPSHOT,  // 6E
 } OP_CODE;
 
 enum copy_codes { MEM_BUF = 0, BUF_MEM };
 
+// Not a real op code, so it is outside of the byte range. It is decoded for
+// every address past the program so running off the end can be caught
+// without checking pc before every instruction.
+enum decode_codes { OUT_OF_BOUNDS = 0x100 };
+
 /// ltmem.h //////////////////////////////////////////////////////////////////
 static inline DWORD get_dword(WORD* mem, ADDRESS pos) {
   return (mem[pos] << WORD_SIZE) | (mem[pos+1] & 0xffff);
@@ -127,27 +281,388 @@ static inline WORDU string_length(WORD* mem, ADDRESS start) {
   return start - (atemp - 1);
 }
 
+/// ltdecode.c //////////////////////////////////////////////////////////////
+// An instruction decoded ahead of time. The op code and its flag byte are
+// split out of the word and any immediate value is read in with it, so the
+// interpreter does not have to mask, shift, or reread memory for them.
+typedef struct instruction {
+  unsigned short op;
+  unsigned char flag;
+  DWORD arg;  // PUSH word or DPUSH double word
+} INSTRUCTION;
+
+// Every address is decoded on its own, as if execution could start there,
+// so jumping into the middle of something still does what it did before.
+static inline void decode_at(WORD* mem, INSTRUCTION* code, ADDRESS pos) {
+  code[pos].op = mem[pos] & 0xff;
+  code[pos].flag = (mem[pos] >> BYTE_SIZE) & 0xff;
+  switch (code[pos].op) {
+    case PUSH:
+    case LOADI:
+    case STOREI:
+    case DLOADI:
+    case DSTOREI:
+    case JUMPI:
+    case BRANCHI:
+    case CALLI:
+      code[pos].arg = mem[(ADDRESS)(pos + 1)];
+      break;
+    case DPUSH:
+      code[pos].arg = (mem[(ADDRESS)(pos + 1)] << WORD_SIZE)
+                      | (mem[(ADDRESS)(pos + 2)] & 0xffff);
+      break;
+    default:
+      code[pos].arg = 0;
+      break;
+  }
+}
+
+void decode_program(WORD* mem, INSTRUCTION* code, ADDRESS end) {
+  for (ADDRESS pos = 0; pos < end; pos++)
+    decode_at(mem, code, pos);
+  for (size_t pos = end; pos <= END_MEMORY; pos++)
+    code[pos].op = OUT_OF_BOUNDS;
+}
+
+// Called after memory from start up to end has been written. Writes into
+// the program region redecode the words written and the two words before
+// them, which may be ops using them as immediates. Writes past the program
+// region cannot be executed so they are ignored.
+static inline void invalidate(WORD* mem, INSTRUCTION* code,
+                              size_t start, size_t end, ADDRESS bfp) {
+  if (start >= bfp) return;
+  if (end > bfp) end = bfp;
+  for (size_t pos = start < 2 ? 0 : start - 2; pos < end; pos++)
+    decode_at(mem, code, pos);
+}
+
+// True if a write to memory from start up to end touches the code of a
+// program whose code starts at code_start. The first 3 words are the jump
+// over the static data.
+static inline bool writes_code(size_t start, size_t end, ADDRESS code_start,
+                               ADDRESS bfp) {
+  return start < 3 || (end > code_start && start < bfp);
+}
+
 /// ltio.c ///////////////////////////////////////////////////////////////////
-void display_range(WORD* mem, ADDRESS start, ADDRESS end, bool debug) {
+// Program input and output go through buffers over read and write callbacks
+// instead of scanf and printf, so reading or printing a number does not go
+// through format parsing, locales, or a call per character. Each VM has its
+// own buffers, reading from stdin and writing to stdout unless it is given
+// other callbacks. Output is flushed before blocking for more input, so
+// prompts still show up, and when a run stops. Anything written straight to
+// stdout or stderr has to flush_output first to stay in order.
+#define IO_BUFFER_SIZE 0x10000
+
+typedef struct lt64_io {
+  LT64_READ read;
+  void* read_user;
+  LT64_WRITE write;
+  void* write_user;
+
+  char in_buffer[IO_BUFFER_SIZE];
+  size_t in_pos;
+  size_t in_end;
+
+  char out_buffer[IO_BUFFER_SIZE];
+  size_t out_end;
+} LT64_IO;
+
+static long read_stdin(void* user, char* buffer, size_t size) {
+  (void)user;
+  for (;;) {
+    ssize_t got = read(STDIN_FILENO, buffer, size);
+    if (got < 0 && errno == EINTR) continue;
+    return got;
+  }
+}
+
+static long write_stdout(void* user, const char* buffer, size_t size) {
+  (void)user;
+  for (;;) {
+    ssize_t written = write(STDOUT_FILENO, buffer, size);
+    if (written < 0 && errno == EINTR) continue;
+    return written;
+  }
+}
+
+long lt64_buffer_read(void* buffer, char* data, size_t size) {
+  LT64_BUFFER* input = (LT64_BUFFER*)buffer;
+  size_t left = input->length - input->pos;
+  if (size > left)
+    size = left;
+  memcpy(data, input->data + input->pos, size);
+  input->pos += size;
+  return size;
+}
+
+long lt64_buffer_write(void* buffer, const char* data, size_t size) {
+  LT64_BUFFER* output = (LT64_BUFFER*)buffer;
+  if (output->length + size > output->capacity) {
+    size_t capacity = output->capacity ? output->capacity : IO_BUFFER_SIZE;
+    while (capacity < output->length + size)
+      capacity *= 2;
+    char* data = (char*)realloc(output->data, capacity);
+    if (data == NULL)
+      return -1;
+    output->data = data;
+    output->capacity = capacity;
+  }
+  memcpy(output->data + output->length, data, size);
+  output->length += size;
+  return size;
+}
+
+void flush_output(LT64_IO* io) {
+  size_t pos = 0;
+  while (pos < io->out_end) {
+    long written = io->write(io->write_user, io->out_buffer + pos,
+                             io->out_end - pos);
+    if (written <= 0)
+      break;
+    pos += written;
+  }
+  io->out_end = 0;
+}
+
+static inline void write_char(LT64_IO* io, char ch) {
+  if (io->out_end == IO_BUFFER_SIZE)
+    flush_output(io);
+  io->out_buffer[io->out_end++] = ch;
+}
+
+void write_unsigned(LT64_IO* io, unsigned long long value) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count)
+    write_char(io, digits[--count]);
+}
+
+void write_signed(LT64_IO* io, long long value) {
+  if (value < 0) {
+    write_char(io, '-');
+    write_unsigned(io, -(unsigned long long)value);
+  } else {
+    write_unsigned(io, value);
+  }
+}
+
+// Same as printf("%.*lf", places, (double)value / SCALES[places]). A DWORD
+// over a power of 10 is always close enough to the double that printf
+// rounds it back to these digits, so no floating point is needed.
+void write_fixed(LT64_IO* io, DWORD value, WORDU places) {
+  unsigned long long magnitude = value < 0 ? -(unsigned long long)value
+                                           : (unsigned long long)value;
+  if (value < 0)
+    write_char(io, '-');
+  write_unsigned(io, magnitude / SCALES[places]);
+  write_char(io, '.');
+
+  unsigned long long fraction = magnitude % SCALES[places];
+  for (WORDU place = places; place > 0; place--)
+    write_char(io, '0' + fraction / SCALES[place - 1] % 10);
+}
+
+// Refill the input buffer. Returns false at the end of input.
+static bool fill_input(LT64_IO* io) {
+  flush_output(io);
+  long got = io->read(io->read_user, io->in_buffer, IO_BUFFER_SIZE);
+  io->in_pos = 0;
+  io->in_end = got > 0 ? got : 0;
+  return got > 0;
+}
+
+// The next input char, or EOF, without taking it
+static inline int peek_char(LT64_IO* io) {
+  if (io->in_pos == io->in_end && !fill_input(io))
+    return EOF;
+  return (unsigned char)io->in_buffer[io->in_pos];
+}
+
+static inline int next_char(LT64_IO* io) {
+  int ch = peek_char(io);
+  if (ch != EOF)
+    io->in_pos++;
+  return ch;
+}
+
+static inline bool is_space(int ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+static inline bool is_digit(int ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+// Skip whitespace and take a '+' or '-'. Returns true for '-'.
+static bool read_sign(LT64_IO* io) {
+  while (is_space(peek_char(io)))
+    io->in_pos++;
+  int ch = peek_char(io);
+  if (ch == '+' || ch == '-') {
+    io->in_pos++;
+    return ch == '-';
+  }
+  return false;
+}
+
+// Reads a decimal integer the way scanf's %d does, saturating at the range of
+// a long like strtol. Returns false, leaving value alone, at the end of
+// input or if there are no digits.
+bool read_integer(LT64_IO* io, long* value) {
+  bool negative = read_sign(io);
+  if (!is_digit(peek_char(io)))
+    return false;
+
+  unsigned long limit = negative ? -(unsigned long)LONG_MIN : LONG_MAX;
+  unsigned long magnitude = 0;
+  while (is_digit(peek_char(io))) {
+    unsigned long digit = next_char(io) - '0';
+    if (magnitude > (limit - digit) / 10)
+      magnitude = limit;
+    else
+      magnitude = magnitude * 10 + digit;
+  }
+  *value = negative ? (long)-magnitude : (long)magnitude;
+  return true;
+}
+
+// Reads a decimal number the way scanf's %lf does. Up to 19 significant
+// digits with a small exponent are exact in a double after one multiply or
+// divide by a power of 10, which covers any reasonable fixed point input.
+// Anything else is rebuilt as a string for strtod so it rounds the same way
+// it always did. Returns false, leaving value alone, at the end of input or
+// if there are no digits.
+bool read_double(LT64_IO* io, double* value) {
+  static const double POWERS[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const int MAX_DIGITS = 40;
+  char digits[MAX_DIGITS + 1];
+  int count = 0;
+  int exponent = 0;
+  bool any_digits = false;
+  unsigned long long mantissa = 0;
+
+  bool negative = read_sign(io);
+  while (is_digit(peek_char(io))) {
+    int ch = next_char(io);
+    any_digits = true;
+    if (count == 0 && ch == '0') continue;
+    if (count < MAX_DIGITS) {
+      digits[count++] = ch;
+      if (count <= 19) mantissa = mantissa * 10 + (ch - '0');
+    } else {
+      exponent++;
+    }
+  }
+  if (peek_char(io) == '.') {
+    io->in_pos++;
+    while (is_digit(peek_char(io))) {
+      int ch = next_char(io);
+      any_digits = true;
+      if (count == 0 && ch == '0') {
+        exponent--;
+        continue;
+      }
+      if (count < MAX_DIGITS) {
+        digits[count++] = ch;
+        if (count <= 19) mantissa = mantissa * 10 + (ch - '0');
+        exponent--;
+      }
+    }
+  }
+  if (!any_digits)
+    return false;
+
+  if (peek_char(io) == 'e' || peek_char(io) == 'E') {
+    io->in_pos++;
+    bool exp_negative = false;
+    if (peek_char(io) == '+' || peek_char(io) == '-')
+      exp_negative = next_char(io) == '-';
+    int exp_value = 0;
+    while (is_digit(peek_char(io))) {
+      int digit = next_char(io) - '0';
+      if (exp_value < 100000)
+        exp_value = exp_value * 10 + digit;
+    }
+    exponent += exp_negative ? -exp_value : exp_value;
+  }
+
+  double result;
+  if (count == 0) {
+    result = 0.0;
+  } else if (count <= 19 && mantissa <= (1ULL << 53)
+             && exponent >= -22 && exponent <= 22) {
+    result = exponent < 0 ? (double)mantissa / POWERS[-exponent]
+                          : (double)mantissa * POWERS[exponent];
+  } else {
+    char text[MAX_DIGITS + 16];
+    int length = 0;
+    for (int i = 0; i < count; i++)
+      text[length++] = digits[i];
+    length += sprintf(text + length, "e%d", exponent);
+    result = strtod(text, NULL);
+  }
+  *value = negative ? -result : result;
+  return true;
+}
+
+// Reads one char, whitespace or not. Returns false at the end of input.
+bool read_char(LT64_IO* io, char* ch) {
+  int next = next_char(io);
+  if (next == EOF)
+    return false;
+  *ch = next;
+  return true;
+}
+
+// Like fgets, reads up to size - 1 chars through the end of the line
+bool read_line(LT64_IO* io, char* buffer, int size) {
+  int length = 0;
+  while (length < size - 1) {
+    int ch = next_char(io);
+    if (ch == EOF) break;
+    buffer[length++] = ch;
+    if (ch == '\n') break;
+  }
+  buffer[length] = 0;
+  return length > 0;
+}
+
+void display_range(LT64_IO* io, WORD* mem, ADDRESS start, ADDRESS end,
+                   bool debug) {
+  static const char HEX[] = "0123456789abcdef";
   if (debug && end - 8 > start) {
     start = end - 8; 
     fprintf(stderr, "... ");
   }
 
   for (ADDRESS i = start; i < end; i++) {
-    if (debug)
+    if (debug) {
       fprintf(stderr, "%hx(%hd) ", mem[i], mem[i]);
-    else
-      printf("%04hx ", mem[i]);
+    } else {
+      WORDU word = mem[i];
+      write_char(io, HEX[(word >> 12) & 0xf]);
+      write_char(io, HEX[(word >> 8) & 0xf]);
+      write_char(io, HEX[(word >> 4) & 0xf]);
+      write_char(io, HEX[word & 0xf]);
+      write_char(io, ' ');
+    }
   }
 
   if (debug)
     fprintf(stderr, "->\n");
   else
-    printf("\n");
+    write_char(io, '\n');
 }
 
-void print_string(WORD* mem, ADDRESS start, ADDRESS max) {
+void print_string(LT64_IO* io, WORD* mem, ADDRESS start, ADDRESS max) {
   ADDRESS atemp = start;
   while (atemp < max) {
     WORD chars = mem[atemp];
@@ -155,23 +670,25 @@ void print_string(WORD* mem, ADDRESS start, ADDRESS max) {
     WORD high = chars >> BYTE_SIZE;
 
     if (!low) break;
-    printf("%c", low);
+    write_char(io, low);
 
     if (!high) break;
-    printf("%c", high);
+    write_char(io, high);
 
     atemp++;
   }
 }
 
-void read_string(WORD* mem, ADDRESS start, ADDRESS max) {
+// Reads to the end of the line, or of the input
+void read_string(LT64_IO* io, WORD* mem, ADDRESS start, ADDRESS max) {
   ADDRESS atemp = start;
   bool first = true;
   WORDU two_chars = 0;
 
   while (atemp < max - 1) {
     char ch;
-    scanf("%c", &ch);
+    if (!read_char(io, &ch))
+      ch = '\n';
 
     if (ch == '\n') {
       if (first) {
@@ -300,33 +817,43 @@ void display_op_name(OP_CODE op, FILE* stream) {
     case FMULTSC: fprintf(stream, "FMULTSC"); break;
     case FDIVSC: fprintf(stream, "FDIVSC"); break;
     case PRNPK: fprintf(stream, "PRNPK"); break;
+    case LOADI: fprintf(stream, "LOADI"); break;
+    case STOREI: fprintf(stream, "STOREI"); break;
+    case DLOADI: fprintf(stream, "DLOADI"); break;
+    case DSTOREI: fprintf(stream, "DSTOREI"); break;
+    case JUMPI: fprintf(stream, "JUMPI"); break;
+    case BRANCHI: fprintf(stream, "BRANCHI"); break;
+    case CALLI: fprintf(stream, "CALLI"); break;
+    case DINCR: fprintf(stream, "DINCR"); break;
+    case NIP: fprintf(stream, "NIP"); break;
+    case SNAPSHOT: fprintf(stream, "SNAPSHOT"); break;
     default: fprintf(stream, "code=%hx (%hd)", op, op); break;
   }
 }
 
-void debug_info_display(WORD* data_stack, WORD* return_stack, ADDRESS dsp,
-                        ADDRESS rsp, ADDRESS pc, WORD op) {
+void debug_info_display(LT64_IO* io, WORD* data_stack, WORD* return_stack,
+                        ADDRESS dsp, ADDRESS rsp, ADDRESS pc, WORD op) {
   // print stacks and pointers
-  fflush(stdout);
+  flush_output(io);
   fprintf(stderr, "\nDstack: ");
-  display_range(data_stack, 0x0001, dsp + 1, DEBUGGING);
+  display_range(io, data_stack, 0x0001, dsp + 1, DEBUGGING);
   fprintf(stderr, "Rstack: ");
-  display_range(return_stack, 0x0001, rsp + 1, DEBUGGING);
+  display_range(io, return_stack, 0x0001, rsp + 1, DEBUGGING);
   fprintf(stderr, "PC: %hx (%hu), Next OP: ", pc, pc);
   display_op_name(op, stderr);
   fprintf(stderr, "\n");
 }
 
-size_t debug_step(size_t steps) {
+size_t debug_step(LT64_IO* io, size_t steps) {
   if (steps > 0) {
     return steps - 1;
   } else {
     char buffer[10];
     int size = 10;
 
-    fflush(stdout);
+    flush_output(io);
     fprintf(stderr, "\n***Step: ");
-    if ( fgets(buffer, size, stdin) != NULL ) {
+    if (read_line(io, buffer, size)) {
       return strtol(buffer,NULL,10);
     } else {
       return 0;
@@ -334,707 +861,3134 @@ size_t debug_step(size_t steps) {
   }
 }
 
-/// ltrun.c //////////////////////////////////////////////////////////////////
-size_t execute(WORD* memory, size_t length, WORD* data_stack, WORD* return_stack) {
-  // Declare and initialize memory pointer "registers"
-  ADDRESS dsp, rsp, pc, bfp, fmp;
-  dsp = 0;
-  rsp = 0;
-  pc = 0;
-  bfp = length;
-  fmp = length + BUFFER_SIZE;
+/// ltprof.c /////////////////////////////////////////////////////////////////
+// The profiling build (-DLT64_PROFILE) counts every instruction run by its op
+// code and by its address, and every call by its target. The time from one
+// instruction to the next is added to the op that ran, in cycles from rdtsc
+// on x86 or in nanoseconds from clock_gettime elsewhere. When the program
+// finishes the counts are printed to stderr sorted, and written one per line
+// to PROFILE_FILE so the assembler can name the addresses in them.
+#ifdef LT64_PROFILE
+typedef unsigned long long COUNT;
+
+#if defined(__x86_64__) || defined(__i386__)
+  const char* TICK_UNIT = "cycles";
+#else
+  const char* TICK_UNIT = "ns";
+#endif
 
-  // Declare some temporary "registers" for working with intermediate values
-  ADDRESS atemp;
-  WORD temp;
-  WORDU utemp;
-  DWORD dtemp;
-  
-  // Run the program in memory
-  bool run = true;
-  size_t debug_steps = 3;
-  while (run) {
-    // Print stack, op code, and pc before every execution
-    if (DEBUGGING) {
-      debug_steps = debug_step(debug_steps);
-      debug_info_display(data_stack, return_stack, dsp, rsp, pc, memory[pc] & 0xff);
-    }
+// Number of addresses and call targets shown in the report on stderr
+const size_t PROFILE_TOP = 20;
+
+static COUNT op_counts[OUT_OF_BOUNDS + 1];
+static COUNT op_ticks[OUT_OF_BOUNDS + 1];
+static COUNT pc_counts[0x10000];
+static COUNT call_counts[0x10000];
+static COUNT last_tick = 0;
+static unsigned short last_op = HALT;
+
+static inline COUNT profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (COUNT)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static inline void profile_step(unsigned short op, ADDRESS pc) {
+  COUNT now = profile_clock();
+  if (last_tick)
+    op_ticks[last_op] += now - last_tick;
+  last_tick = now;
+  last_op = op;
+  op_counts[op]++;
+  pc_counts[pc]++;
+}
+
+// Fills top with the indexes of the largest non zero counts, largest first.
+// Returns how many were found, at most max.
+static size_t top_counts(COUNT* counts, size_t size, size_t* top, size_t max) {
+  size_t found = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!counts[i] || (found == max && counts[i] <= counts[top[max - 1]]))
+      continue;
+    size_t pos = found < max ? found++ : max - 1;
+    for (; pos > 0 && counts[top[pos - 1]] < counts[i]; pos--)
+      top[pos] = top[pos - 1];
+    top[pos] = i;
+  }
+  return found;
+}
+
+void profile_report() {
+  if (last_tick) {
+    op_ticks[last_op] += profile_clock() - last_tick;
+    last_tick = 0;
+  }
+
+  COUNT total = 0, ticks = 0;
+  for (size_t op = 0; op <= OUT_OF_BOUNDS; op++) {
+    total += op_counts[op];
+    ticks += op_ticks[op];
+  }
+
+  size_t top[OUT_OF_BOUNDS + 1];
+  size_t found = top_counts(op_counts, OUT_OF_BOUNDS + 1, top,
+                            OUT_OF_BOUNDS + 1);
+  fprintf(stderr, "\n*** Profile: %llu instructions, %llu %s ***\n",
+          total, ticks, TICK_UNIT);
+  fprintf(stderr, "%14s %6s %16s  %s\n", "count", "%", TICK_UNIT, "op");
+  for (size_t i = 0; i < found; i++) {
+    fprintf(stderr, "%14llu %6.2f %16llu  ", op_counts[top[i]],
+            100.0 * op_counts[top[i]] / total, op_ticks[top[i]]);
+    display_op_name(top[i], stderr);
+    fprintf(stderr, "\n");
+  }
 
-    // Catch some common pointer/address errors
-    if (pc >= bfp) {
-      fprintf(stderr,
-              "Error: program counter out of bounds, pc: %hx, bfp: %hx\n",
-              pc, bfp);
-      return EXIT_POB;
-    } else if (dsp > 0x8000) {  // i.e. it has wrapped around into negatives
-      fprintf(stderr, "Error: stack underflow, sp: %hx (%hd)\n", dsp, dsp);
-      return EXIT_SUF;
-    } else if (dsp > END_STACK) {
-      fprintf(stderr, "Error: stack overflow, sp: %hx (%hd)\n", dsp, dsp);
-      return EXIT_SOF;
-    } else if (rsp > 0x8000) {  // i.e. it has wrapped around into negatives
-      fprintf(stderr, "Error: return stack underflow, sp: %hx (%hd)\n",
-              rsp, rsp);
-      return EXIT_RSUF;
-    } else if (rsp > END_RETURN) {
-      fprintf(stderr, "Error: return stack overflow, sp: %hx (%hd)\n",
-              rsp, rsp);
-      return EXIT_RSOF;
+  found = top_counts(pc_counts, 0x10000, top, PROFILE_TOP);
+  fprintf(stderr, "\n%14s %6s  %s\n", "count", "%", "address");
+  for (size_t i = 0; i < found; i++)
+    fprintf(stderr, "%14llu %6.2f  %zx\n", pc_counts[top[i]],
+            100.0 * pc_counts[top[i]] / total, top[i]);
+
+  found = top_counts(call_counts, 0x10000, top, PROFILE_TOP);
+  if (found)
+    fprintf(stderr, "\n%14s  %s\n", "calls", "target");
+  for (size_t i = 0; i < found; i++)
+    fprintf(stderr, "%14llu  %zx\n", call_counts[top[i]], top[i]);
+
+  FILE* file = fopen(PROFILE_FILE, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error: Could not write the profile to %s\n",
+            PROFILE_FILE);
+    return;
+  }
+  for (size_t op = 0; op <= OUT_OF_BOUNDS; op++) {
+    if (!op_counts[op]) continue;
+    fprintf(file, "op %zx ", op);
+    display_op_name(op, file);
+    fprintf(file, " %llu %llu\n", op_counts[op], op_ticks[op]);
+  }
+  for (size_t pc = 0; pc < 0x10000; pc++)
+    if (pc_counts[pc])
+      fprintf(file, "pc %zx %llu\n", pc, pc_counts[pc]);
+  for (size_t pc = 0; pc < 0x10000; pc++)
+    if (call_counts[pc])
+      fprintf(file, "call %zx %llu\n", pc, call_counts[pc]);
+  fclose(file);
+  fprintf(stderr, "\nProfile written to %s\n", PROFILE_FILE);
+}
+
+  #define PROFILE_STEP() profile_step(code[pc].op, pc)
+  #define PROFILE_CALL(target) (call_counts[(ADDRESS)(target)]++)
+#else
+  #define PROFILE_STEP()
+  #define PROFILE_CALL(target)
+#endif
+
+/// ltjit.c //////////////////////////////////////////////////////////////////
+// The JIT (-DLT64_JIT, x86-64 Linux only) compiles hot code to machine code.
+// The interpreter counts how often each address is jumped to, and once one
+// has been jumped to LT64_JIT_THRESHOLD times the code from it up to the
+// next jump, branch, call, or return is compiled into a block by copying a
+// small template of machine code for each instruction. Blocks work on the
+// stacks and memory of the VM in place and return the pc to go on from, so
+// the interpreter runs blocks for as long as there are blocks to run and
+// its handlers do everything else. Ops without a template, like I/O, copying
+// memory, and the fixed point ops, end a block before them.
+//
+// A block checks dsp and rsp once on entry against the deepest and highest
+// words it will touch, and leaves without running anything if they could go
+// out of bounds, so the interpreter runs it and reports the error. Stores
+// into the program leave the block before writing so the interpreter does
+// them, and any write into the program drops the blocks compiled from it.
+#ifdef LT64_JIT
+#ifndef LT64_JIT_THRESHOLD
+#define LT64_JIT_THRESHOLD 64
+#endif
+
+// Bytes of executable memory for blocks. When it is full every block is
+// dropped and compiling starts again.
+const size_t JIT_CODE_SIZE = 0x400000;
+// Most instructions compiled into one block, and the most bytes of machine
+// code a block and each instruction in it can take.
+const size_t JIT_BLOCK_OPS = 256;
+const size_t JIT_BLOCK_BYTES = 160;
+const size_t JIT_OP_BYTES = 96;
+
+// The registers a block runs on. The templates load and store them by
+// their offsets, so the layout cannot change.
+typedef struct jit_regs {
+  WORD* data_stack;    // 0
+  WORD* memory;        // 8
+  WORD* return_stack;  // 16
+  long long fuel;      // 24
+  unsigned int dsp;    // 32
+  unsigned int rsp;    // 36
+} JIT_REGS;
+
+// Runs a block and returns the pc to go on from, with JIT_JUMPED set if it
+// left by a jump, branch, call, or return. The instructions it ran are taken
+// from fuel, and it leaves fuel alone if it ran nothing.
+typedef unsigned int (*JIT_BLOCK)(JIT_REGS* regs);
+const unsigned int JIT_JUMPED = 0x10000;
+
+typedef struct jit {
+  WORD* memory;
+  WORD* data_stack;
+  WORD* return_stack;
+  INSTRUCTION* code;
+  ADDRESS bfp, fmp;
+  JIT_BLOCK blocks[0x10000];       // by the address they start at
+  unsigned int counts[0x10000];    // jumps to each address not compiled yet
+  unsigned int ends[0x10000];      // end of the code each block was from
+  ADDRESS starts[0x10000];         // start of each block, in no order
+  size_t block_count;
+  unsigned char* text;             // executable memory for the blocks
+  size_t used;
+} JIT;
+
+// What an op does to the stacks. reach is the deepest word it touches, as
+// n in S(n), and moves is how far it moves the stack pointer, for the data
+// and return stacks. Ops that end a block always leave it, branches only
+// leave when they are taken.
+typedef struct jit_op {
+  bool compiles;
+  signed char reach, moves;
+  signed char rreach, rmoves;
+  bool ends;
+} JIT_OP;
+
+#define JIT_OP_(reach, moves, rreach, rmoves, ends) \
+  { true, reach, moves, rreach, rmoves, ends }
+static const JIT_OP JIT_OPS[OUT_OF_BOUNDS + 1] = {
+  [PUSH] = JIT_OP_(0, 1, 0, 0, false),
+  [POP] = JIT_OP_(0, -1, 0, 0, false),
+  [LOAD] = JIT_OP_(0, 0, 0, 0, false),
+  [STORE] = JIT_OP_(1, -2, 0, 0, false),
+  [FST] = JIT_OP_(0, 1, 0, 0, false),
+  [SEC] = JIT_OP_(1, 1, 0, 0, false),
+  [SWAP] = JIT_OP_(1, 0, 0, 0, false),
+  [ROT] = JIT_OP_(2, 0, 0, 0, false),
+  [RPUSH] = JIT_OP_(0, -1, 0, 1, false),
+  [RPOP] = JIT_OP_(0, 1, 0, -1, false),
+  [RGRAB] = JIT_OP_(0, 1, 0, 0, false),
+
+  [DPUSH] = JIT_OP_(0, 2, 0, 0, false),
+  [DPOP] = JIT_OP_(0, -2, 0, 0, false),
+  [DLOAD] = JIT_OP_(0, 1, 0, 0, false),
+  [DSTORE] = JIT_OP_(2, -3, 0, 0, false),
+  [DFST] = JIT_OP_(1, 2, 0, 0, false),
+  [DSEC] = JIT_OP_(3, 2, 0, 0, false),
+  [DSWAP] = JIT_OP_(3, 0, 0, 0, false),
+  [DROT] = JIT_OP_(5, 0, 0, 0, false),
+  [DRPUSH] = JIT_OP_(1, -2, 0, 2, false),
+  [DRPOP] = JIT_OP_(0, 2, 1, -2, false),
+  [DRGRAB] = JIT_OP_(0, 2, 1, 0, false),
+
+  [ADD] = JIT_OP_(1, -1, 0, 0, false),
+  [SUB] = JIT_OP_(1, -1, 0, 0, false),
+  [MULT] = JIT_OP_(1, -1, 0, 0, false),
+  [DIV] = JIT_OP_(1, -1, 0, 0, false),
+  [MOD] = JIT_OP_(1, -1, 0, 0, false),
+  [EQ] = JIT_OP_(1, -1, 0, 0, false),
+  [LT] = JIT_OP_(1, -1, 0, 0, false),
+  [GT] = JIT_OP_(1, -1, 0, 0, false),
+  [MULTU] = JIT_OP_(1, 0, 0, 0, false),
+  [DIVU] = JIT_OP_(1, -1, 0, 0, false),
+  [MODU] = JIT_OP_(1, -1, 0, 0, false),
+  [LTU] = JIT_OP_(1, -1, 0, 0, false),
+  [GTU] = JIT_OP_(1, -1, 0, 0, false),
+
+  [SL] = JIT_OP_(1, -1, 0, 0, false),
+  [SR] = JIT_OP_(1, -1, 0, 0, false),
+  [AND] = JIT_OP_(1, -1, 0, 0, false),
+  [OR] = JIT_OP_(1, -1, 0, 0, false),
+  [NOT] = JIT_OP_(0, 0, 0, 0, false),
+
+  [DADD] = JIT_OP_(3, -2, 0, 0, false),
+  [DSUB] = JIT_OP_(3, -2, 0, 0, false),
+  [DMULT] = JIT_OP_(3, -2, 0, 0, false),
+  [DDIV] = JIT_OP_(3, -2, 0, 0, false),
+  [DMOD] = JIT_OP_(3, -2, 0, 0, false),
+  [DEQ] = JIT_OP_(3, -2, 0, 0, false),
+  [DLT] = JIT_OP_(3, -2, 0, 0, false),
+  [DGT] = JIT_OP_(3, -2, 0, 0, false),
+  [DDIVU] = JIT_OP_(3, -2, 0, 0, false),
+  [DMODU] = JIT_OP_(3, -2, 0, 0, false),
+  [DLTU] = JIT_OP_(3, -2, 0, 0, false),
+  [DGTU] = JIT_OP_(3, -2, 0, 0, false),
+
+  [DSL] = JIT_OP_(2, -1, 0, 0, false),
+  [DSR] = JIT_OP_(2, -1, 0, 0, false),
+  [DAND] = JIT_OP_(3, -2, 0, 0, false),
+  [DOR] = JIT_OP_(3, -2, 0, 0, false),
+  [DNOT] = JIT_OP_(1, 0, 0, 0, false),
+
+  [JUMP] = JIT_OP_(0, -1, 0, 0, true),
+  [BRANCH] = JIT_OP_(1, -2, 0, 0, false),
+  [CALL] = JIT_OP_(0, -1, 0, 1, true),
+  [RET] = JIT_OP_(0, 0, 0, -1, true),
+  [DSP] = JIT_OP_(0, 1, 0, 0, false),
+  [PC] = JIT_OP_(0, 1, 0, 0, false),
+  [BFP] = JIT_OP_(0, 1, 0, 0, false),
+  [FMP] = JIT_OP_(0, 1, 0, 0, false),
+
+  [HIGH] = JIT_OP_(0, 1, 0, 0, false),
+  [LOW] = JIT_OP_(0, 1, 0, 0, false),
+  [UNPACK] = JIT_OP_(0, 2, 0, 0, false),
+  [PACK] = JIT_OP_(1, -1, 0, 0, false),
+
+  [LOADI] = JIT_OP_(0, 1, 0, 0, false),
+  [STOREI] = JIT_OP_(0, -1, 0, 0, false),
+  [DLOADI] = JIT_OP_(0, 2, 0, 0, false),
+  [DSTOREI] = JIT_OP_(1, -2, 0, 0, false),
+  [JUMPI] = JIT_OP_(0, 0, 0, 0, true),
+  [BRANCHI] = JIT_OP_(0, -1, 0, 0, false),
+  [CALLI] = JIT_OP_(0, 0, 0, 1, true),
+  [DINCR] = JIT_OP_(1, 0, 0, 0, false),
+  [NIP] = JIT_OP_(1, -1, 0, 0, false),
+};
+#undef JIT_OP_
+
+// Scratch registers, as numbered in machine code
+enum { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+static inline unsigned char* jit_bytes(unsigned char* p,
+                                       const unsigned char* bytes, size_t n) {
+  memcpy(p, bytes, n);
+  return p + n;
+}
+
+static inline unsigned char* jit_u16(unsigned char* p, unsigned int x) {
+  unsigned short half = x;
+  memcpy(p, &half, 2);
+  return p + 2;
+}
+
+static inline unsigned char* jit_u32(unsigned char* p, unsigned int x) {
+  memcpy(p, &x, 4);
+  return p + 4;
+}
+
+// A 32 bit offset from the end of itself to target
+static inline unsigned char* jit_rel32(unsigned char* p,
+                                       unsigned char* target) {
+  return jit_u32(p, (unsigned int)(target - (p + 4)));
+}
+
+// An instruction on the word at base + index * 2 + disp. With rbx, r13 for
+// the data stack and r14, r15 for the return stack disp picks out S(n) and
+// R(n). With r12, rax it is main memory at the address in eax. Op codes
+// over 0xff are two bytes.
+static unsigned char* jit_operand(unsigned char* p, bool half,
+                                  unsigned char rex, unsigned int op,
+                                  int reg, unsigned char sib, int disp) {
+  if (half)
+    *p++ = 0x66;
+  *p++ = rex;
+  if (op > 0xff)
+    *p++ = op >> 8;
+  *p++ = op;
+  *p++ = 0x44 | reg << 3;
+  *p++ = sib;
+  *p++ = (unsigned char)disp;
+  return p;
+}
+
+// Main memory at a fixed address, [r12 + disp32]
+static unsigned char* jit_absolute(unsigned char* p, bool half,
+                                   unsigned int op, int reg, size_t address) {
+  if (half)
+    *p++ = 0x66;
+  *p++ = 0x41;
+  if (op > 0xff)
+    *p++ = op >> 8;
+  *p++ = op;
+  *p++ = 0x84 | reg << 3;
+  *p++ = 0x24;
+  return jit_u32(p, address * sizeof(WORD));
+}
+
+// Templates for the compiler, which keeps the next byte in p
+#define EMIT(...) \
+  do { \
+    const unsigned char bytes_[] = { __VA_ARGS__ }; \
+    p = jit_bytes(p, bytes_, sizeof(bytes_)); \
+  } while (0)
+
+// Word n below the top of the data stack, -1 is the next one pushed. Loads
+// zero extend the word, or sign extend it with S_LOADS.
+#define S_OP(half, op, reg, n) \
+  p = jit_operand(p, half, 0x42, op, reg, 0x6b, -2*(n))
+#define S_LOAD(reg, n) S_OP(false, 0x0fb7, reg, n)
+#define S_LOADS(reg, n) S_OP(false, 0x0fbf, reg, n)
+#define S_STORE(reg, n) S_OP(true, 0x89, reg, n)
+#define S_SET(n, x) \
+  do { \
+    EMIT(0x66, 0x42, 0xc7, 0x44, 0x6b, (unsigned char)(-2*(n))); \
+    p = jit_u16(p, x); \
+  } while (0)
+// The double word in S(n) and S(n-1). Words are always read and written
+// one at a time, like the interpreter does, since reading a double word
+// just written as two words stalls the CPU.
+#define D_LOAD(reg, n) \
+  do { \
+    S_LOAD(reg, n); \
+    S_LOAD(ESI, (n) - 1); \
+    EMIT(0xc1, 0xe0 | (reg), 16, 0x09, 0xf0 | (reg));  /* shl 16, or esi */ \
+  } while (0)
+#define D_STORE(reg, n) \
+  do { \
+    S_STORE(reg, (n) - 1); \
+    EMIT(0xc1, 0xe8 | (reg), 16);  /* shr reg, 16 */ \
+    S_STORE(reg, n); \
+  } while (0)
+// Copies the double word in S(from) and S(from-1) to S(to) and S(to-1)
+#define D_COPY(from, to) \
+  do { \
+    S_LOAD(EAX, from); \
+    S_LOAD(ECX, (from) - 1); \
+    S_STORE(EAX, to); \
+    S_STORE(ECX, (to) - 1); \
+  } while (0)
+
+// Word n below the top of the return stack
+#define R_OP(half, op, reg, n) \
+  p = jit_operand(p, half, 0x43, op, reg, 0x7e, -2*(n))
+#define R_LOAD(reg, n) R_OP(false, 0x0fb7, reg, n)
+#define R_STORE(reg, n) R_OP(true, 0x89, reg, n)
+#define R_SET(n, x) \
+  do { \
+    EMIT(0x66, 0x43, 0xc7, 0x44, 0x7e, (unsigned char)(-2*(n))); \
+    p = jit_u16(p, x); \
+  } while (0)
+
+// Main memory at eax + k, or at a fixed address
+#define M_OP(half, op, reg, k) \
+  p = jit_operand(p, half, 0x41, op, reg, 0x44, 2*(k))
+#define M_LOAD(reg, k) M_OP(false, 0x0fb7, reg, k)
+#define M_STORE(reg, k) M_OP(true, 0x89, reg, k)
+#define A_LOAD(reg, address) p = jit_absolute(p, false, 0x0fb7, reg, address)
+#define A_STORE(reg, address) p = jit_absolute(p, true, 0x89, reg, address)
+
+// add r13d or r15d, k
+#define MOVE_DSP(k) EMIT(0x41, 0x83, 0xc5, (unsigned char)(k))
+#define MOVE_RSP(k) EMIT(0x41, 0x83, 0xc7, (unsigned char)(k))
+
+// The address of a LOAD or STORE in eax, for flag 1 from main memory and
+// otherwise from the free memory pointer
+#define ADDRESS_OF(flag) \
+  do { \
+    S_LOAD(EAX, 0); \
+    if (!((flag) & 1)) { \
+      EMIT(0x05); \
+      p = jit_u32(p, jit->fmp); \
+    } \
+  } while (0)
+
+// Leaves the block at pc after running count instructions. JIT_JUMP leaves
+// it by jumping to pc, and JIT_JUMP_EAX to the pc in eax.
+#define JIT_EXIT(count) \
+  do { \
+    EMIT(0xb9); \
+    p = jit_u32(p, count); \
+    EMIT(0xe9); \
+    p = jit_rel32(p, jit->text); \
+  } while (0)
+#define JIT_LEAVE(pc, count) \
+  do { \
+    EMIT(0xb8); \
+    p = jit_u32(p, (ADDRESS)(pc)); \
+    JIT_EXIT(count); \
+  } while (0)
+#define JIT_JUMP(pc, count) \
+  do { \
+    EMIT(0xb8); \
+    p = jit_u32(p, (ADDRESS)(pc) | JIT_JUMPED); \
+    JIT_EXIT(count); \
+  } while (0)
+#define JIT_JUMP_EAX(count) \
+  do { \
+    EMIT(0x0d);  /* or eax, JIT_JUMPED */ \
+    p = jit_u32(p, JIT_JUMPED); \
+    JIT_EXIT(count); \
+  } while (0)
+
+// Word ops on S1 and S0 in ecx and eax, leaving the result in S1. cc is the
+// setcc op code for comparisons.
+#define JIT_BINARY(load, ...) \
+  do { \
+    load(ECX, 1); \
+    load(EAX, 0); \
+    EMIT(__VA_ARGS__); \
+    S_STORE(ECX, 1); \
+    MOVE_DSP(-1); \
+  } while (0)
+#define JIT_COMPARE(load, cc) \
+  do { \
+    load(ECX, 1); \
+    load(EAX, 0); \
+    EMIT(0x39, 0xc1, 0x0f, cc, 0xc0, 0x0f, 0xb6, 0xc0); \
+    S_STORE(EAX, 1); \
+    MOVE_DSP(-1); \
+  } while (0)
+// Double word ops on D2 and D0, leaving the result in D2
+#define JIT_DBINARY(...) \
+  do { \
+    D_LOAD(ECX, 3); \
+    D_LOAD(EAX, 1); \
+    EMIT(__VA_ARGS__); \
+    D_STORE(ECX, 3); \
+    MOVE_DSP(-2); \
+  } while (0)
+#define JIT_DCOMPARE(cc) \
+  do { \
+    D_LOAD(ECX, 3); \
+    D_LOAD(EAX, 1); \
+    EMIT(0x39, 0xc1, 0x0f, cc, 0xc0, 0x0f, 0xb6, 0xc0); \
+    D_STORE(EAX, 3); \
+    MOVE_DSP(-2); \
+  } while (0)
+
+// Restores the machine registers a block uses and returns to jit_run, with
+// the next pc in eax and the number of instructions run in ecx. Every block
+// jumps here to leave.
+static unsigned char* jit_epilogue(unsigned char* p) {
+  EMIT(0x44, 0x89, 0x6d, 0x20,  // mov [rbp+32], r13d
+       0x44, 0x89, 0x7d, 0x24,  // mov [rbp+36], r15d
+       0x48, 0x29, 0x4d, 0x18,  // sub [rbp+24], rcx
+       0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c,  // pop r15 - r12
+       0x5d, 0x5b,  // pop rbp, rbx
+       0xc3);
+  return p;
+}
+
+static void jit_flush(JIT* jit) {
+  for (size_t i = 0; i < jit->block_count; i++) {
+    jit->blocks[jit->starts[i]] = NULL;
+    jit->counts[jit->starts[i]] = 0;
+  }
+  jit->block_count = 0;
+  jit->used = jit_epilogue(jit->text) - jit->text;
+}
+
+static JIT* jit_create(WORD* memory, INSTRUCTION* code, WORD* data_stack,
+                       WORD* return_stack) {
+  JIT* jit = (JIT*) calloc(1, sizeof(JIT));
+  if (jit == NULL)
+    return NULL;
+  jit->text = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->text == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+  jit->memory = memory;
+  jit->code = code;
+  jit->data_stack = data_stack;
+  jit->return_stack = return_stack;
+  jit_flush(jit);
+  return jit;
+}
+
+static void jit_destroy(JIT* jit) {
+  munmap(jit->text, JIT_CODE_SIZE);
+  free(jit);
+}
+
+// Drops every block and count, for a program of length bytes that has just
+// been decoded.
+static void jit_reset(JIT* jit, size_t length) {
+  if (jit == NULL)
+    return;
+  jit_flush(jit);
+  memset(jit->counts, 0, sizeof(jit->counts));
+  jit->bfp = length;
+  jit->fmp = length + BUFFER_SIZE;
+}
+
+// Drops the blocks compiled from memory from start up to end after it has
+// been written.
+static void jit_invalidate(JIT* jit, size_t start, size_t end) {
+  if (start >= jit->bfp)
+    return;
+  for (size_t i = 0; i < jit->block_count;) {
+    ADDRESS entry = jit->starts[i];
+    if (entry < end && start < jit->ends[entry]) {
+      jit->blocks[entry] = NULL;
+      jit->counts[entry] = 0;
+      jit->starts[i] = jit->starts[--jit->block_count];
+    } else {
+      i++;
     }
+  }
+}
 
-    // Switch to cover each opcode. It is too long, but for simplicity and
-    // efficiency it is kept this way, with larger operations calling
-    // functions. The functions for things like unpacking and packing
-    // double words are declared as inline so they will be more efficient.
-    // Larger functions for things like io operations are regular functions
-    // because they are not really hurt by the function call.
-    switch (memory[pc] & 0xff) {
-      case HALT:
-        run = false;
-        break;
+// Words each instruction takes up
+static inline ADDRESS jit_length(unsigned short op) {
+  switch (op) {
+    case DPUSH:
+      return 3;
+    case PUSH:
+    case LOADI:
+    case STOREI:
+    case DLOADI:
+    case DSTOREI:
+    case JUMPI:
+    case BRANCHI:
+    case CALLI:
+      return 2;
+    default:
+      return 1;
+  }
+}
 
+// Main memory addressed by a fused op
+static inline size_t jit_address(JIT* jit, INSTRUCTION* ins) {
+  ADDRESS address = ins->arg;
+  return ins->flag & 1 ? address : (size_t)jit->fmp + address;
+}
+
+// Compiles the code at entry into a block, or returns NULL if the first
+// instruction has no template.
+static JIT_BLOCK jit_compile(JIT* jit, ADDRESS entry) {
+  // Find where the block ends and how far it can move the stacks
+  int depth = 0, low = 0, high = 0;
+  int rdepth = 0, rlow = 0, rhigh = 0;
+  size_t ops = 0;
+  size_t pc = entry;
+  while (ops < JIT_BLOCK_OPS && pc < jit->bfp) {
+    INSTRUCTION* ins = &jit->code[pc];
+    const JIT_OP* op = &JIT_OPS[ins->op];
+    if (!op->compiles)
+      break;
+    if ((ins->op == STOREI || ins->op == DSTOREI)
+        && jit_address(jit, ins) < jit->bfp)
+      break;
+
+    if (depth - op->reach < low) low = depth - op->reach;
+    depth += op->moves;
+    if (depth < low) low = depth;
+    if (depth > high) high = depth;
+    if (rdepth - op->rreach < rlow) rlow = rdepth - op->rreach;
+    rdepth += op->rmoves;
+    if (rdepth < rlow) rlow = rdepth;
+    if (rdepth > rhigh) rhigh = rdepth;
+
+    ops++;
+    pc += jit_length(ins->op);
+    if (op->ends)
+      break;
+  }
+  if (!ops)
+    return NULL;
+
+  size_t size = JIT_BLOCK_BYTES + ops * JIT_OP_BYTES;
+  if (jit->used + size > JIT_CODE_SIZE)
+    jit_flush(jit);
+  unsigned char* start = jit->text + jit->used;
+  unsigned char* p = start;
+
+  // Save the machine registers the block uses and load the VM's into them
+  EMIT(0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+       0x48, 0x89, 0xfd,        // mov rbp, rdi
+       0x48, 0x8b, 0x5d, 0x00,  // mov rbx, [rbp]
+       0x4c, 0x8b, 0x65, 0x08,  // mov r12, [rbp+8]
+       0x4c, 0x8b, 0x75, 0x10,  // mov r14, [rbp+16]
+       0x44, 0x8b, 0x6d, 0x20,  // mov r13d, [rbp+32]
+       0x44, 0x8b, 0x7d, 0x24,  // mov r15d, [rbp+36]
+       0xeb, 30);               // jmp top
+
+  // Leaving without running anything, and leaving a loop that has used up
+  // its budget
+  unsigned char* none = p;
+  JIT_LEAVE(entry, 0);
+  unsigned char* spent = p;
+  JIT_JUMP(entry, 0);
+
+  // Check the stack registers before every pass through the block
+  unsigned char* top = p;
+  EMIT(0x41, 0x81, 0xfd);  // cmp r13d
+  p = jit_u32(p, -low);
+  EMIT(0x0f, 0x8c);  // jl
+  p = jit_rel32(p, none);
+  EMIT(0x41, 0x81, 0xfd);
+  p = jit_u32(p, END_STACK - high);
+  EMIT(0x0f, 0x8f);  // jg
+  p = jit_rel32(p, none);
+  EMIT(0x41, 0x81, 0xff);  // cmp r15d
+  p = jit_u32(p, -rlow);
+  EMIT(0x0f, 0x8c);
+  p = jit_rel32(p, none);
+  EMIT(0x41, 0x81, 0xff);
+  p = jit_u32(p, END_RETURN - rhigh);
+  EMIT(0x0f, 0x8f);
+  p = jit_rel32(p, none);
+
+  pc = entry;
+  unsigned short last = HALT;
+  for (size_t count = 0; count < ops; count++) {
+    INSTRUCTION* ins = &jit->code[pc];
+    last = ins->op;
+    ADDRESS target = ins->arg;
+    unsigned char* skip;
+    switch (ins->op) {
       /// Stack Manipulation ///
       case PUSH:
-        data_stack[++dsp] = memory[++pc];
+        S_SET(-1, ins->arg);
+        MOVE_DSP(1);
         break;
       case POP:
-        dsp--;
+        MOVE_DSP(-1);
         break;
       case LOAD:
-        if (memory[pc] >> BYTE_SIZE & 1)
-          data_stack[dsp] = memory[(ADDRESS)data_stack[dsp]];
-        else
-          data_stack[dsp] = memory[fmp + (ADDRESS)data_stack[dsp]];
+        ADDRESS_OF(ins->flag);
+        M_LOAD(ECX, 0);
+        S_STORE(ECX, 0);
         break;
       case STORE:
-        if (memory[pc] >> BYTE_SIZE & 1) {
-          memory[(ADDRESS)data_stack[dsp]] = data_stack[dsp-1];
-        } else {
-          memory[fmp + (ADDRESS)data_stack[dsp]] = data_stack[dsp-1];
-        }
-        dsp-=2;
+        ADDRESS_OF(ins->flag);
+        EMIT(0x3d);  // cmp eax, bfp
+        p = jit_u32(p, jit->bfp);
+        EMIT(0x73, 15);  // jae over leaving
+        JIT_LEAVE(pc, count);
+        S_LOAD(ECX, 1);
+        M_STORE(ECX, 0);
+        MOVE_DSP(-2);
         break;
       case FST:
-        data_stack[dsp+1] = data_stack[dsp];
-        dsp++;
+        S_LOAD(EAX, 0);
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
       case SEC:
-        data_stack[dsp+1] = data_stack[dsp-1];
-        dsp++;
-        break;
-      case NTH:
-        data_stack[dsp] = data_stack[dsp - data_stack[dsp] - 1];
+        S_LOAD(EAX, 1);
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
       case SWAP:
-        temp = data_stack[dsp];
-        data_stack[dsp] = data_stack[dsp-1];
-        data_stack[dsp-1] = temp;
+        S_LOAD(EAX, 0);
+        S_LOAD(ECX, 1);
+        S_STORE(ECX, 0);
+        S_STORE(EAX, 1);
         break;
       case ROT:
-        temp = data_stack[dsp-2];
-        data_stack[dsp-2] = data_stack[dsp-1];
-        data_stack[dsp-1] = data_stack[dsp];
-        data_stack[dsp] = temp;
+        S_LOAD(EAX, 2);
+        S_LOAD(ECX, 1);
+        S_LOAD(EDX, 0);
+        S_STORE(ECX, 2);
+        S_STORE(EDX, 1);
+        S_STORE(EAX, 0);
         break;
       case RPUSH:
-        return_stack[++rsp] = data_stack[dsp--];
+        S_LOAD(EAX, 0);
+        R_STORE(EAX, -1);
+        MOVE_RSP(1);
+        MOVE_DSP(-1);
         break;
       case RPOP:
-        data_stack[++dsp] = return_stack[rsp--];
+        R_LOAD(EAX, 0);
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
+        MOVE_RSP(-1);
         break;
       case RGRAB:
-        data_stack[++dsp] = return_stack[rsp];
+        R_LOAD(EAX, 0);
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
 
       /// Double Word Stack Manipulation ///
       case DPUSH:
-        data_stack[++dsp] = memory[++pc];
-        data_stack[++dsp] = memory[++pc];
+        S_SET(-1, ins->arg >> WORD_SIZE);
+        S_SET(-2, ins->arg);
+        MOVE_DSP(2);
         break;
       case DPOP:
-        dsp-=2;
+        MOVE_DSP(-2);
         break;
       case DLOAD:
-        atemp = data_stack[dsp--];
-        if (memory[pc] >> BYTE_SIZE & 1) {
-          data_stack[++dsp] = memory[atemp];
-          data_stack[++dsp] = memory[atemp + 1];
-        } else {
-          data_stack[++dsp] = memory[fmp + atemp];
-          data_stack[++dsp] = memory[fmp + atemp + 1];
-        }
+        ADDRESS_OF(ins->flag);
+        M_LOAD(ECX, 0);
+        M_LOAD(EDX, 1);
+        S_STORE(ECX, 0);
+        S_STORE(EDX, -1);
+        MOVE_DSP(1);
         break;
       case DSTORE:
-        atemp = data_stack[dsp--];
-        if (memory[pc] >> BYTE_SIZE & 1) {
-          memory[atemp] = data_stack[dsp-1];
-          memory[atemp + 1] = data_stack[dsp];
-        } else {
-          memory[fmp + atemp] = data_stack[dsp-1];
-          memory[fmp + atemp + 1] = data_stack[dsp];
-        }
-        dsp-=2;
+        ADDRESS_OF(ins->flag);
+        EMIT(0x3d);
+        p = jit_u32(p, jit->bfp);
+        EMIT(0x73, 15);
+        JIT_LEAVE(pc, count);
+        S_LOAD(ECX, 2);
+        M_STORE(ECX, 0);
+        S_LOAD(ECX, 1);
+        M_STORE(ECX, 1);
+        MOVE_DSP(-3);
         break;
       case DFST:
-        data_stack[dsp+1] = data_stack[dsp-1];
-        data_stack[dsp+2] = data_stack[dsp];
-        dsp+=2;
+        D_COPY(1, -1);
+        MOVE_DSP(2);
         break;
       case DSEC:
-        data_stack[dsp+1] = data_stack[dsp-3];
-        data_stack[dsp+2] = data_stack[dsp-2];
-        dsp+=2;
-        break;
-      case DNTH:
-        atemp = data_stack[dsp--] * 2;
-        data_stack[dsp+1] = data_stack[dsp - atemp - 1];
-        data_stack[dsp+2] = data_stack[dsp - atemp];
-        dsp+=2;
+        D_COPY(3, -1);
+        MOVE_DSP(2);
         break;
       case DSWAP:
-        temp = data_stack[dsp];
-        data_stack[dsp] = data_stack[dsp-2];
-        data_stack[dsp-2] = temp;
-
-        temp = data_stack[dsp-1];
-        data_stack[dsp-1] = data_stack[dsp-3];
-        data_stack[dsp-3] = temp;
+        S_LOAD(EAX, 3);
+        S_LOAD(ECX, 2);
+        S_LOAD(EDX, 1);
+        S_LOAD(ESI, 0);
+        S_STORE(EDX, 3);
+        S_STORE(ESI, 2);
+        S_STORE(EAX, 1);
+        S_STORE(ECX, 0);
         break;
       case DROT:
-        temp = data_stack[dsp-5];
-        data_stack[dsp-5] = data_stack[dsp-3];
-        data_stack[dsp-3] = data_stack[dsp-1];
-        data_stack[dsp-1] = temp;
-
-        temp = data_stack[dsp-4];
-        data_stack[dsp-4] = data_stack[dsp-2];
-        data_stack[dsp-2] = data_stack[dsp];
-        data_stack[dsp] = temp;
+        for (int n = 5; n >= 4; n--) {
+          S_LOAD(EAX, n);
+          S_LOAD(ECX, n - 2);
+          S_LOAD(EDX, n - 4);
+          S_STORE(ECX, n);
+          S_STORE(EDX, n - 2);
+          S_STORE(EAX, n - 4);
+        }
         break;
       case DRPUSH:
-        return_stack[++rsp] = data_stack[dsp-1];
-        return_stack[++rsp] = data_stack[dsp];
-        dsp-=2;
+        S_LOAD(EAX, 1);
+        S_LOAD(ECX, 0);
+        R_STORE(EAX, -1);
+        R_STORE(ECX, -2);
+        MOVE_RSP(2);
+        MOVE_DSP(-2);
         break;
       case DRPOP:
-        data_stack[++dsp] = return_stack[rsp-1];
-        data_stack[++dsp] = return_stack[rsp];
-        rsp-=2;
-        break;
       case DRGRAB:
-        data_stack[++dsp] = return_stack[rsp-1];
-        data_stack[++dsp] = return_stack[rsp];
+        R_LOAD(EAX, 1);
+        R_LOAD(ECX, 0);
+        S_STORE(EAX, -1);
+        S_STORE(ECX, -2);
+        MOVE_DSP(2);
+        if (ins->op == DRPOP)
+          MOVE_RSP(-2);
         break;
 
       /// Word Arithmetic ///
       case ADD:
-        data_stack[dsp-1] = data_stack[dsp-1] + data_stack[dsp];
-        dsp--;
+        JIT_BINARY(S_LOADS, 0x01, 0xc1);  // add ecx, eax
         break;
       case SUB:
-        data_stack[dsp-1] = data_stack[dsp-1] - data_stack[dsp];
-        dsp--;
+        JIT_BINARY(S_LOADS, 0x29, 0xc1);  // sub ecx, eax
         break;
       case MULT:
-        data_stack[dsp-1] = data_stack[dsp-1] * data_stack[dsp];
-        dsp--;
+        JIT_BINARY(S_LOADS, 0x0f, 0xaf, 0xc8);  // imul ecx, eax
         break;
       case DIV:
-        data_stack[dsp-1] = data_stack[dsp-1] / data_stack[dsp];
-        dsp--;
-        break;
       case MOD:
-        data_stack[dsp-1] = data_stack[dsp-1] % data_stack[dsp];
-        dsp--;
+        S_LOADS(EAX, 1);
+        S_LOADS(ECX, 0);
+        EMIT(0x99, 0xf7, 0xf9);  // cdq, idiv ecx
+        S_STORE(ins->op == DIV ? EAX : EDX, 1);
+        MOVE_DSP(-1);
         break;
 
       /// Signed Comparisson ///
       case EQ:
-        data_stack[dsp-1] = data_stack[dsp-1] == data_stack[dsp];
-        dsp--;
+        JIT_COMPARE(S_LOADS, 0x94);  // sete
         break;
       case LT:
-        data_stack[dsp-1] = data_stack[dsp-1] < data_stack[dsp];
-        dsp--;
+        JIT_COMPARE(S_LOADS, 0x9c);  // setl
         break;
       case GT:
-        data_stack[dsp-1] = data_stack[dsp-1] > data_stack[dsp];
-        dsp--;
+        JIT_COMPARE(S_LOADS, 0x9f);  // setg
         break;
 
       /// Unsigned Artihmetic and Comparisson ///
       case MULTU:
-        {
-          // large signed numbers cast to unsigned dword as 0xffff____
-          // so we have to zero those bits before the calculation 
-          DWORDU a = (DWORDU)data_stack[dsp-1] & 0xffff;
-          DWORDU b = (DWORDU)data_stack[dsp] & 0xffff;
-          DWORDU res = a * b;
-          data_stack[dsp-1] = res >> 16; 
-          data_stack[dsp] = res;
-        }
+        S_LOAD(EAX, 1);
+        S_LOAD(ECX, 0);
+        EMIT(0x0f, 0xaf, 0xc1);  // imul eax, ecx
+        S_STORE(EAX, 0);
+        EMIT(0xc1, 0xe8, 16);  // shr eax, 16
+        S_STORE(EAX, 1);
         break;
       case DIVU:
-        data_stack[dsp-1] = (WORDU)data_stack[dsp-1] / (WORDU)data_stack[dsp];
-        dsp--;
-        break;
       case MODU:
-        data_stack[dsp-1] = (WORDU)data_stack[dsp-1] % (WORDU)data_stack[dsp];
-        dsp--;
+        S_LOAD(EAX, 1);
+        S_LOAD(ECX, 0);
+        EMIT(0x31, 0xd2, 0xf7, 0xf1);  // xor edx, edx, div ecx
+        S_STORE(ins->op == DIVU ? EAX : EDX, 1);
+        MOVE_DSP(-1);
         break;
       case LTU:
-        data_stack[dsp-1] = (WORDU)data_stack[dsp-1] < (WORDU)data_stack[dsp];
-        dsp--;
+        JIT_COMPARE(S_LOAD, 0x92);  // setb
         break;
       case GTU:
-        data_stack[dsp-1] = (WORDU)data_stack[dsp-1] > (WORDU)data_stack[dsp];
-        dsp--;
+        JIT_COMPARE(S_LOAD, 0x97);  // seta
         break;
 
       /// Double Arithmetic and Comparisson ///
       case DADD:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     + get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DBINARY(0x01, 0xc1);
         break;
       case DSUB:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     - get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DBINARY(0x29, 0xc1);
         break;
       case DMULT:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     * get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DBINARY(0x0f, 0xaf, 0xc8);
         break;
       case DDIV:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     / get_dword(data_stack, dsp-1));
-        dsp-=2;
-        break;
       case DMOD:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     % get_dword(data_stack, dsp-1));
-        dsp-=2;
+      case DDIVU:
+      case DMODU:
+        D_LOAD(EAX, 3);
+        D_LOAD(ECX, 1);
+        if (ins->op == DDIV || ins->op == DMOD)
+          EMIT(0x99, 0xf7, 0xf9);  // cdq, idiv ecx
+        else
+          EMIT(0x31, 0xd2, 0xf7, 0xf1);  // xor edx, edx, div ecx
+        D_STORE(ins->op == DDIV || ins->op == DDIVU ? EAX : EDX, 3);
+        MOVE_DSP(-2);
         break;
       case DEQ:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     == get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DCOMPARE(0x94);
         break;
       case DLT:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     < get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DCOMPARE(0x9c);
         break;
       case DGT:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     > get_dword(data_stack, dsp-1));
-        dsp-=2;
-        break;
-
-      /// Unsigned Double Arithmetic and Comparisson ///
-      case DDIVU:
-        set_dword(data_stack, dsp-3, (DWORDU)get_dword(data_stack, dsp-3)
-                                     / (DWORDU)get_dword(data_stack, dsp-1));
-        dsp-=2;
-        break;
-      case DMODU:
-        set_dword(data_stack, dsp-3, (DWORDU)get_dword(data_stack, dsp-3)
-                                     % (DWORDU)get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DCOMPARE(0x9f);
         break;
       case DLTU:
-        set_dword(data_stack, dsp-3, (DWORDU)get_dword(data_stack, dsp-3)
-                                     < (DWORDU)get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DCOMPARE(0x92);
         break;
       case DGTU:
-        set_dword(data_stack, dsp-3, (DWORDU)get_dword(data_stack, dsp-3)
-                                     > (DWORDU)get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DCOMPARE(0x97);
         break;
 
       /// Bitwise words ///
       case SL:
-        data_stack[dsp-1] = data_stack[dsp-1] << data_stack[dsp];
-        dsp--;
+        S_LOAD(EAX, 1);
+        S_LOADS(ECX, 0);
+        EMIT(0xd3, 0xe0);  // shl eax, cl
+        S_STORE(EAX, 1);
+        MOVE_DSP(-1);
         break;
       case SR:
-        data_stack[dsp-1] = data_stack[dsp-1] >> data_stack[dsp];
-        dsp--;
+        S_LOADS(EAX, 1);
+        S_LOADS(ECX, 0);
+        EMIT(0xd3, 0xf8);  // sar eax, cl
+        S_STORE(EAX, 1);
+        MOVE_DSP(-1);
         break;
       case AND:
-        data_stack[dsp-1] = data_stack[dsp-1] & data_stack[dsp];
-        dsp--;
+        JIT_BINARY(S_LOAD, 0x21, 0xc1);
         break;
       case OR:
-        data_stack[dsp-1] = data_stack[dsp-1] | data_stack[dsp];
-        dsp--;
+        JIT_BINARY(S_LOAD, 0x09, 0xc1);
         break;
       case NOT:
-        data_stack[dsp] = ~data_stack[dsp];
+        S_LOAD(EAX, 0);
+        EMIT(0xf7, 0xd0);  // not eax
+        S_STORE(EAX, 0);
         break;
 
       /// Bitwise double words ///
       case DSL:
-        set_dword(data_stack, dsp-2, get_dword(data_stack, dsp-2)
-                                     << data_stack[dsp]);
-        dsp--;
-        break;
       case DSR:
-        set_dword(data_stack, dsp-2, get_dword(data_stack, dsp-2)
-                                     >> data_stack[dsp]);
-        dsp--;
+        D_LOAD(EAX, 2);
+        S_LOADS(ECX, 0);
+        if (ins->op == DSL)
+          EMIT(0xd3, 0xe0);
+        else
+          EMIT(0xd3, 0xf8);
+        D_STORE(EAX, 2);
+        MOVE_DSP(-1);
         break;
       case DAND:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     & get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DBINARY(0x21, 0xc1);
         break;
       case DOR:
-        set_dword(data_stack, dsp-3, get_dword(data_stack, dsp-3)
-                                     | get_dword(data_stack, dsp-1));
-        dsp-=2;
+        JIT_DBINARY(0x09, 0xc1);
         break;
       case DNOT:
-        set_dword(data_stack, dsp-1, ~get_dword(data_stack, dsp-1));
+        D_LOAD(EAX, 1);
+        EMIT(0xf7, 0xd0);
+        D_STORE(EAX, 1);
         break;
 
       /// Movement ///
       case JUMP:
-        pc = data_stack[dsp--];
-        continue;
+        S_LOAD(EAX, 0);
+        MOVE_DSP(-1);
+        JIT_JUMP_EAX(count + 1);
+        break;
       case BRANCH:
-        atemp = data_stack[dsp--];
-        temp = data_stack[dsp--];
-        if (temp) {
-          pc = atemp;
-          continue;
-        }
+        S_LOAD(EAX, 0);
+        S_LOADS(ECX, 1);
+        MOVE_DSP(-2);
+        EMIT(0x85, 0xc9, 0x74, 0);  // test ecx, ecx, jz past the jump
+        skip = p;
+        JIT_JUMP_EAX(count + 1);
+        skip[-1] = p - skip;
         break;
       case CALL:
-        return_stack[++rsp] = pc + 1;
-        pc = data_stack[dsp--];
-        continue;
+        S_LOAD(EAX, 0);
+        MOVE_DSP(-1);
+        R_SET(-1, pc + 1);
+        MOVE_RSP(1);
+        JIT_JUMP_EAX(count + 1);
+        break;
       case RET:
-        pc = return_stack[rsp--];
-        continue;
+        R_LOAD(EAX, 0);
+        MOVE_RSP(-1);
+        JIT_JUMP_EAX(count + 1);
+        break;
       case DSP:
-        data_stack[dsp+1] = dsp;
-        dsp++;
+        EMIT(0x44, 0x89, 0xe8);  // mov eax, r13d
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
       case PC:
-        data_stack[++dsp] = pc;
+        S_SET(-1, pc);
+        MOVE_DSP(1);
         break;
       case BFP:
-        data_stack[++dsp] = bfp;
+        S_SET(-1, jit->bfp);
+        MOVE_DSP(1);
         break;
       case FMP:
-        data_stack[++dsp] = fmp;
+        S_SET(-1, jit->fmp);
+        MOVE_DSP(1);
         break;
 
-      /// Number Printing ///
-      case WPRN:
-        printf("%hd", data_stack[dsp--]);
-        break;
-      case DPRN:
-        printf("%d", get_dword(data_stack, dsp-1));
-        dsp-=2;
-        break;
-      case WPRNU:
-        printf("%hu", data_stack[dsp--]);
+      /// Bytes ///
+      case HIGH:
+        S_LOAD(EAX, 0);
+        EMIT(0xc1, 0xe8, BYTE_SIZE);  // shr eax, 8
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
-      case DPRNU:
-        printf("%u", get_dword(data_stack, dsp-1));
-        dsp-=2;
+      case LOW:
+        S_LOAD(EAX, 0);
+        EMIT(0x25, 0xff, 0, 0, 0);  // and eax, 0xff
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
         break;
-      case FPRN:
-        printf("%.3lf", (double)get_dword(data_stack, dsp-1)
-                        / SCALES[ DEFAULT_SCALE ]);
-        dsp-=2;
+      case UNPACK:
+        S_LOAD(EAX, 0);
+        EMIT(0x89, 0xc1, 0xc1, 0xe9, BYTE_SIZE);  // mov ecx, eax, shr ecx, 8
+        EMIT(0x25, 0xff, 0, 0, 0);
+        S_STORE(ECX, -1);
+        S_STORE(EAX, -2);
+        MOVE_DSP(2);
         break;
-      case FPRNSC:
-        temp = data_stack[dsp--];
-        if (temp && temp < SCALE_MAX) {
-          dtemp = SCALES[temp];
+      case PACK:
+        S_LOAD(EAX, 0);
+        S_LOAD(ECX, 1);
+        EMIT(0xc1, 0xe1, BYTE_SIZE, 0x09, 0xc8);  // shl ecx, 8, or eax, ecx
+        S_STORE(EAX, 1);
+        MOVE_DSP(-1);
+        break;
+
+      /// Fused ops ///
+      case LOADI:
+        A_LOAD(EAX, jit_address(jit, ins));
+        S_STORE(EAX, -1);
+        MOVE_DSP(1);
+        break;
+      case STOREI:
+        S_LOAD(EAX, 0);
+        A_STORE(EAX, jit_address(jit, ins));
+        MOVE_DSP(-1);
+        break;
+      case DLOADI:
+        A_LOAD(EAX, jit_address(jit, ins));
+        A_LOAD(ECX, jit_address(jit, ins) + 1);
+        S_STORE(EAX, -1);
+        S_STORE(ECX, -2);
+        MOVE_DSP(2);
+        break;
+      case DSTOREI:
+        S_LOAD(EAX, 1);
+        A_STORE(EAX, jit_address(jit, ins));
+        S_LOAD(EAX, 0);
+        A_STORE(EAX, jit_address(jit, ins) + 1);
+        MOVE_DSP(-2);
+        break;
+      case JUMPI:
+      case BRANCHI:
+        skip = NULL;
+        if (ins->op == BRANCHI) {
+          S_LOADS(ECX, 0);
+          MOVE_DSP(-1);
+          EMIT(0x85, 0xc9, 0x74, 0);
+          skip = p;
+        }
+        if (target == entry) {
+          // Loop without leaving until the budget runs out
+          EMIT(0x48, 0x81, 0x6d, 0x18);  // sub qword [rbp+24], count
+          p = jit_u32(p, count + 1);
+          EMIT(0x0f, 0x8e);  // jle
+          p = jit_rel32(p, spent);
+          EMIT(0xe9);
+          p = jit_rel32(p, top);
         } else {
-          dtemp = SCALES[ DEFAULT_SCALE ];
-          temp = DEFAULT_SCALE;
+          JIT_JUMP(target, count + 1);
         }
-        printf("%.*lf", temp, (double)get_dword(data_stack, dsp-1) / dtemp);
-        dsp-=2;
-        break;
-
-      /// Char and String printing ///
-      case PRNCH:
-        printf("%c", data_stack[dsp--] & 0xff);
-        break;
-      case PRNPK:
-        temp = data_stack[dsp--];
-        printf("%c", temp & 0xff);
-        printf("%c", (temp >> BYTE_SIZE) & 0xff);
+        if (skip != NULL)
+          skip[-1] = p - skip;
         break;
-      case PRN:
-        // Print from bfp to first null or buffer end
-        print_string(memory, bfp, fmp);
+      case CALLI:
+        R_SET(-1, pc + 2);
+        MOVE_RSP(1);
+        JIT_JUMP(target, count + 1);
         break;
-      case PRNLN:
-        // Print from bfp to first null or buffer end with a newline
-        print_string(memory, bfp, fmp);
-        printf("\n");
+      case DINCR:
+        D_LOAD(EAX, 1);
+        EMIT(0x83, 0xc0, 1);  // add eax, 1
+        D_STORE(EAX, 1);
         break;
-      case PRNMEM:
-        atemp = data_stack[dsp--];
-        if (memory[pc] >> BYTE_SIZE & 1) {
-          print_string(memory, atemp, END_MEMORY);
-        } else {
-          print_string(memory, fmp + atemp, END_MEMORY);
-        } 
+      case NIP:
+        S_LOAD(EAX, 0);
+        S_STORE(EAX, 1);
+        MOVE_DSP(-1);
         break;
+    }
+    pc += jit_length(ins->op);
+  }
+  // Straight line code that stops before an op with no template
+  if (!JIT_OPS[last].ends)
+    JIT_LEAVE(pc, ops);
+
+  jit->used += p - start;
+  jit->blocks[entry] = (JIT_BLOCK)start;
+  jit->ends[entry] = pc;
+  jit->starts[jit->block_count++] = entry;
+  return jit->blocks[entry];
+}
 
-      /// Reading ///
-      case WREAD:
-        scanf("%hd", &temp);
-        data_stack[++dsp] = temp;
-        break;
-      case DREAD:
-        scanf("%d", &dtemp);
-        set_dword(data_stack, dsp + 1, dtemp);
-        dsp+=2;
-        break;
-      case FREAD:
+// True if there is a block for pc, compiling one if pc has been jumped to
+// often enough.
+static inline bool jit_hot(JIT* jit, ADDRESS pc) {
+  if (jit->blocks[pc] != NULL)
+    return true;
+  if (jit->counts[pc] >= LT64_JIT_THRESHOLD)  // it could not be compiled
+    return false;
+  if (++jit->counts[pc] < LT64_JIT_THRESHOLD)
+    return false;
+  return jit_compile(jit, pc) != NULL;
+}
+
+// Runs blocks from pc for as long as each one jumps to another, with fuel
+// left to run it. Leaves pc where the interpreter goes on from and returns
+// true if the last block to run left by jumping, so the budget is checked
+// in the same places as in the interpreter.
+static bool jit_run(JIT* jit, ADDRESS* pc, ADDRESS* dsp, ADDRESS* rsp,
+                    long long* fuel) {
+  JIT_REGS regs = {
+    jit->data_stack, jit->memory, jit->return_stack, *fuel, *dsp, *rsp
+  };
+  bool jumped = false;
+  while (jit_hot(jit, *pc)) {
+    long long before = regs.fuel;
+    unsigned int next = jit->blocks[*pc](&regs);
+    if (regs.fuel == before)
+      break;
+    *pc = next;
+    jumped = next & JIT_JUMPED;
+    if (!jumped || regs.fuel <= 0)
+      break;
+  }
+  *dsp = regs.dsp;
+  *rsp = regs.rsp;
+  *fuel = regs.fuel;
+  return jumped;
+}
+
+#undef EMIT
+
+  // Called by the interpreter after every jump
+  #define JIT_ENTER() \
+    if (JITTING && jit_hot(vm->jit, pc)) { \
+      SPILL(); \
+      bool jumped = jit_run(vm->jit, &pc, &dsp, &rsp, &fuel); \
+      FILL(); \
+      if (jumped) \
+        CHECK_FUEL(); \
+    }
+  #define JIT_INVALIDATE(start, end) \
+    if (JITTING) jit_invalidate(vm->jit, (start), (end))
+#else
+  #define JIT_ENTER()
+  #define JIT_INVALIDATE(start, end)
+#endif
+
+/// ltrun.c //////////////////////////////////////////////////////////////////
+// Catch some common pointer/address errors. Returns the exit code for the
+// first error found, or 0 if the registers are all in bounds.
+static inline size_t check_registers(ADDRESS pc, ADDRESS bfp,
+                                     ADDRESS dsp, ADDRESS rsp) {
+  if (pc >= bfp) {
+    fprintf(stderr,
+            "Error: program counter out of bounds, pc: %hx, bfp: %hx\n",
+            pc, bfp);
+    return EXIT_POB;
+  } else if (dsp > 0x8000) {  // i.e. it has wrapped around into negatives
+    fprintf(stderr, "Error: stack underflow, sp: %hx (%hd)\n", dsp, dsp);
+    return EXIT_SUF;
+  } else if (dsp > END_STACK) {
+    fprintf(stderr, "Error: stack overflow, sp: %hx (%hd)\n", dsp, dsp);
+    return EXIT_SOF;
+  } else if (rsp > 0x8000) {  // i.e. it has wrapped around into negatives
+    fprintf(stderr, "Error: return stack underflow, sp: %hx (%hd)\n",
+            rsp, rsp);
+    return EXIT_RSUF;
+  } else if (rsp > END_RETURN) {
+    fprintf(stderr, "Error: return stack overflow, sp: %hx (%hd)\n",
+            rsp, rsp);
+    return EXIT_RSOF;
+  }
+  return 0;
+}
+
+// Work done before every instruction. Count it against the run's budget,
+// print stack, op code, and pc when debugging, count it when profiling, and
+// make sure the registers are still in bounds.
+#define PRE_DISPATCH() \
+  do { \
+    fuel--; \
+    PROFILE_STEP(); \
+    if (DEBUGGING) { \
+      SPILL(); \
+      debug_steps = debug_step(io, debug_steps); \
+      debug_info_display(io, data_stack, return_stack, dsp, rsp, pc, \
+                         memory[pc] & 0xff); \
+    } \
+    if (CHECK_ALWAYS && !verified \
+        && (error = check_registers(pc, bfp, dsp, rsp))) \
+      goto stop; \
+  } while (0)
+
+// Checks for the fast engine, which only checks the registers a handler
+// changes. pc does not need checking, running past the program dispatches
+// to OUT_OF_BOUNDS. Any failure goes through check_registers with the
+// registers the next instruction would have seen, so the error reported is
+// the same as when checking before every instruction.
+// dsp > END_STACK also covers underflow, since it wraps around to 0xffff.
+// A verified program skips them, see VERIFIED.
+#define CHECK_DSP() \
+  if (!CHECK_ALWAYS && !verified && dsp > END_STACK) goto next_registers_error
+#define CHECK_RSP() \
+  if (!CHECK_ALWAYS && !verified && rsp > END_RETURN) \
+    goto next_registers_error
+#define CHECK_JUMP() \
+  if (!CHECK_ALWAYS && !verified && (dsp > END_STACK || rsp > END_RETURN)) \
+    goto registers_error
+
+// Stops the run once it has used its budget. It is only checked where
+// control jumps, so straight line code just counts down fuel, and a run can
+// go past its budget by the instructions up to the next jump.
+#define CHECK_FUEL() \
+  if (fuel <= 0) { \
+    error = LT64_BUDGET; \
+    goto stop; \
+  }
+
+// Redecodes memory written from start up to end, and drops anything the JIT
+// compiled from it. Code that writes its own code was not verified, so it
+// goes back to checking for the rest of the program's runs.
+#define INVALIDATE(start, end) \
+  do { \
+    invalidate(memory, code, (start), (end), bfp); \
+    JIT_INVALIDATE((start), (end)); \
+    if (verified && writes_code((start), (end), code_start, bfp)) \
+      verified = vm->verified = false; \
+  } while (0)
+
+// Data stack access for the handlers. S0 and S1 are the top two words and
+// S(n) is the word n below the top. D0 is the double word in S1 and S0, D1
+// the one in S(2) and S1, and D2 the one in S(3) and S(2). BINARY replaces
+// the top two words with one, and DRESULT drops k words and then replaces
+// the top double word.
+//
+// The cached engine (-DLT64_TOS) keeps S0 in a local, so pushing and
+// popping only touch data_stack for the word going under it, and most ops
+// that consume the top of the stack do not touch data_stack for it at all.
+// While it is cached the top slot in data_stack is stale. Anything that
+// reads data_stack directly has to SPILL first, and FILL after if it moved
+// dsp or changed the top of the stack. Its indexes wrap to an ADDRESS, so
+// the data stack is given every address rather than reading outside of it
+// when popping from an empty stack.
+#ifdef LT64_TOS
+  #define S0 tos
+  #define S1 S(1)
+  #define S(n) data_stack[(ADDRESS)(dsp - (n))]
+  #define D0 ((S1 << WORD_SIZE) | (tos & 0xffff))
+  #define D1 ((S(2) << WORD_SIZE) | (S1 & 0xffff))
+  #define D2 ((S(3) << WORD_SIZE) | (S(2) & 0xffff))
+  #define PUSH_DS(x) \
+    do { \
+      WORD pushed = (x); \
+      data_stack[dsp] = tos; \
+      tos = pushed; \
+      dsp++; \
+    } while (0)
+  #define DROP1 (tos = S(1), dsp--)
+  #define DROP2 (tos = S(2), dsp-=2)
+  #define POP_DS() (popped = tos, DROP1, popped)
+  #define BINARY(x) \
+    do { \
+      tos = (x); \
+      dsp--; \
+    } while (0)
+  #define DRESULT(k, x) \
+    do { \
+      DWORD result = (x); \
+      dsp-=(k); \
+      S(1) = result >> WORD_SIZE; \
+      tos = result; \
+    } while (0)
+  #define SPILL() data_stack[dsp] = tos
+  #define FILL() tos = data_stack[dsp]
+#else
+  #define S0 data_stack[dsp]
+  #define S1 data_stack[dsp-1]
+  #define S(n) data_stack[dsp-(n)]
+  #define D0 get_dword(data_stack, dsp-1)
+  #define D1 get_dword(data_stack, dsp-2)
+  #define D2 get_dword(data_stack, dsp-3)
+  #define PUSH_DS(x) \
+    do { \
+      data_stack[dsp+1] = (x); \
+      dsp++; \
+    } while (0)
+  #define DROP1 (dsp--)
+  #define DROP2 (dsp-=2)
+  #define POP_DS() data_stack[dsp--]
+  #define BINARY(x) \
+    do { \
+      data_stack[dsp-1] = (x); \
+      dsp--; \
+    } while (0)
+  #define DRESULT(k, x) \
+    do { \
+      set_dword(data_stack, dsp-1-(k), (x)); \
+      dsp-=(k); \
+    } while (0)
+  #define SPILL()
+  #define FILL()
+#endif
+
+// Handlers are written with these so the same code builds either engine.
+// The portable engine is a switch in a loop. The threaded engine
+// (-DLT64_THREADED, needs GCC or Clang labels as values) only uses the
+// switch for the first instruction. After that every handler jumps
+// straight to the next one through dispatch_table, so each op gets its
+// own indirect branch and the loop and switch range check go away.
+#ifdef LT64_THREADED
+  #define OP(name) case name: op_##name
+  #define BAD_OP default: op_BAD
+  #define DISPATCH() \
+    do { \
+      PRE_DISPATCH(); \
+      goto *dispatch_table[code[pc].op]; \
+    } while (0)
+  #define NEXT pc++; DISPATCH()
+  #define JUMP_NEXT CHECK_FUEL(); JIT_ENTER(); DISPATCH()
+#else
+  #define OP(name) case name
+  #define BAD_OP default
+  #define NEXT break
+  #define JUMP_NEXT CHECK_FUEL(); JIT_ENTER(); continue
+#endif
+
+// Everything a program needs to run. Its registers are kept here between
+// runs, so a run that stops at its budget can be picked up again later.
+struct lt64_vm {
+  WORD* memory;
+  INSTRUCTION* code;
+  WORD* data_stack;
+  WORD* return_stack;
+  size_t length;
+  ADDRESS dsp, rsp, pc;
+  size_t steps;
+  bool owns_memory;
+  bool verified;  // runs without checks until it writes its own code
+  LT64_IO io;
+#ifdef LT64_JIT
+  JIT* jit;
+#endif
+};
+
+// Runs the loaded program from its saved registers for at most budget
+// instructions, or until it stops when budget is 0.
+size_t lt64_run(LT64_VM* vm, size_t budget) {
+  WORD* memory = vm->memory;
+  INSTRUCTION* code = vm->code;
+  WORD* data_stack = vm->data_stack;
+  WORD* return_stack = vm->return_stack;
+  LT64_IO* io = &vm->io;
+  ADDRESS dsp = vm->dsp, rsp = vm->rsp, pc = vm->pc;
+  long long start_fuel = budget && budget < LLONG_MAX ? budget : LLONG_MAX;
+  long long fuel = start_fuel;
+
+  // Declare and initialize memory pointer "registers"
+  ADDRESS bfp, fmp;
+  bfp = vm->length;
+  fmp = vm->length + BUFFER_SIZE;
+
+  // A verified program runs without checks until it writes into its code,
+  // which starts where the jump over the static data goes
+  bool verified = VERIFIED && vm->verified;
+  ADDRESS code_start = memory[1];
+  (void)code_start;
+
+  // Declare some temporary "registers" for working with intermediate values
+  ADDRESS atemp;
+  WORD temp = 0;
+  WORDU utemp;
+  DWORD dtemp = 0;
+  // Not every one is used when the handlers are cut down to a program's ops
+  (void)atemp; (void)temp; (void)utemp; (void)dtemp;
+#ifdef LT64_TOS
+  WORD tos = data_stack[dsp], popped;
+#endif
+
+#ifdef LT64_THREADED
+  // Every op starts out bad and the real ones override it
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Woverride-init"
+  static void* const dispatch_table[OUT_OF_BOUNDS + 1] = {
+    [0 ... OUT_OF_BOUNDS - 1] = &&op_BAD,
+    [HALT] = &&op_HALT,
+    [PUSH] = &&op_PUSH, [POP] = &&op_POP,
+    [LOAD] = &&op_LOAD, [STORE] = &&op_STORE,
+    [FST] = &&op_FST, [SEC] = &&op_SEC, [NTH] = &&op_NTH,
+    [SWAP] = &&op_SWAP, [ROT] = &&op_ROT,
+    [RPUSH] = &&op_RPUSH, [RPOP] = &&op_RPOP, [RGRAB] = &&op_RGRAB,
+
+    [DPUSH] = &&op_DPUSH, [DPOP] = &&op_DPOP,
+    [DLOAD] = &&op_DLOAD, [DSTORE] = &&op_DSTORE,
+    [DFST] = &&op_DFST, [DSEC] = &&op_DSEC, [DNTH] = &&op_DNTH,
+    [DSWAP] = &&op_DSWAP, [DROT] = &&op_DROT,
+    [DRPUSH] = &&op_DRPUSH, [DRPOP] = &&op_DRPOP, [DRGRAB] = &&op_DRGRAB,
+
+    [ADD] = &&op_ADD, [SUB] = &&op_SUB, [MULT] = &&op_MULT,
+    [DIV] = &&op_DIV, [MOD] = &&op_MOD,
+    [EQ] = &&op_EQ, [LT] = &&op_LT, [GT] = &&op_GT,
+    [MULTU] = &&op_MULTU, [DIVU] = &&op_DIVU, [MODU] = &&op_MODU,
+    [LTU] = &&op_LTU, [GTU] = &&op_GTU,
+
+    [SL] = &&op_SL, [SR] = &&op_SR,
+    [AND] = &&op_AND, [OR] = &&op_OR, [NOT] = &&op_NOT,
+
+    [DADD] = &&op_DADD, [DSUB] = &&op_DSUB, [DMULT] = &&op_DMULT,
+    [DDIV] = &&op_DDIV, [DMOD] = &&op_DMOD,
+    [DEQ] = &&op_DEQ, [DLT] = &&op_DLT, [DGT] = &&op_DGT,
+    [DDIVU] = &&op_DDIVU, [DMODU] = &&op_DMODU,
+    [DLTU] = &&op_DLTU, [DGTU] = &&op_DGTU,
+
+    [DSL] = &&op_DSL, [DSR] = &&op_DSR,
+    [DAND] = &&op_DAND, [DOR] = &&op_DOR, [DNOT] = &&op_DNOT,
+
+    [JUMP] = &&op_JUMP, [BRANCH] = &&op_BRANCH,
+    [CALL] = &&op_CALL, [RET] = &&op_RET,
+    [DSP] = &&op_DSP, [PC] = &&op_PC, [BFP] = &&op_BFP, [FMP] = &&op_FMP,
+
+    [WPRN] = &&op_WPRN, [DPRN] = &&op_DPRN,
+    [WPRNU] = &&op_WPRNU, [DPRNU] = &&op_DPRNU,
+    [FPRN] = &&op_FPRN, [FPRNSC] = &&op_FPRNSC,
+    [PRNCH] = &&op_PRNCH, [PRN] = &&op_PRN, [PRNLN] = &&op_PRNLN,
+    [PRNMEM] = &&op_PRNMEM,
+
+    [WREAD] = &&op_WREAD, [DREAD] = &&op_DREAD,
+    [FREAD] = &&op_FREAD, [FREADSC] = &&op_FREADSC,
+    [READCH] = &&op_READCH, [READLN] = &&op_READLN,
+
+    [BFSTORE] = &&op_BFSTORE, [BFLOAD] = &&op_BFLOAD,
+    [HIGH] = &&op_HIGH, [LOW] = &&op_LOW,
+    [UNPACK] = &&op_UNPACK, [PACK] = &&op_PACK,
+
+    [MEMCOPY] = &&op_MEMCOPY, [STRCOPY] = &&op_STRCOPY,
+    [FMULT] = &&op_FMULT, [FDIV] = &&op_FDIV,
+    [FMULTSC] = &&op_FMULTSC, [FDIVSC] = &&op_FDIVSC,
+
+    [PRNPK] = &&op_PRNPK,
+
+    [LOADI] = &&op_LOADI, [STOREI] = &&op_STOREI,
+    [DLOADI] = &&op_DLOADI, [DSTOREI] = &&op_DSTOREI,
+    [JUMPI] = &&op_JUMPI, [BRANCHI] = &&op_BRANCHI, [CALLI] = &&op_CALLI,
+    [DINCR] = &&op_DINCR, [NIP] = &&op_NIP,
+    [SNAPSHOT] = &&op_SNAPSHOT,
+
+    [OUT_OF_BOUNDS] = &&op_OUT_OF_BOUNDS,
+  };
+  #pragma GCC diagnostic pop
+#endif
+
+  // Run the program in memory
+  size_t debug_steps = 3;
+  size_t error;
+  for (;;) {
+    PRE_DISPATCH();
+
+    // Switch to cover each opcode. It is too long, but for simplicity and
+    // efficiency it is kept this way, with larger operations calling
+    // functions. The functions for things like unpacking and packing
+    // double words are declared as inline so they will be more efficient.
+    // Larger functions for things like io operations are regular functions
+    // because they are not really hurt by the function call.
+    switch (code[pc].op) {
+      OP(HALT):
+        goto halt;
+
+      /// Stack Manipulation ///
+      OP(PUSH):
+        PUSH_DS(code[pc++].arg);
+        CHECK_DSP();
+        NEXT;
+      OP(POP):
+        DROP1;
+        CHECK_DSP();
+        NEXT;
+      OP(LOAD):
+        if (code[pc].flag & 1)
+          S0 = memory[(ADDRESS)S0];
+        else
+          S0 = memory[fmp + (ADDRESS)S0];
+        NEXT;
+      OP(STORE):
+        atemp = S0;
+        if (code[pc].flag & 1) {
+          memory[atemp] = S1;
+          INVALIDATE(atemp, atemp + 1);
+        } else {
+          memory[fmp + atemp] = S1;
+          INVALIDATE(fmp + atemp, fmp + atemp + 1);
+        }
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(FST):
+        PUSH_DS(S0);
+        CHECK_DSP();
+        NEXT;
+      OP(SEC):
+        PUSH_DS(S1);
+        CHECK_DSP();
+        NEXT;
+      OP(NTH):
+        SPILL();
+        data_stack[dsp] = data_stack[dsp - data_stack[dsp] - 1];
+        FILL();
+        NEXT;
+      OP(SWAP):
+        temp = S0;
+        S0 = S1;
+        S1 = temp;
+        NEXT;
+      OP(ROT):
+        temp = S(2);
+        S(2) = S1;
+        S1 = S0;
+        S0 = temp;
+        NEXT;
+      OP(RPUSH):
+        return_stack[++rsp] = POP_DS();
+        CHECK_DSP();
+        CHECK_RSP();
+        NEXT;
+      OP(RPOP):
+        PUSH_DS(return_stack[rsp--]);
+        CHECK_DSP();
+        CHECK_RSP();
+        NEXT;
+      OP(RGRAB):
+        PUSH_DS(return_stack[rsp]);
+        CHECK_DSP();
+        NEXT;
+
+      /// Double Word Stack Manipulation ///
+      OP(DPUSH):
+        PUSH_DS(code[pc].arg >> WORD_SIZE);
+        PUSH_DS(code[pc].arg);
+        pc+=2;
+        CHECK_DSP();
+        NEXT;
+      OP(DPOP):
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(DLOAD):
+        atemp = POP_DS();
+        if (code[pc].flag & 1) {
+          PUSH_DS(memory[atemp]);
+          PUSH_DS(memory[atemp + 1]);
+        } else {
+          PUSH_DS(memory[fmp + atemp]);
+          PUSH_DS(memory[fmp + atemp + 1]);
+        }
+        CHECK_DSP();
+        NEXT;
+      OP(DSTORE):
+        atemp = POP_DS();
+        if (code[pc].flag & 1) {
+          memory[atemp] = S1;
+          memory[atemp + 1] = S0;
+          INVALIDATE(atemp, atemp + 2);
+        } else {
+          memory[fmp + atemp] = S1;
+          memory[fmp + atemp + 1] = S0;
+          INVALIDATE(fmp + atemp, fmp + atemp + 2);
+        }
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(DFST):
+        PUSH_DS(S1);
+        PUSH_DS(S1);
+        CHECK_DSP();
+        NEXT;
+      OP(DSEC):
+        PUSH_DS(S(3));
+        PUSH_DS(S(3));
+        CHECK_DSP();
+        NEXT;
+      OP(DNTH):
+        SPILL();
+        atemp = data_stack[dsp--] * 2;
+        data_stack[dsp+1] = data_stack[dsp - atemp - 1];
+        data_stack[dsp+2] = data_stack[dsp - atemp];
+        dsp+=2;
+        FILL();
+        CHECK_DSP();
+        NEXT;
+      OP(DSWAP):
+        temp = S0;
+        S0 = S(2);
+        S(2) = temp;
+
+        temp = S1;
+        S1 = S(3);
+        S(3) = temp;
+        NEXT;
+      OP(DROT):
+        temp = S(5);
+        S(5) = S(3);
+        S(3) = S1;
+        S1 = temp;
+
+        temp = S(4);
+        S(4) = S(2);
+        S(2) = S0;
+        S0 = temp;
+        NEXT;
+      OP(DRPUSH):
+        return_stack[++rsp] = S1;
+        return_stack[++rsp] = S0;
+        DROP2;
+        CHECK_DSP();
+        CHECK_RSP();
+        NEXT;
+      OP(DRPOP):
+        PUSH_DS(return_stack[rsp-1]);
+        PUSH_DS(return_stack[rsp]);
+        rsp-=2;
+        CHECK_DSP();
+        CHECK_RSP();
+        NEXT;
+      OP(DRGRAB):
+        PUSH_DS(return_stack[rsp-1]);
+        PUSH_DS(return_stack[rsp]);
+        CHECK_DSP();
+        NEXT;
+
+      /// Word Arithmetic ///
+      OP(ADD):
+        BINARY(S1 + S0);
+        CHECK_DSP();
+        NEXT;
+      OP(SUB):
+        BINARY(S1 - S0);
+        CHECK_DSP();
+        NEXT;
+      OP(MULT):
+        BINARY(S1 * S0);
+        CHECK_DSP();
+        NEXT;
+      OP(DIV):
+        BINARY(S1 / S0);
+        CHECK_DSP();
+        NEXT;
+      OP(MOD):
+        BINARY(S1 % S0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Signed Comparisson ///
+      OP(EQ):
+        BINARY(S1 == S0);
+        CHECK_DSP();
+        NEXT;
+      OP(LT):
+        BINARY(S1 < S0);
+        CHECK_DSP();
+        NEXT;
+      OP(GT):
+        BINARY(S1 > S0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Unsigned Artihmetic and Comparisson ///
+      OP(MULTU):
         {
-          double x;
-          scanf("%lf", &x);
-          set_dword(data_stack, dsp + 1, (DWORD)(x * SCALES[ DEFAULT_SCALE ]));
-          dsp+=2;
+          // large signed numbers cast to unsigned dword as 0xffff____
+          // so we have to zero those bits before the calculation
+          DWORDU a = (DWORDU)S1 & 0xffff;
+          DWORDU b = (DWORDU)S0 & 0xffff;
+          DWORDU res = a * b;
+          S1 = res >> 16;
+          S0 = res;
         }
-        break;
-      case FREADSC:
+        NEXT;
+      OP(DIVU):
+        BINARY((WORDU)S1 / (WORDU)S0);
+        CHECK_DSP();
+        NEXT;
+      OP(MODU):
+        BINARY((WORDU)S1 % (WORDU)S0);
+        CHECK_DSP();
+        NEXT;
+      OP(LTU):
+        BINARY((WORDU)S1 < (WORDU)S0);
+        CHECK_DSP();
+        NEXT;
+      OP(GTU):
+        BINARY((WORDU)S1 > (WORDU)S0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Double Arithmetic and Comparisson ///
+      // Arithmetic that can overflow is done unsigned so it wraps instead of
+      // being undefined, which the optimizer could otherwise assume away
+      OP(DADD):
+        DRESULT(2, (DWORDU)D2 + (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DSUB):
+        DRESULT(2, (DWORDU)D2 - (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DMULT):
+        DRESULT(2, (DWORDU)D2 * (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DDIV):
+        DRESULT(2, D2 / D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DMOD):
+        DRESULT(2, D2 % D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DEQ):
+        DRESULT(2, D2 == D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DLT):
+        DRESULT(2, D2 < D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DGT):
+        DRESULT(2, D2 > D0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Unsigned Double Arithmetic and Comparisson ///
+      OP(DDIVU):
+        DRESULT(2, (DWORDU)D2 / (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DMODU):
+        DRESULT(2, (DWORDU)D2 % (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DLTU):
+        DRESULT(2, (DWORDU)D2 < (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DGTU):
+        DRESULT(2, (DWORDU)D2 > (DWORDU)D0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Bitwise words ///
+      OP(SL):
+        BINARY((WORDU)S1 << S0);
+        CHECK_DSP();
+        NEXT;
+      OP(SR):
+        BINARY(S1 >> S0);
+        CHECK_DSP();
+        NEXT;
+      OP(AND):
+        BINARY(S1 & S0);
+        CHECK_DSP();
+        NEXT;
+      OP(OR):
+        BINARY(S1 | S0);
+        CHECK_DSP();
+        NEXT;
+      OP(NOT):
+        S0 = ~S0;
+        NEXT;
+
+      /// Bitwise double words ///
+      OP(DSL):
+        DRESULT(1, (DWORDU)D1 << S0);
+        CHECK_DSP();
+        NEXT;
+      OP(DSR):
+        DRESULT(1, D1 >> S0);
+        CHECK_DSP();
+        NEXT;
+      OP(DAND):
+        DRESULT(2, D2 & D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DOR):
+        DRESULT(2, D2 | D0);
+        CHECK_DSP();
+        NEXT;
+      OP(DNOT):
+        DRESULT(0, ~D0);
+        NEXT;
+
+      /// Movement ///
+      OP(JUMP):
+        pc = POP_DS();
+        CHECK_JUMP();
+        JUMP_NEXT;
+      OP(BRANCH):
+        atemp = POP_DS();
+        temp = POP_DS();
+        if (temp) {
+          pc = atemp;
+          CHECK_JUMP();
+          JUMP_NEXT;
+        }
+        CHECK_DSP();
+        NEXT;
+      OP(CALL):
+        return_stack[++rsp] = pc + 1;
+        pc = POP_DS();
+        PROFILE_CALL(pc);
+        CHECK_JUMP();
+        JUMP_NEXT;
+      OP(RET):
+        pc = return_stack[rsp--];
+        CHECK_JUMP();
+        JUMP_NEXT;
+      OP(DSP):
+        PUSH_DS(dsp);
+        CHECK_DSP();
+        NEXT;
+      OP(PC):
+        PUSH_DS(pc);
+        CHECK_DSP();
+        NEXT;
+      OP(BFP):
+        PUSH_DS(bfp);
+        CHECK_DSP();
+        NEXT;
+      OP(FMP):
+        PUSH_DS(fmp);
+        CHECK_DSP();
+        NEXT;
+
+      /// Number Printing ///
+      OP(WPRN):
+        write_signed(io, POP_DS());
+        CHECK_DSP();
+        NEXT;
+      OP(DPRN):
+        write_signed(io, D0);
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(WPRNU):
+        write_unsigned(io, (WORDU)POP_DS());
+        CHECK_DSP();
+        NEXT;
+      OP(DPRNU):
+        write_unsigned(io, (DWORDU)D0);
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(FPRN):
+        write_fixed(io, D0, DEFAULT_SCALE);
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+      OP(FPRNSC):
+        temp = POP_DS();
+        if (temp <= 0 || temp >= SCALE_MAX)
+          temp = DEFAULT_SCALE;
+        write_fixed(io, D0, temp);
+        DROP2;
+        CHECK_DSP();
+        NEXT;
+
+      /// Char and String printing ///
+      OP(PRNCH):
+        write_char(io, POP_DS() & 0xff);
+        CHECK_DSP();
+        NEXT;
+      OP(PRNPK):
+        temp = POP_DS();
+        write_char(io, temp & 0xff);
+        write_char(io, (temp >> BYTE_SIZE) & 0xff);
+        CHECK_DSP();
+        NEXT;
+      OP(PRN):
+        // Print from bfp to first null or buffer end
+        print_string(io, memory, bfp, fmp);
+        NEXT;
+      OP(PRNLN):
+        // Print from bfp to first null or buffer end with a newline
+        print_string(io, memory, bfp, fmp);
+        write_char(io, '\n');
+        NEXT;
+      OP(PRNMEM):
+        atemp = POP_DS();
+        if (code[pc].flag & 1) {
+          print_string(io, memory, atemp, END_MEMORY);
+        } else {
+          print_string(io, memory, fmp + atemp, END_MEMORY);
+        }
+        CHECK_DSP();
+        NEXT;
+
+      /// Reading ///
+      OP(WREAD):
+        {
+          // A failed read pushes 0, like FREAD
+          long number = 0;
+          read_integer(io, &number);
+          PUSH_DS((WORD)number);
+        }
+        CHECK_DSP();
+        NEXT;
+      OP(DREAD):
+        {
+          long number = 0;
+          read_integer(io, &number);
+          dtemp = number;
+          PUSH_DS(dtemp >> WORD_SIZE);
+          PUSH_DS(dtemp);
+        }
+        CHECK_DSP();
+        NEXT;
+      OP(FREAD):
+        {
+          double x = 0;
+          read_double(io, &x);
+          dtemp = x * SCALES[ DEFAULT_SCALE ];
+          PUSH_DS(dtemp >> WORD_SIZE);
+          PUSH_DS(dtemp);
+        }
+        CHECK_DSP();
+        NEXT;
+      OP(FREADSC):
         {
           // TODO no way to get scale off of stack?
-          temp = data_stack[dsp--];
+          temp = POP_DS();
           if (temp && temp < SCALE_MAX) {
             dtemp = SCALES[temp];
           } else {
             dtemp = SCALES[ DEFAULT_SCALE ];
           }
-          double x;
-          scanf("%lf", &x);
-          set_dword(data_stack, dsp + 1, (DWORD)(x * dtemp));
-          dsp+=2;
+          double x = 0;
+          read_double(io, &x);
+          dtemp = x * dtemp;
+          PUSH_DS(dtemp >> WORD_SIZE);
+          PUSH_DS(dtemp);
         }
-        break;
-      case READCH:
+        CHECK_DSP();
+        NEXT;
+      OP(READCH):
         {
-          char ch;
-          scanf("%c", &ch);
-          data_stack[++dsp] = (WORD)ch & 0xff;
+          char ch = 0;
+          read_char(io, &ch);
+          PUSH_DS((WORD)ch & 0xff);
         }
-        break;
-      case READLN:
-        read_string(memory, bfp, fmp);
-        break;
+        CHECK_DSP();
+        NEXT;
+      OP(READLN):
+        read_string(io, memory, bfp, fmp);
+        NEXT;
 
       /// Buffer and Chars ///
-      case BFSTORE:
-        atemp = data_stack[dsp--];
-        memory[bfp + atemp] = data_stack[dsp--];
-        break;
-      case BFLOAD:
-        atemp = data_stack[dsp];
-        data_stack[dsp] = memory[bfp + atemp];
-        break;
-      case HIGH:
-        data_stack[dsp+1] = (data_stack[dsp] >> BYTE_SIZE) & 0xff;
-        dsp++;
-        break;
-      case LOW:
-        data_stack[dsp+1] = data_stack[dsp] & 0xff;
-        dsp++;
-        break;
-      case UNPACK:
-        temp = data_stack[dsp];
-        data_stack[++dsp] =  (temp >> BYTE_SIZE) & 0xff;
-        data_stack[++dsp] = temp & 0xff;
-        break;
-      case PACK:
-        temp = data_stack[dsp--];
-        data_stack[dsp] = temp | (data_stack[dsp] << BYTE_SIZE);
-        break;
+      OP(BFSTORE):
+        atemp = POP_DS();
+        memory[bfp + atemp] = POP_DS();
+        CHECK_DSP();
+        NEXT;
+      OP(BFLOAD):
+        atemp = S0;
+        S0 = memory[bfp + atemp];
+        NEXT;
+      OP(HIGH):
+        PUSH_DS((S0 >> BYTE_SIZE) & 0xff);
+        CHECK_DSP();
+        NEXT;
+      OP(LOW):
+        PUSH_DS(S0 & 0xff);
+        CHECK_DSP();
+        NEXT;
+      OP(UNPACK):
+        temp = S0;
+        PUSH_DS((temp >> BYTE_SIZE) & 0xff);
+        PUSH_DS(temp & 0xff);
+        CHECK_DSP();
+        NEXT;
+      OP(PACK):
+        temp = POP_DS();
+        S0 = temp | (S0 << BYTE_SIZE);
+        CHECK_DSP();
+        NEXT;
 
       /// Memory copying ///
-      case MEMCOPY:
-        utemp = data_stack[dsp--];
-        switch (memory[pc] >> BYTE_SIZE) {
+      OP(MEMCOPY):
+        utemp = POP_DS();
+        switch (code[pc].flag) {
           case MEM_BUF:
-            atemp = data_stack[dsp--];
+            atemp = POP_DS();
             memcpy(memory + bfp,
                    memory + fmp + atemp,
                    utemp * 2);
             break;
           case BUF_MEM:
-            atemp = data_stack[dsp--];
+            atemp = POP_DS();
             memcpy(memory + fmp + atemp,
                    memory + bfp,
                    utemp * 2);
+            INVALIDATE(fmp + atemp, fmp + atemp + utemp);
             break;
         }
-        break;
-      case STRCOPY:
-        switch (memory[pc] >> BYTE_SIZE) {
+        CHECK_DSP();
+        NEXT;
+      OP(STRCOPY):
+        switch (code[pc].flag) {
           case MEM_BUF:
-            atemp = data_stack[dsp--];
+            atemp = POP_DS();
             utemp = string_length(memory, fmp + atemp);
             memcpy(memory + bfp,
                    memory + fmp + atemp,
                    utemp * 2);
             break;
           case BUF_MEM:
-            atemp = data_stack[dsp--];
+            atemp = POP_DS();
             utemp = string_length(memory, bfp);
             memcpy(memory + fmp + atemp,
                    memory + bfp,
                    utemp * 2);
+            INVALIDATE(fmp + atemp, fmp + atemp + utemp);
             break;
         }
-        break;
+        CHECK_DSP();
+        NEXT;
 
       /// Fixed point arithmetic ///
       // only for those operations that cannot be done by dword ops
-      case FMULT:
+      OP(FMULT):
         {
-          long long inter = (long long)get_dword(data_stack, dsp-3)
-                            * (long long)get_dword(data_stack, dsp-1);
-          dsp-=2;
-          set_dword(data_stack, dsp-1, inter / SCALES[ DEFAULT_SCALE ]);
+          long long inter = (long long)D2 * (long long)D0;
+          DRESULT(2, inter / SCALES[ DEFAULT_SCALE ]);
         }
-        break;
-      case FDIV:
+        CHECK_DSP();
+        NEXT;
+      OP(FDIV):
         {
-          double inter = (double)get_dword(data_stack, dsp-3)
-                         / (double)get_dword(data_stack, dsp-1);
-          dsp-=2;
-          set_dword(data_stack, dsp-1, inter * SCALES[ DEFAULT_SCALE ]);
+          double inter = (double)D2 / (double)D0;
+          DRESULT(2, inter * SCALES[ DEFAULT_SCALE ]);
         }
-        break;
-      case FMULTSC:
+        CHECK_DSP();
+        NEXT;
+      OP(FMULTSC):
         {
-          temp = data_stack[dsp--];
+          temp = POP_DS();
           if (temp && temp < SCALE_MAX) {
             dtemp = SCALES[temp];
           } else {
             dtemp = SCALES[ DEFAULT_SCALE ];
           }
-          long long inter = (long long)get_dword(data_stack, dsp-3)
-                            * (long long)get_dword(data_stack, dsp-1);
-          dsp-=2;
-          set_dword(data_stack, dsp-1, inter / dtemp);
+          long long inter = (long long)D2 * (long long)D0;
+          DRESULT(2, inter / dtemp);
         }
-        break;
-      case FDIVSC:
+        CHECK_DSP();
+        NEXT;
+      OP(FDIVSC):
         {
-          temp = data_stack[dsp--];
+          temp = POP_DS();
           if (temp && temp < SCALE_MAX) {
             dtemp = SCALES[temp];
           } else {
             dtemp = SCALES[ DEFAULT_SCALE ];
           }
-          double inter = (double)get_dword(data_stack, dsp-3)
-                         / (double)get_dword(data_stack, dsp-1);
-          dsp-=2;
-          set_dword(data_stack, dsp-1, inter * dtemp);
+          double inter = (double)D2 / (double)D0;
+          DRESULT(2, inter * dtemp);
         }
-        break;
+        CHECK_DSP();
+        NEXT;
+
+      /// Fused ops ///
+      // Each one does the work of the op sequence the assembler replaced
+      // with it, taking the value that was pushed as an immediate.
+      OP(LOADI):  // push X load
+        atemp = code[pc].arg;
+        if (code[pc].flag & 1)
+          PUSH_DS(memory[atemp]);
+        else
+          PUSH_DS(memory[fmp + atemp]);
+        pc++;
+        CHECK_DSP();
+        NEXT;
+      OP(STOREI):  // push X store
+        atemp = code[pc].arg;
+        if (code[pc].flag & 1) {
+          memory[atemp] = S0;
+          INVALIDATE(atemp, atemp + 1);
+        } else {
+          memory[fmp + atemp] = S0;
+          INVALIDATE(fmp + atemp, fmp + atemp + 1);
+        }
+        DROP1;
+        pc++;
+        CHECK_DSP();
+        NEXT;
+      OP(DLOADI):  // push X dload
+        atemp = code[pc].arg;
+        if (code[pc].flag & 1) {
+          PUSH_DS(memory[atemp]);
+          PUSH_DS(memory[atemp + 1]);
+        } else {
+          PUSH_DS(memory[fmp + atemp]);
+          PUSH_DS(memory[fmp + atemp + 1]);
+        }
+        pc++;
+        CHECK_DSP();
+        NEXT;
+      OP(DSTOREI):  // push X dstore
+        atemp = code[pc].arg;
+        if (code[pc].flag & 1) {
+          memory[atemp] = S1;
+          memory[atemp + 1] = S0;
+          INVALIDATE(atemp, atemp + 2);
+        } else {
+          memory[fmp + atemp] = S1;
+          memory[fmp + atemp + 1] = S0;
+          INVALIDATE(fmp + atemp, fmp + atemp + 2);
+        }
+        DROP2;
+        pc++;
+        CHECK_DSP();
+        NEXT;
+      OP(JUMPI):  // push L jump
+        pc = code[pc].arg;
+        JUMP_NEXT;
+      OP(BRANCHI):  // push L branch
+        if (POP_DS()) {
+          pc = code[pc].arg;
+          CHECK_JUMP();
+          JUMP_NEXT;
+        }
+        pc++;
+        CHECK_DSP();
+        NEXT;
+      OP(CALLI):  // push L call
+        return_stack[++rsp] = pc + 2;
+        pc = code[pc].arg;
+        PROFILE_CALL(pc);
+        CHECK_JUMP();
+        JUMP_NEXT;
+      OP(DINCR):  // dpush 1 dadd
+        DRESULT(0, (DWORDU)D0 + 1);
+        NEXT;
+      OP(NIP):  // swap pop
+        BINARY(S0);
+        CHECK_DSP();
+        NEXT;
+
+      /// Pause ///
+      OP(SNAPSHOT):
+        pc++;
+        error = LT64_PAUSED;
+        goto stop;
+
+      OP(OUT_OF_BOUNDS):
+        goto registers_error;
 
       /// BAD OP CODE ///
-      default:
+      BAD_OP:
         fprintf(stderr, "Error: Unknown OP code: 0x%hx\n", memory[pc]);
-        return EXIT_OP;
+        error = EXIT_OP;
+        goto stop;
     }
     pc++;
   }
 
+next_registers_error:
+  pc++;
+registers_error:
+  error = check_registers(pc, bfp, dsp, rsp);
+  goto stop;
+
+halt:
   // When program is run for tests we print out the contents of the stack
   // to stdout to check that the program ended in the expected state.
   // Because we always increment dsp before pushing a value the true start of
   // the stack is index 1 and not 0.
   if (TESTING) {
-    display_range(data_stack, 0x0001, dsp + 1, false);
+    SPILL();
+    display_range(io, data_stack, 0x0001, dsp + 1, false);
+  }
+  error = LT64_HALTED;
+
+stop:
+  SPILL();
+  vm->dsp = dsp;
+  vm->rsp = rsp;
+  vm->pc = pc;
+  vm->steps += (size_t)(start_fuel - fuel);
+  flush_output(io);
+  return error;
+}
+
+/// ltvm.c ///////////////////////////////////////////////////////////////////
+// Prints an error and returns its exit code if a program of length bytes
+// cannot be loaded into main memory, otherwise returns 0.
+size_t check_length(size_t length) {
+  if (!length) {
+    fprintf(stderr, "Error: program length is 0\n");
+    return EXIT_FILE;
+  } else if ((length / 2) + 1 >= END_MEMORY) {
+    fprintf(stderr, "Error: program is to large to fit in memory\n");
+    return EXIT_MEM;
+  }
+  return 0;
+}
+
+// Makes a VM around main memory that has already been allocated. Returns
+// NULL if the rest of it cannot be allocated. The cached engine wraps its
+// data stack indexes to an ADDRESS, so it gets every address.
+static LT64_VM* create_vm(WORD* memory) {
+  LT64_VM* vm = (LT64_VM*) calloc(1, sizeof(LT64_VM));
+  if (vm == NULL)
+    return NULL;
+
+  vm->memory = memory;
+#ifdef LT64_TOS
+  vm->data_stack = (WORD*) calloc((size_t)END_MEMORY + 1, sizeof(WORD));
+#else
+  vm->data_stack = (WORD*) calloc((size_t)END_STACK + 1, sizeof(WORD));
+#endif
+  vm->return_stack = (WORD*) calloc((size_t)END_RETURN + 1, sizeof(WORD));
+  vm->code = (INSTRUCTION*) calloc((size_t)END_MEMORY + 1,
+                                   sizeof(INSTRUCTION));
+  vm->io.read = read_stdin;
+  vm->io.write = write_stdout;
+
+  if (vm->data_stack == NULL || vm->return_stack == NULL
+      || vm->code == NULL) {
+    lt64_destroy(vm);
+    return NULL;
+  }
+#ifdef LT64_JIT
+  if (JITTING) {
+    vm->jit = jit_create(memory, vm->code, vm->data_stack, vm->return_stack);
+    if (vm->jit == NULL) {
+      lt64_destroy(vm);
+      return NULL;
+    }
+  }
+#endif
+  return vm;
+}
+
+// Decodes the program in memory for the interpreter, dropping anything the
+// JIT compiled from what was there before.
+static void decode_vm(LT64_VM* vm) {
+  decode_program(vm->memory, vm->code, vm->length);
+#ifdef LT64_JIT
+  jit_reset(vm->jit, vm->length);
+#endif
+}
+
+// A program with zeroed static data (BSS) leaves it out of its binary. The
+// jump over its static data has a flag of 1 and is followed by the number
+// of zeroed words, which go at the end of the static data, right before
+// the code. Moves the code up to the address it was assembled for and zeroes
+// the words it leaves behind. Memory past the program is already zeroed.
+// Returns the exit code if the program no longer fits, otherwise sets
+// length to the bytes the program takes in memory and returns 0.
+static size_t load_bss(WORD* memory, size_t* length) {
+  size_t words = (*length + 1) / sizeof(WORD);
+  if (words < 4 || (WORDU)memory[2] != (JUMP | 1 << BYTE_SIZE))
+    return 0;
+
+  ADDRESS start = memory[1], bss = memory[3];
+  if (bss > start || start - bss < 4 || (size_t)(start - bss) > words) {
+    fprintf(stderr, "Error: program has an invalid zeroed data section\n");
+    return EXIT_FILE;
   }
+  size_t error = check_length(*length + bss * sizeof(WORD));
+  if (error)
+    return error;
+
+  size_t from = start - bss;
+  memmove(memory + start, memory + from, (words - from) * sizeof(WORD));
+  memset(memory + from, 0, bss * sizeof(WORD));
+  *length += bss * sizeof(WORD);
+  return 0;
+}
+
+// Sets up to run the length bytes of program already in main memory from
+// the start. The interpreter runs over the decoded program rather than
+// memory, so it is decoded here once instead of at the start of every run.
+// Returns the exit code if its zeroed data does not fit, otherwise 0.
+static size_t start_vm(LT64_VM* vm, size_t length) {
+  size_t error = load_bss(vm->memory, &length);
+  if (error)
+    return error;
+
+  vm->length = length;
+  vm->dsp = 0;
+  vm->rsp = 0;
+  vm->pc = 0;
+  vm->steps = 0;
+  vm->verified = VERIFIED;
+  decode_vm(vm);
+  return 0;
+}
+
+LT64_VM* lt64_create() {
+  WORD* memory = (WORD*) calloc((size_t)END_MEMORY + 1, sizeof(WORD));
+  if (memory == NULL)
+    return NULL;
+
+  LT64_VM* vm = create_vm(memory);
+  if (vm == NULL) {
+    free(memory);
+    return NULL;
+  }
+  vm->owns_memory = true;
+  return vm;
+}
+
+void lt64_destroy(LT64_VM* vm) {
+  if (vm->owns_memory)
+    free(vm->memory);
+  free(vm->code);
+  free(vm->data_stack);
+  free(vm->return_stack);
+#ifdef LT64_JIT
+  if (vm->jit != NULL)
+    jit_destroy(vm->jit);
+#endif
+  free(vm);
+}
+
+size_t lt64_load(LT64_VM* vm, const WORD* words, size_t length) {
+  size_t error = check_length(length * sizeof(WORD));
+  if (error)
+    return error;
+
+  memset(vm->memory, 0, ((size_t)END_MEMORY + 1) * sizeof(WORD));
+  memcpy(vm->memory, words, length * sizeof(WORD));
+  return start_vm(vm, length * sizeof(WORD));
+}
+
+size_t lt64_steps(LT64_VM* vm) {
+  return vm->steps;
+}
 
-  return EXIT_SUCCESS;
+void lt64_set_input(LT64_VM* vm, LT64_READ reader, void* user) {
+  vm->io.read = reader;
+  vm->io.read_user = user;
+  vm->io.in_pos = 0;
+  vm->io.in_end = 0;
+}
+
+void lt64_set_output(LT64_VM* vm, LT64_WRITE writer, void* user) {
+  flush_output(&vm->io);
+  vm->io.write = writer;
+  vm->io.write_user = user;
+}
+
+// A snapshot is this header followed by all of main memory and the used
+// part of each stack, as they are laid out in memory.
+const char SNAPSHOT_MAGIC[8] = "LT64SNAP";
+
+typedef struct snapshot_header {
+  char magic[8];
+  unsigned long long length;
+  unsigned long long steps;
+  ADDRESS dsp, rsp, pc;
+} SNAPSHOT_HEADER;
+
+size_t lt64_save(LT64_VM* vm, const char* path) {
+  SNAPSHOT_HEADER header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.length = vm->length;
+  header.steps = vm->steps;
+  header.dsp = vm->dsp;
+  header.rsp = vm->rsp;
+  header.pc = vm->pc;
+
+  flush_output(&vm->io);
+  FILE* file = fopen(path, "wb");
+  size_t memory_words = (size_t)END_MEMORY + 1;
+  bool saved = file != NULL
+      && vm->dsp <= END_STACK && vm->rsp <= END_RETURN
+      && fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(vm->memory, sizeof(WORD), memory_words, file) == memory_words
+      && fwrite(vm->data_stack, sizeof(WORD), vm->dsp + 1, file)
+         == vm->dsp + 1u
+      && fwrite(vm->return_stack, sizeof(WORD), vm->rsp + 1, file)
+         == vm->rsp + 1u;
+  if (file != NULL && fclose(file))
+    saved = false;
+  if (!saved) {
+    fprintf(stderr, "Error: Could not write snapshot %s\n", path);
+    return EXIT_FILE;
+  }
+  return 0;
 }
 
+size_t lt64_restore(LT64_VM* vm, const char* path) {
+  SNAPSHOT_HEADER header;
+  FILE* file = fopen(path, "rb");
+  size_t memory_words = (size_t)END_MEMORY + 1;
+  bool restored = file != NULL
+      && fread(&header, sizeof(header), 1, file) == 1
+      && !memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+      && header.length && (header.length / 2) + 1 < END_MEMORY
+      && header.dsp <= END_STACK && header.rsp <= END_RETURN
+      && fread(vm->memory, sizeof(WORD), memory_words, file) == memory_words
+      && fread(vm->data_stack, sizeof(WORD), header.dsp + 1, file)
+         == header.dsp + 1u
+      && fread(vm->return_stack, sizeof(WORD), header.rsp + 1, file)
+         == header.rsp + 1u;
+  if (file != NULL)
+    fclose(file);
+  if (!restored) {
+    fprintf(stderr, "Error: Could not restore snapshot %s\n", path);
+    return EXIT_FILE;
+  }
+
+  vm->length = header.length;
+  vm->dsp = header.dsp;
+  vm->rsp = header.rsp;
+  vm->pc = header.pc;
+  vm->steps = header.steps;
+  vm->verified = false;
+  vm->io.in_pos = 0;
+  vm->io.in_end = 0;
+  decode_vm(vm);
+  return 0;
+}
+
+/// ltaot.c //////////////////////////////////////////////////////////////////
+// A program assembled with -a is also translated ahead of time into C that is
+// appended after this file as aot_execute. Each instruction becomes its own
+// statements, with static jumps and calls as gotos, so gcc can optimize
+// across them. Anything it was not translated for, like jumping to an
+// address that is not a known target or writing over the program's code,
+// hands the registers back to the interpreter to finish the run.
+#ifdef LT64_AOT
+size_t aot_execute(LT64_VM* vm);
+
+// Finishes a run in the interpreter from the given registers. The
+// translated code writes memory without decoding it, so the program is
+// decoded again first.
+static size_t aot_interpret(LT64_VM* vm, ADDRESS dsp, ADDRESS rsp,
+                            ADDRESS pc) {
+  vm->dsp = dsp;
+  vm->rsp = rsp;
+  vm->pc = pc;
+  decode_vm(vm);
+  return lt64_run(vm, 0);
+}
+#endif
+
 /// main.c ///////////////////////////////////////////////////////////////////
-size_t prog_length();
-void set_program(WORD* mem, size_t length);
+// The standalone VM runs one program on stdin and stdout and exits with the
+// status of the run. Building with -DLT64_LIBRARY leaves it out.
+#ifndef LT64_LIBRARY
+#ifdef LT64_BATCH
+  const bool BATCHING = true;
+#else
+  const bool BATCHING = false;
+#endif
 
-int main( int argc, char *argv[] ) {
-  // VM memory pointers
-  WORD* data_stack;
-  WORD* return_stack;
-  WORD* memory;
+#ifdef LT64_FORK
+  const bool FORKING = true;
+#else
+  const bool FORKING = false;
+#endif
 
-  // Allocate memory for the Data Stack
-  data_stack = (WORD*) calloc((size_t)END_STACK + 1, sizeof(WORD));
-  if (data_stack == NULL) {
-    fprintf(stderr, "Error: Could not allocate the Data Stack\n");
-    exit(EXIT_MEM);
+// -DLT64_SNAPSHOT writes a snapshot to SNAPSHOT_FILE every time the program
+// runs a :snapshot op, and then carries on running.
+#ifdef LT64_SNAPSHOT
+  const bool SAVE_SNAPSHOT = true;
+#else
+  const bool SAVE_SNAPSHOT = false;
+#endif
+const char* SNAPSHOT_FILE = "lt64.snap";
+
+#if defined(LT64_BATCH) && defined(LT64_FORK)
+  #error "LT64_BATCH and LT64_FORK cannot be used together"
+#endif
+#if defined(LT64_SNAPSHOT) && (defined(LT64_BATCH) || defined(LT64_FORK))
+  #error "LT64_SNAPSHOT cannot be used with LT64_BATCH or LT64_FORK"
+#endif
+
+// The runner takes the .ltb file as its first argument
+#ifdef LT64_RUNNER
+  const int PROGRAM_ARGS = 1;
+#else
+  const int PROGRAM_ARGS = 0;
+#endif
+
+void usage(char* name) {
+  fprintf(stderr, "Usage: %s%s%s%s\n", name,
+          PROGRAM_ARGS ? " <program.ltb>" : "",
+          BATCHING || FORKING ? " <output dir>" : "",
+          BATCHING ? " <input>..." : "");
+  exit(EXIT_ARGS);
+}
+
+// Limits for the standalone VM, and for each run in a batch, with 0 for
+// none. -DLT64_MAX_STEPS=n stops a program once it has run n instructions
+// and -DLT64_MAX_MS=n once it has run for n ms, both with EXIT_BUDGET. The
+// time is checked every TIME_SLICE instructions. Translated code cannot be
+// stopped part way through, so a limited build runs in the interpreter.
+#ifndef LT64_MAX_STEPS
+  #define LT64_MAX_STEPS 0
+#endif
+#ifndef LT64_MAX_MS
+  #define LT64_MAX_MS 0
+#endif
+const size_t MAX_STEPS = LT64_MAX_STEPS;
+const size_t MAX_MS = LT64_MAX_MS;
+const size_t TIME_SLICE = 0x100000;
+
+static double elapsed_ms(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000.0
+         + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Prints where a program was stopped when it ran out of a limit
+void report_limit(LT64_VM* vm, const char* limit) {
+  fprintf(stderr, "Error: %s ran out, pc: %hx, op: ", limit, vm->pc);
+  display_op_name(vm->memory[vm->pc] & 0xff, stderr);
+  fprintf(stderr, ", instructions: %zu\n", vm->steps);
+}
+
+// The budget for the next lt64_run of a limited program, at most slice, with
+// the time limit counted from start. Returns 0 once a limit has run out,
+// setting limit to its name.
+static size_t next_slice(LT64_VM* vm, struct timespec* start, size_t slice,
+                         const char** limit) {
+  size_t left = MAX_STEPS > vm->steps ? MAX_STEPS - vm->steps : 0;
+  if (MAX_STEPS && !left) {
+    *limit = "instruction budget";
+    return 0;
+  } else if (MAX_MS && elapsed_ms(start) >= MAX_MS) {
+    *limit = "time limit";
+    return 0;
+  }
+  return MAX_STEPS && left < slice ? left : slice;
+}
+
+// Runs a loaded program until it stops, pauses, or runs out of a limit,
+// with the time limit counted from start.
+static size_t run_limited(LT64_VM* vm, struct timespec* start) {
+  if (!MAX_STEPS && !MAX_MS) {
+#ifdef LT64_AOT
+    return aot_execute(vm);
+#else
+    return lt64_run(vm, 0);
+#endif
+  }
+
+  for (;;) {
+    const char* limit;
+    size_t budget = next_slice(vm, start, MAX_MS ? TIME_SLICE : MAX_STEPS,
+                               &limit);
+    if (!budget) {
+      report_limit(vm, limit);
+      return EXIT_BUDGET;
+    }
+    size_t status = lt64_run(vm, budget);
+    if (status != LT64_BUDGET)
+      return status;
+  }
+}
+
+// Runs a loaded program until it stops or runs out of a limit. It carries
+// on past every :snapshot op, saving a snapshot there first if asked to.
+size_t run_program(LT64_VM* vm) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t status;
+  while ((status = run_limited(vm, &start)) == LT64_PAUSED) {
+    if (SAVE_SNAPSHOT && (status = lt64_save(vm, SNAPSHOT_FILE)))
+      return status;
   }
+  return status;
+}
+
+// True if the file at path is a snapshot rather than a program
+bool is_snapshot(const char* path) {
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  bool found = fread(magic, sizeof(magic), 1, file) == 1
+               && !memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic));
+  fclose(file);
+  return found;
+}
+
+#ifdef LT64_RUNNER
+const size_t MEMORY_BYTES = ((size_t)END_MEMORY + 1) * sizeof(WORD);
 
-  // Allocate memory for the Return Stack
-  return_stack = (WORD*) calloc((size_t)END_RETURN + 1, sizeof(WORD));
-  if (return_stack == NULL) {
-    fprintf(stderr, "Error: Could not allocate the Return Stack\n");
+WORD* alloc_memory() {
+  WORD* memory = (WORD*) mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not allocate Main Program Memory\n");
     exit(EXIT_MEM);
   }
+  return memory;
+}
+
+// Main memory is one anonymous mapping with the .ltb file given on the
+// command line mapped privately over the start of it. The program is paged
+// in as it is used instead of being read and copied, and writes to it
+// never reach the file.
+WORD* load_program(char *argv[], size_t* length) {
+  int fd = open(argv[1], O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    fprintf(stderr, "Error: Could not open %s\n", argv[1]);
+    exit(EXIT_FILE);
+  }
+  *length = info.st_size;
+  size_t error = check_length(*length);
+  if (error)
+    exit(error);
+
+  WORD* memory = alloc_memory();
+  if (mmap(memory, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map %s\n", argv[1]);
+    exit(EXIT_FILE);
+  }
+  close(fd);
+  return memory;
+}
 
-  // Allocate memory for the Main Memory
-  memory = (WORD*) calloc((size_t)END_MEMORY + 1, sizeof(WORD));
+void unload_program(WORD* memory) {
+  munmap(memory, MEMORY_BYTES);
+}
+
+#else
+size_t prog_length();
+void set_program(WORD* mem, size_t length);
+
+WORD* alloc_memory() {
+  WORD* memory = (WORD*) calloc((size_t)END_MEMORY + 1, sizeof(WORD));
   if (memory == NULL) {
     fprintf(stderr, "Error: Could not allocate Main Program Memory\n");
     exit(EXIT_MEM);
   }
+  return memory;
+}
 
-  // Load the program
-  size_t length = prog_length();
-  if (!length) {
-    fprintf(stderr, "Error: program length is 0\n");
-    exit(EXIT_FILE);
-  } else if ((length / 2) + 1 >= END_MEMORY) {
-    fprintf(stderr, "Error: program is to large to fit in memory\n");
+WORD* load_program(char *argv[], size_t* length) {
+  (void)argv;
+  WORD* memory = alloc_memory();
+  *length = prog_length();
+  size_t error = check_length(*length);
+  if (error)
+    exit(error);
+  set_program(memory, *length);
+  return memory;
+}
+
+void unload_program(WORD* memory) {
+  free(memory);
+}
+#endif
+
+// Loads the program into a new VM set to run from the start. The runner can
+// also be given a snapshot in place of the .ltb file, which carries on from
+// where it was saved.
+LT64_VM* load_vm(char* argv[]) {
+  bool snapshot = PROGRAM_ARGS && is_snapshot(argv[1]);
+  size_t length = 0;
+  WORD* memory = snapshot ? alloc_memory() : load_program(argv, &length);
+
+  LT64_VM* vm = create_vm(memory);
+  if (vm == NULL) {
+    fprintf(stderr, "Error: Could not allocate the VM\n");
+    exit(EXIT_MEM);
+  }
+
+  if (!snapshot) {
+    size_t error = start_vm(vm, length);
+    if (error)
+      exit(error);
+  } else {
+    size_t error = lt64_restore(vm, argv[1]);
+    if (error)
+      exit(error);
+  }
+  return vm;
+}
+
+void unload_vm(LT64_VM* vm) {
+  WORD* memory = vm->memory;
+  lt64_destroy(vm);
+  unload_program(memory);
+}
+
+#if defined(LT64_BATCH) || defined(LT64_FORK)
+// Batch mode and the fork server run the program once for each input, and
+// write each run's output to a file of the same name with .out added in the
+// output directory. Every run starts from the same VM, so the outputs are
+// the same as running the inputs one at a time. When the program has a
+// :snapshot op that VM is first run up to it, with no input and its output
+// kept to be written ahead of each run's own, so the work before it is only
+// done once. If it stops, or tries to read input, before getting there, the
+// runs start from the beginning instead. A snapshot given to the runner is
+// already there.
+// Runs of translated code only count the instructions the interpreter ran.
+#if defined(LT64_PROFILE) || defined(DEBUG)
+  #error "LT64_BATCH and LT64_FORK cannot be used with LT64_PROFILE or DEBUG"
+#endif
+
+typedef struct batch_job {
+  char* input;
+  char* output;
+  size_t status;
+  size_t steps;
+  double ms;
+} BATCH_JOB;
+
+static long read_file(void* user, char* buffer, size_t size) {
+  FILE* file = (FILE*)user;
+  size_t got = fread(buffer, 1, size, file);
+  return got || !ferror(file) ? (long)got : -1;
+}
+
+static long write_file(void* user, const char* buffer, size_t size) {
+  FILE* file = (FILE*)user;
+  size_t written = fwrite(buffer, 1, size, file);
+  return written || !ferror(file) ? (long)written : -1;
+}
+
+static long no_input(void* user, char* buffer, size_t size) {
+  (void)buffer;
+  (void)size;
+  *(bool*)user = true;
+  return 0;
+}
+
+static char* join_path(const char* dir, const char* name, const char* ext) {
+  size_t size = strlen(dir) + strlen(name) + strlen(ext) + 2;
+  char* path = (char*) malloc(size);
+  if (path == NULL) {
+    fprintf(stderr, "Error: Could not allocate the batch\n");
     exit(EXIT_MEM);
   }
-  set_program(memory, length);
+  snprintf(path, size, "%s/%s%s", dir, name, ext);
+  return path;
+}
+
+static void make_dir(const char* dir) {
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error: Could not create %s\n", dir);
+    exit(EXIT_FILE);
+  }
+}
+
+// Sets vm up to carry on from where from stopped
+static void copy_vm(LT64_VM* vm, LT64_VM* from) {
+  memcpy(vm->memory, from->memory, ((size_t)END_MEMORY + 1) * sizeof(WORD));
+  memcpy(vm->data_stack, from->data_stack, (from->dsp + 1) * sizeof(WORD));
+  memcpy(vm->return_stack, from->return_stack,
+         (from->rsp + 1) * sizeof(WORD));
+  vm->length = from->length;
+  vm->dsp = from->dsp;
+  vm->rsp = from->rsp;
+  vm->pc = from->pc;
+  vm->steps = from->steps;
+  vm->verified = from->verified;
+  decode_vm(vm);
+}
+
+static bool has_snapshot_op(LT64_VM* vm) {
+  for (size_t pos = 0; pos < vm->length; pos++)
+    if (vm->code[pos].op == SNAPSHOT)
+      return true;
+  return false;
+}
+
+// Moves a VM that is at the start of the program up to its :snapshot op if
+// it can, adding its output on the way to before.
+static void run_to_snapshot(LT64_VM* vm, LT64_BUFFER* before) {
+  if (vm->pc || !has_snapshot_op(vm))
+    return;
+  LT64_VM* trial = lt64_create();
+  if (trial == NULL)
+    return;
+
+  bool wants_input = false;
+  copy_vm(trial, vm);
+  lt64_set_input(trial, no_input, &wants_input);
+  lt64_set_output(trial, lt64_buffer_write, before);
+  // The setup gets the same limits as a run, and a program that runs out
+  // of them before its :snapshot is run from the start by every job
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const char* limit;
+  size_t budget, status = LT64_BUDGET;
+  while (status == LT64_BUDGET && !wants_input
+         && (budget = next_slice(trial, &start, TIME_SLICE, &limit)))
+    status = lt64_run(trial, budget);
+
+  if (status == LT64_PAUSED && !wants_input)
+    copy_vm(vm, trial);
+  else
+    before->length = 0;
+  lt64_destroy(trial);
+}
+
+// Runs a VM that has been set up for a job on its input
+static void run_job_input(LT64_VM* vm, LT64_BUFFER* before, BATCH_JOB* job) {
+  FILE* input = fopen(job->input, "rb");
+  FILE* output = fopen(job->output, "wb");
+  if (input == NULL || output == NULL) {
+    fprintf(stderr, "Error: Could not open %s\n",
+            input == NULL ? job->input : job->output);
+    job->status = EXIT_FILE;
+  } else {
+    fwrite(before->data, 1, before->length, output);
+    lt64_set_input(vm, read_file, input);
+    lt64_set_output(vm, write_file, output);
+    job->status = run_program(vm);
+    flush_output(&vm->io);
+    job->steps = vm->steps;
+  }
+
+  if (input != NULL)
+    fclose(input);
+  if (output != NULL)
+    fclose(output);
+}
+
+static void print_job(BATCH_JOB* job) {
+  printf("%s\t%zu\t%zu\t%.3f\n", job->input, job->status, job->steps,
+         job->ms);
+}
+#endif
+
+#ifdef LT64_BATCH
+// Batch mode runs every input file given, or every file in an input
+// directory. Runs are shared out to a thread per core, each taking the next
+// input left as it finishes one, and a line with the input, exit code,
+// instruction count, and time in ms is printed for each when all are done.
+typedef struct batch {
+  LT64_VM* start;
+  LT64_BUFFER before;
+  BATCH_JOB* jobs;
+  size_t count;
+  atomic_size_t next;
+} BATCH;
+
+static void add_job(BATCH* batch, char* input, const char* out_dir) {
+  if (batch->count % 64 == 0) {
+    batch->jobs = (BATCH_JOB*) realloc(batch->jobs,
+                                       (batch->count + 64) * sizeof(BATCH_JOB));
+    if (batch->jobs == NULL) {
+      fprintf(stderr, "Error: Could not allocate the batch\n");
+      exit(EXIT_MEM);
+    }
+  }
+  const char* name = strrchr(input, '/');
+  BATCH_JOB* job = &batch->jobs[batch->count++];
+  job->input = input;
+  job->output = join_path(out_dir, name ? name + 1 : input, ".out");
+  job->status = 0;
+  job->steps = 0;
+  job->ms = 0;
+}
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds a job for an input file, or for every file in an input directory
+// in name order, skipping hidden files.
+static void add_input(BATCH* batch, const char* input, const char* out_dir) {
+  struct stat info;
+  if (stat(input, &info) < 0) {
+    fprintf(stderr, "Error: Could not open %s\n", input);
+    exit(EXIT_FILE);
+  }
+  if (!S_ISDIR(info.st_mode)) {
+    char* path = (char*) malloc(strlen(input) + 1);
+    if (path == NULL) {
+      fprintf(stderr, "Error: Could not allocate the batch\n");
+      exit(EXIT_MEM);
+    }
+    add_job(batch, strcpy(path, input), out_dir);
+    return;
+  }
+
+  DIR* dir = opendir(input);
+  if (dir == NULL) {
+    fprintf(stderr, "Error: Could not open %s\n", input);
+    exit(EXIT_FILE);
+  }
+  char** names = NULL;
+  size_t count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char* path = join_path(input, entry->d_name, "");
+    if (stat(path, &info) < 0 || !S_ISREG(info.st_mode)) {
+      free(path);
+      continue;
+    }
+    names = (char**) realloc(names, (count + 1) * sizeof(char*));
+    if (names == NULL) {
+      fprintf(stderr, "Error: Could not allocate the batch\n");
+      exit(EXIT_MEM);
+    }
+    names[count++] = path;
+  }
+  closedir(dir);
+
+  qsort(names, count, sizeof(char*), compare_names);
+  for (size_t i = 0; i < count; i++)
+    add_job(batch, names[i], out_dir);
+  free(names);
+}
+
+static void run_job(BATCH* batch, BATCH_JOB* job) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  LT64_VM* vm = lt64_create();
+  if (vm == NULL) {
+    fprintf(stderr, "Error: Could not allocate the VM\n");
+    job->status = EXIT_MEM;
+  } else {
+    copy_vm(vm, batch->start);
+    run_job_input(vm, &batch->before, job);
+    lt64_destroy(vm);
+  }
+  job->ms = elapsed_ms(&start);
+}
+
+static void* batch_worker(void* arg) {
+  BATCH* batch = (BATCH*)arg;
+  for (;;) {
+    size_t next = atomic_fetch_add(&batch->next, 1);
+    if (next >= batch->count)
+      return NULL;
+    run_job(batch, &batch->jobs[next]);
+  }
+}
+
+// Returns 0 if every run halted, otherwise the exit code of the first
+// input that did not.
+size_t run_batch(LT64_VM* start, const char* out_dir, char* inputs[],
+                 int input_count) {
+  BATCH batch = { .start = start };
+  atomic_init(&batch.next, 0);
+  for (int i = 0; i < input_count; i++)
+    add_input(&batch, inputs[i], out_dir);
+  make_dir(out_dir);
+  run_to_snapshot(start, &batch.before);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t thread_count = cores > 0 ? (size_t)cores : 1;
+  if (thread_count > batch.count)
+    thread_count = batch.count;
+  pthread_t* threads = (pthread_t*) calloc(thread_count, sizeof(pthread_t));
+  size_t started = 0;
+  for (; threads != NULL && started < thread_count; started++)
+    if (pthread_create(&threads[started], NULL, batch_worker, &batch))
+      break;
+  if (!started)
+    batch_worker(&batch);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  size_t result = 0;
+  for (size_t i = 0; i < batch.count; i++) {
+    BATCH_JOB* job = &batch.jobs[i];
+    print_job(job);
+    if (!result)
+      result = job->status;
+    free(job->input);
+    free(job->output);
+  }
+  free(batch.jobs);
+  free(batch.before.data);
+  return result;
+}
+
+int main( int argc, char *argv[] ) {
+  int first_input = PROGRAM_ARGS + 2;
+  if (argc <= first_input)
+    usage(argv[0]);
+
+  LT64_VM* vm = load_vm(argv);
+  size_t result = run_batch(vm, argv[first_input - 1], argv + first_input,
+                            argc - first_input);
+  unload_vm(vm);
+  return result;
+}
+
+#elif defined(LT64_FORK)
+// The fork server reads the paths of inputs from stdin, one per line, and
+// runs each in a child process forked from the VM, so a run starts with the
+// program already loaded and nothing copied until it is written. A line
+// with the input, exit code, instruction count, and time in ms is printed
+// as each run finishes. A child that is killed is given 128 plus the
+// signal as its exit code, the same as a shell.
+static void fork_job(LT64_VM* vm, LT64_BUFFER* before, BATCH_JOB* job) {
+  size_t* steps = (size_t*) mmap(NULL, sizeof(size_t), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (steps == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not allocate the run\n");
+    job->status = EXIT_MEM;
+    return;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    run_job_input(vm, before, job);
+    *steps = job->steps;
+    _exit(job->status);
+  }
+
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    fprintf(stderr, "Error: Could not run %s\n", job->input);
+    job->status = EXIT_MEM;
+  } else if (WIFEXITED(status)) {
+    job->status = WEXITSTATUS(status);
+  } else {
+    job->status = 128 + WTERMSIG(status);
+  }
+  job->steps = *steps;
+  munmap(steps, sizeof(size_t));
+}
+
+int main( int argc, char *argv[] ) {
+  if (argc != PROGRAM_ARGS + 2)
+    usage(argv[0]);
+
+  LT64_VM* vm = load_vm(argv);
+  const char* out_dir = argv[PROGRAM_ARGS + 1];
+  make_dir(out_dir);
+  LT64_BUFFER before = { 0 };
+  run_to_snapshot(vm, &before);
+
+  size_t result = 0;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t got;
+  while ((got = getline(&line, &size, stdin)) > 0) {
+    if (line[got - 1] == '\n')
+      line[--got] = '\0';
+    if (!got)
+      continue;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char* name = strrchr(line, '/');
+    BATCH_JOB job = { .input = line };
+    job.output = join_path(out_dir, name ? name + 1 : line, ".out");
+    fork_job(vm, &before, &job);
+    job.ms = elapsed_ms(&start);
+
+    print_job(&job);
+    fflush(stdout);
+    if (!result)
+      result = job.status;
+    free(job.output);
+  }
+
+  free(line);
+  free(before.data);
+  unload_vm(vm);
+  return result;
+}
+
+#else
+int main( int argc, char *argv[] ) {
+  if (PROGRAM_ARGS && argc != PROGRAM_ARGS + 1)
+    usage(argv[0]);
+
+  // Load the program into main memory with the stacks and decoded program
+  // around it
+  LT64_VM* vm = load_vm(argv);
 
   // Run program
-  size_t result = execute(memory, length, data_stack, return_stack);
+  size_t result = run_program(vm);
+  flush_output(&vm->io);
+#ifdef LT64_PROFILE
+  profile_report();
+#endif
 
   // clean up
-  free(memory);
-  free(data_stack);
-  free(return_stack);
+  unload_vm(vm);
 
   return result;
 }
+#endif
+#endif
 
 /** sample of what needs to be written for this to create a binary for a
  * full program with vm and assembled bytes
 
 size_t prog_length() { return 6; }
 
-void set_program(WORD* mem, size_t length) {
-  char prog[] = {
-    1,
-    0,
-    100,
-    0,
-    69,
-    0
-  };
-  memcpy(mem, prog, length);
+static const WORD program[] = {
+  1,100,69,
 };
 
+void set_program(WORD* mem, size_t length) {
+  memcpy(mem, program, length);
+}
+
 */
@@ -0,0 +1,70 @@
+// lt64.h ////////////////////////////////////////////////////////////////////
+// Declarations for embedding the lt64 VM. Build resources/lt64.c with
+// -DLT64_LIBRARY and link it with the program that includes this. These are
+// the same as the lt64.h section at the top of lt64.c.
+#ifndef LT64_H
+#define LT64_H
+
+#include "stddef.h"
+
+typedef struct lt64_vm LT64_VM;
+
+// Called to refill a VM's input and to flush its output, with the user
+// pointer they were set with. They return the number of bytes read or
+// written, 0 at the end of input, or a negative number on an error.
+typedef long (*LT64_READ)(void* user, char* buffer, size_t size);
+typedef long (*LT64_WRITE)(void* user, const char* buffer, size_t size);
+
+// In memory input and output, used as the user pointer for
+// lt64_buffer_read and lt64_buffer_write. Input is read from data up to
+// length. Output is added to the end of data, which is grown as needed and
+// has to be freed by the caller.
+typedef struct lt64_buffer {
+  char* data;
+  size_t length;
+  size_t capacity;
+  size_t pos;
+} LT64_BUFFER;
+
+// lt64_run returns LT64_HALTED when the program halts, LT64_BUDGET when it
+// ran for its whole budget without stopping, LT64_PAUSED when it ran a
+// :snapshot op, and otherwise the exit code of the error that stopped it,
+// the same as the standalone VM.
+enum lt64_status { LT64_HALTED = 0, LT64_BUDGET = 12, LT64_PAUSED = 13 };
+
+// Returns NULL if the VM cannot be allocated
+LT64_VM* lt64_create();
+void lt64_destroy(LT64_VM* vm);
+
+// Copies length words of an assembled program into the VM's memory and
+// sets it to run from the start. Returns 0, or the exit code for a program
+// that is empty or too large.
+size_t lt64_load(LT64_VM* vm, const short* words, size_t length);
+
+// A VM reads stdin and writes stdout until it is given other callbacks
+void lt64_set_input(LT64_VM* vm, LT64_READ reader, void* user);
+void lt64_set_output(LT64_VM* vm, LT64_WRITE writer, void* user);
+
+// Runs the program until it has run budget instructions, or with no limit
+// for a budget of 0. The budget is checked at jumps, branches, calls, and
+// returns, so a run can go a little past it. Running again after
+// LT64_BUDGET carries on where it stopped. Output is flushed before it
+// returns.
+size_t lt64_run(LT64_VM* vm, size_t budget);
+
+// Writes a VM's memory, stacks, and registers to the file at path, and reads
+// them back into a VM so it carries on from where the saved one stopped.
+// Input that was read but not used, and output already written, are not
+// saved. A snapshot can only be restored by a VM built the same way on the
+// same kind of machine. Both return 0, or the exit code for a bad file if
+// it cannot be written or read or is not a snapshot. A VM that could not be
+// restored has to be loaded again.
+size_t lt64_save(LT64_VM* vm, const char* path);
+size_t lt64_restore(LT64_VM* vm, const char* path);
+
+// The number of instructions run since the program was loaded
+size_t lt64_steps(LT64_VM* vm);
+
+long lt64_buffer_read(void* buffer, char* data, size_t size);
+long lt64_buffer_write(void* buffer, const char* data, size_t size);
+#endif
@@ -0,0 +1,457 @@
+(ns lt64-asm.aot
+  (:require [lt64-asm.symbols :as sym]
+            [lt64-asm.bytes :as b]))
+
+;;; Decoding ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Map of op codes to their op keywords. The high byte of an op word is a
+;; flag, i.e. :load-lb is :load with the flag set, so only the ops with a
+;; flag of 0 are needed to name every op.
+(def code->op
+  (into {} (for [[op code] sym/symbol-map
+                 :when (< code 0xff)]
+             [code op])))
+
+;; Op codes of the ops with a word argument following them
+(def imm-codes
+  (set (map #(bit-and (sym/op->code %) 0xff)
+            (cons :push sym/imm-ops))))
+
+(def dpush-code (sym/op->code :dpush))
+
+(defn memory-words
+  "Given the words of an assembled program returns them as the VM lays
+  them out in memory. If the jump over the static data has a flag of 1 the
+  word after it is the number of zeroed words left out at the end of the
+  static data, see static/process-bss, and they are put back."
+  [words]
+  (let [words (vec words)
+        start (bit-and (get words 1 0) 0xffff)
+        bss (bit-and (get words 3 0) 0xffff)]
+    (if (= (bit-or (sym/op->code :jump) 0x100) (bit-and (get words 2 0) 0xffff))
+      (let [from (- start bss)]
+        (vec (concat (subvec words 0 from)
+                     (repeat bss 0)
+                     (subvec words from))))
+      words)))
+
+(defn decode
+  "Given the words of an assembled program returns its instructions in
+  address order, at their addresses in memory, see memory-words. Each is a
+  map with the :addr of the op, the :op keyword (nil for an unknown op),
+  its :flag byte, the words of its argument in :args, and the address of
+  the instruction after it in :next.
+  The static data between the jump at the start of the program and the
+  start address it jumps to is skipped."
+  [words]
+  (let [words (memory-words words)
+        word-at #(get words % 0)
+        start (bit-and (word-at 1) 0xffff)]
+    (loop [addr 0
+           instrs []]
+      (cond
+        (>= addr (count words)) instrs
+
+        (and (= addr 3) (> start 3))
+        (recur start instrs)
+
+        :else
+        (let [word (word-at addr)
+              code (bit-and word 0xff)
+              size (cond
+                     (= code dpush-code) 3
+                     (contains? imm-codes code) 2
+                     :else 1)]
+          (recur (+ addr size)
+                 (conj instrs
+                       {:addr addr
+                        :op (get code->op code)
+                        :flag (bit-and (bit-shift-right word 8) 0xff)
+                        :args (mapv word-at (range (inc addr) (+ addr size)))
+                        :next (+ addr size)})))))))
+
+(defn dispatch-targets
+  "Returns the set of instruction addresses a program might jump to by
+  computing them at run time. These are the return addresses of calls,
+  pushed words that are the address of an instruction, i.e. a label pushed
+  for :jump or stored in a table, and where a run paused by :snapshot
+  carries on. Any other address that is jumped to is left to the VM."
+  [instrs]
+  (let [starts (set (map :addr instrs))]
+    (->> instrs
+         (mapcat (fn [{:keys [op args next]}]
+                   (case op
+                     (:call :calli :snapshot) [next]
+                     :push [(bit-and (first args) 0xffff)]
+                     [])))
+         (filter starts)
+         set)))
+
+(defn static-targets
+  "Returns the set of instruction addresses jumped to by fused jumps,
+  branches, and calls, which can be translated to gotos."
+  [instrs]
+  (let [starts (set (map :addr instrs))]
+    (->> instrs
+         (filter #(contains? #{:jumpi :branchi :calli} (:op %)))
+         (map #(bit-and (first (:args %)) 0xffff))
+         (filter starts)
+         set)))
+
+;;; Translation ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Each op is translated to the same statements as its handler in lt64.c,
+;; using the same stack macros, with its argument, flag, and pc filled in.
+;; Stack checks are the ones the fast engine does, so errors are reported
+;; with the registers the next instruction would have seen. They are left
+;; out of a verified program by the C compiler, see VERIFIED in lt64.c.
+
+(def binary-exprs
+  {:add "S1 + S0"  :sub "S1 - S0"  :mult "S1 * S0"  :div "S1 / S0"
+   :mod "S1 % S0"  :eq "S1 == S0"  :lt "S1 < S0"  :gt "S1 > S0"
+   :divu "(WORDU)S1 / (WORDU)S0"  :modu "(WORDU)S1 % (WORDU)S0"
+   :ltu "(WORDU)S1 < (WORDU)S0"  :gtu "(WORDU)S1 > (WORDU)S0"
+   :sl "(WORDU)S1 << S0"  :sr "S1 >> S0"  :and "S1 & S0"  :or "S1 | S0"
+   :nip "S0"})
+
+;; Ops that drop some words and replace the double word left on top
+(def dresult-exprs
+  {:dadd [2 "(DWORDU)D2 + (DWORDU)D0"]  :dsub [2 "(DWORDU)D2 - (DWORDU)D0"]
+   :dmult [2 "(DWORDU)D2 * (DWORDU)D0"]
+   :ddiv [2 "D2 / D0"]  :dmod [2 "D2 % D0"]  :deq [2 "D2 == D0"]
+   :dlt [2 "D2 < D0"]  :dgt [2 "D2 > D0"]
+   :ddivu [2 "(DWORDU)D2 / (DWORDU)D0"]  :dmodu [2 "(DWORDU)D2 % (DWORDU)D0"]
+   :dltu [2 "(DWORDU)D2 < (DWORDU)D0"]  :dgtu [2 "(DWORDU)D2 > (DWORDU)D0"]
+   :dsl [1 "(DWORDU)D1 << S0"]  :dsr [1 "D1 >> S0"]
+   :dand [2 "D2 & D0"]  :dor [2 "D2 | D0"]
+   :dnot [0 "~D0"]  :dincr [0 "(DWORDU)D0 + 1"]})
+
+;; Ops that do not touch the stack pointers, so they need no checks
+(def unchecked-ops
+  {:swap "temp = S0; S0 = S1; S1 = temp;"
+   :rot "temp = S(2); S(2) = S1; S1 = S0; S0 = temp;"
+   :nth (str "SPILL(); data_stack[dsp] = data_stack[dsp - data_stack[dsp] - 1];"
+             " FILL();")
+   :dswap (str "temp = S0; S0 = S(2); S(2) = temp;"
+               " temp = S1; S1 = S(3); S(3) = temp;")
+   :drot (str "temp = S(5); S(5) = S(3); S(3) = S1; S1 = temp;"
+              " temp = S(4); S(4) = S(2); S(2) = S0; S0 = temp;")
+   :multu (str "{ DWORDU a = (DWORDU)S1 & 0xffff;"
+               " DWORDU b = (DWORDU)S0 & 0xffff;"
+               " DWORDU res = a * b; S1 = res >> 16; S0 = res; }")
+   :not "S0 = ~S0;"
+   :prn "print_string(io, memory, bfp, fmp);"
+   :prnln "print_string(io, memory, bfp, fmp); write_char(io, '\\n');"
+   :readln "read_string(io, memory, bfp, fmp);"
+   :bufload "atemp = S0; S0 = memory[bfp + atemp];"})
+
+;; Ops that move dsp, and rsp for the ones marked, so they are followed by
+;; a check
+(def checked-ops
+  {:pop "DROP1;"
+   :first "PUSH_DS(S0);"
+   :second "PUSH_DS(S1);"
+   :rpush ["return_stack[++rsp] = POP_DS();" :rsp]
+   :rpop ["PUSH_DS(return_stack[rsp--]);" :rsp]
+   :rgrab "PUSH_DS(return_stack[rsp]);"
+   :dpop "DROP2;"
+   :dfirst "PUSH_DS(S1); PUSH_DS(S1);"
+   :dsecond "PUSH_DS(S(3)); PUSH_DS(S(3));"
+   :dnth (str "SPILL(); atemp = data_stack[dsp--] * 2;"
+              " data_stack[dsp+1] = data_stack[dsp - atemp - 1];"
+              " data_stack[dsp+2] = data_stack[dsp - atemp]; dsp+=2; FILL();")
+   :drpush ["return_stack[++rsp] = S1; return_stack[++rsp] = S0; DROP2;" :rsp]
+   :drpop [(str "PUSH_DS(return_stack[rsp-1]); PUSH_DS(return_stack[rsp]);"
+                " rsp-=2;")
+           :rsp]
+   :drgrab "PUSH_DS(return_stack[rsp-1]); PUSH_DS(return_stack[rsp]);"
+   :dsp "PUSH_DS(dsp);"
+   :bfp "PUSH_DS(bfp);"
+   :fmp "PUSH_DS(fmp);"
+   :wprn "write_signed(io, POP_DS());"
+   :dprn "write_signed(io, D0); DROP2;"
+   :wprnu "write_unsigned(io, (WORDU)POP_DS());"
+   :dprnu "write_unsigned(io, (DWORDU)D0); DROP2;"
+   :fprn "write_fixed(io, D0, DEFAULT_SCALE); DROP2;"
+   :fprnsc (str "temp = POP_DS(); if (temp <= 0 || temp >= SCALE_MAX)"
+                " temp = DEFAULT_SCALE; write_fixed(io, D0, temp); DROP2;")
+   :prnch "write_char(io, POP_DS() & 0xff);"
+   :prnpk (str "temp = POP_DS(); write_char(io, temp & 0xff);"
+               " write_char(io, (temp >> BYTE_SIZE) & 0xff);")
+   :wread (str "{ long number = 0; read_integer(io, &number);"
+               " PUSH_DS((WORD)number); }")
+   :dread (str "{ long number = 0; read_integer(io, &number); dtemp = number;"
+               " PUSH_DS(dtemp >> WORD_SIZE); PUSH_DS(dtemp); }")
+   :fread (str "{ double x = 0; read_double(io, &x);"
+               " dtemp = x * SCALES[ DEFAULT_SCALE ];"
+               " PUSH_DS(dtemp >> WORD_SIZE); PUSH_DS(dtemp); }")
+   :freadsc (str "{ temp = POP_DS(); if (temp && temp < SCALE_MAX)"
+                 " dtemp = SCALES[temp]; else dtemp = SCALES[ DEFAULT_SCALE ];"
+                 " double x = 0; read_double(io, &x); dtemp = x * dtemp;"
+                 " PUSH_DS(dtemp >> WORD_SIZE); PUSH_DS(dtemp); }")
+   :readch "{ char ch = 0; read_char(io, &ch); PUSH_DS((WORD)ch & 0xff); }"
+   :bufstore "atemp = POP_DS(); memory[bfp + atemp] = POP_DS();"
+   :high "PUSH_DS((S0 >> BYTE_SIZE) & 0xff);"
+   :low "PUSH_DS(S0 & 0xff);"
+   :unpack (str "temp = S0; PUSH_DS((temp >> BYTE_SIZE) & 0xff);"
+                " PUSH_DS(temp & 0xff);")
+   :pack "temp = POP_DS(); S0 = temp | (S0 << BYTE_SIZE);"
+   :fmult (str "{ long long inter = (long long)D2 * (long long)D0;"
+               " DRESULT(2, inter / SCALES[ DEFAULT_SCALE ]); }")
+   :fdiv (str "{ double inter = (double)D2 / (double)D0;"
+              " DRESULT(2, inter * SCALES[ DEFAULT_SCALE ]); }")
+   :fmultsc (str "{ temp = POP_DS(); if (temp && temp < SCALE_MAX)"
+                 " dtemp = SCALES[temp]; else dtemp = SCALES[ DEFAULT_SCALE ];"
+                 " long long inter = (long long)D2 * (long long)D0;"
+                 " DRESULT(2, inter / dtemp); }")
+   :fdivsc (str "{ temp = POP_DS(); if (temp && temp < SCALE_MAX)"
+                " dtemp = SCALES[temp]; else dtemp = SCALES[ DEFAULT_SCALE ];"
+                " double inter = (double)D2 / (double)D0;"
+                " DRESULT(2, inter * dtemp); }")})
+
+(defn check-dsp
+  [next-addr]
+  (str " if (!VERIFIED && dsp > END_STACK)"
+       " { pc = " next-addr "; goto registers_error; }"))
+
+(defn check-rsp
+  [next-addr]
+  (str " if (!VERIFIED && rsp > END_RETURN)"
+       " { pc = " next-addr "; goto registers_error; }"))
+
+(def check-jump
+  (str " if (!VERIFIED && (dsp > END_STACK || rsp > END_RETURN))"
+       " goto registers_error;"))
+
+(defn check-writes
+  "Hands the run back to the VM at next-addr if memory from start up to end
+  was part of the code, so it runs the code that was written, with checks
+  since that code was not verified."
+  [start end next-addr]
+  (str " if (writes_code(" start ", " end ", CODE_START, bfp))"
+       " { vm->verified = false; pc = " next-addr "; goto interpret; }"))
+
+(defn goto-addr
+  "A goto for an address known when translating. Addresses that are not
+  labelled go through the dispatch switch."
+  [addr labels]
+  (if (contains? labels addr)
+    (str " goto L" addr ";")
+    (str " pc = " addr "; goto dispatch;")))
+
+(defn mem
+  "The memory for an address, offset by fmp unless the op's flag says its
+  address is absolute, i.e. :load-lb."
+  [flag addr]
+  (if (odd? flag)
+    (str "memory[" addr "]")
+    (str "memory[fmp + " addr "]")))
+
+(defn mem-start
+  [flag addr]
+  (if (odd? flag) addr (str "fmp + " addr)))
+
+(defn instr->c
+  "Given a decoded instruction and the set of labelled addresses returns
+  the C statements for it."
+  [{:keys [addr op flag args next]} labels]
+  (let [arg (first args)
+        imm (bit-and (or arg 0) 0xffff)]
+    (cond
+      (contains? binary-exprs op)
+      (str "BINARY(" (binary-exprs op) ");" (check-dsp next))
+
+      (contains? dresult-exprs op)
+      (let [[k expr] (dresult-exprs op)]
+        (str "DRESULT(" k ", " expr ");" (when (pos? k) (check-dsp next))))
+
+      (contains? unchecked-ops op)
+      (unchecked-ops op)
+
+      (contains? checked-ops op)
+      (let [body (checked-ops op)]
+        (if (vector? body)
+          (str (first body) (check-dsp next) (check-rsp next))
+          (str body (check-dsp next))))
+
+      :else
+      (case op
+        :halt "goto halt;"
+        :push (str "PUSH_DS(" arg ");" (check-dsp next))
+        :dpush (str "PUSH_DS(" arg "); PUSH_DS(" (second args) ");"
+                    (check-dsp next))
+        :pc (str "PUSH_DS(" addr ");" (check-dsp next))
+
+        :load (str "S0 = " (mem flag "(ADDRESS)S0") ";")
+        :store (str "atemp = S0; " (mem flag "atemp") " = S1; DROP2;"
+                    (check-dsp next)
+                    (check-writes (mem-start flag "atemp")
+                                  (str (mem-start flag "atemp") " + 1")
+                                  next))
+        :dload (str "atemp = POP_DS(); PUSH_DS(" (mem flag "atemp") ");"
+                    " PUSH_DS(" (mem flag "atemp + 1") ");"
+                    (check-dsp next))
+        :dstore (str "atemp = POP_DS(); " (mem flag "atemp") " = S1; "
+                     (mem flag "atemp + 1") " = S0; DROP2;"
+                     (check-dsp next)
+                     (check-writes (mem-start flag "atemp")
+                                   (str (mem-start flag "atemp") " + 2")
+                                   next))
+        :prnmem (str "atemp = POP_DS(); print_string(io, memory, "
+                     (mem-start flag "atemp") ", END_MEMORY);"
+                     (check-dsp next))
+
+        :mem-to-buf
+        (case flag
+          0 (str "utemp = POP_DS(); atemp = POP_DS();"
+                 " memcpy(memory + bfp, memory + fmp + atemp, utemp * 2);"
+                 (check-dsp next))
+          1 (str "utemp = POP_DS(); atemp = POP_DS();"
+                 " memcpy(memory + fmp + atemp, memory + bfp, utemp * 2);"
+                 (check-dsp next)
+                 (check-writes "fmp + atemp" "fmp + atemp + utemp" next))
+          (str "utemp = POP_DS();" (check-dsp next)))
+        :str-to-buf
+        (case flag
+          0 (str "atemp = POP_DS(); utemp = string_length(memory, fmp + atemp);"
+                 " memcpy(memory + bfp, memory + fmp + atemp, utemp * 2);"
+                 (check-dsp next))
+          1 (str "atemp = POP_DS(); utemp = string_length(memory, bfp);"
+                 " memcpy(memory + fmp + atemp, memory + bfp, utemp * 2);"
+                 (check-dsp next)
+                 (check-writes "fmp + atemp" "fmp + atemp + utemp" next))
+          (subs (check-dsp next) 1))
+
+        :jump (str "pc = POP_DS();" check-jump " goto dispatch;")
+        :branch (str "atemp = POP_DS(); temp = POP_DS();"
+                     " if (temp) { pc = atemp;" check-jump " goto dispatch; }"
+                     (check-dsp next))
+        :call (str "return_stack[++rsp] = " next "; pc = POP_DS();" check-jump
+                   " goto dispatch;")
+        :ret (str "pc = return_stack[rsp--];" check-jump " goto dispatch;")
+
+        :loadi (str "PUSH_DS(" (mem flag imm) ");" (check-dsp next))
+        :storei (str (mem flag imm) " = S0; DROP1;"
+                     (check-dsp next)
+                     (check-writes (mem-start flag imm)
+                                   (str (mem-start flag imm) " + 1")
+                                   next))
+        :dloadi (str "PUSH_DS(" (mem flag imm) "); PUSH_DS("
+                     (mem flag (str imm " + 1")) ");"
+                     (check-dsp next))
+        :dstorei (str (mem flag imm) " = S1; " (mem flag (str imm " + 1"))
+                      " = S0; DROP2;"
+                      (check-dsp next)
+                      (check-writes (mem-start flag imm)
+                                    (str (mem-start flag imm) " + 2")
+                                    next))
+        :jumpi (subs (goto-addr imm labels) 1)
+        :branchi (str "if (POP_DS()) { pc = " imm ";" check-jump
+                      (goto-addr imm labels) " }"
+                      (check-dsp next))
+        :calli (str "return_stack[++rsp] = " next "; pc = " imm ";" check-jump
+                    (goto-addr imm labels))
+        :snapshot (str "pc = " next "; goto pause;")
+
+        ;; Unused and unknown op codes are reported by the VM
+        (str "pc = " addr "; goto interpret;")))))
+
+(defn uses?
+  "Checks if a name is used as a whole word in some C code."
+  [c-code name]
+  (boolean (re-find (re-pattern (str "\\b" name "\\b")) c-code)))
+
+(defn translate
+  "Given an assembled byte array for a program returns the C for
+  aot_execute, which runs the program the same way as execute in lt64.c.
+  It is appended after the single file VM and the program, and is used
+  when lt64.c is built with LT64_AOT defined. A program with a :snapshot
+  op is paused there and carries on from the VM's registers when it is
+  run again."
+  [program-bytes]
+  (let [words (b/bytes->words program-bytes)
+        instrs (decode words)
+        dispatched (dispatch-targets instrs)
+        labels (into dispatched (static-targets instrs))
+        end (:next (peek instrs) 0)
+        resume (when (some #(= :snapshot (:op %)) instrs)
+                 "  if (pc)\n    goto dispatch;\n\n")
+        body (str resume
+                  (->> instrs
+                       (map #(str (when (contains? labels (:addr %))
+                                    (str "L" (:addr %) ":\n"))
+                                  "  " (instr->c % labels) "\n"))
+                       (apply str))
+                  "  pc = " end "; goto interpret;\n")
+        tail (str (when (uses? body "dispatch")
+                    (str "dispatch:\n"
+                         "  switch (pc) {\n"
+                         (->> (sort dispatched)
+                              (map #(str "    case " % ": goto L" % ";\n"))
+                              (apply str))
+                         "  }\n"))
+                  "interpret:\n"
+                  "  SPILL();\n"
+                  "  return aot_interpret(vm, dsp, rsp, pc);\n"
+                  (when (uses? body "registers_error")
+                    (str "registers_error:\n"
+                         "  return check_registers(pc, bfp, dsp, rsp);\n"))
+                  (when (uses? body "halt")
+                    (str "halt:\n"
+                         "  if (TESTING) {\n"
+                         "    SPILL();\n"
+                         "    display_range(io, data_stack, 0x0001, dsp + 1,"
+                         " false);\n"
+                         "  }\n"
+                         "  return LT64_HALTED;\n"))
+                  (when (uses? body "pause")
+                    (str "pause:\n"
+                         "  SPILL();\n"
+                         "  vm->dsp = dsp;\n"
+                         "  vm->rsp = rsp;\n"
+                         "  vm->pc = pc;\n"
+                         "  flush_output(io);\n"
+                         "  return LT64_PAUSED;\n")))
+        locals (->> [["WORD*" "memory" "vm->memory"]
+                     ["WORD*" "return_stack" "vm->return_stack"]
+                     ["LT64_IO*" "io" "&vm->io"]
+                     ["ADDRESS" "bfp" "vm->length"]
+                     ["ADDRESS" "fmp" "vm->length + BUFFER_SIZE"]
+                     ["ADDRESS" "CODE_START" (bit-and (second words) 0xffff)]
+                     ["ADDRESS" "atemp" 0] ["WORD" "temp" 0]
+                     ["WORDU" "utemp" 0] ["DWORD" "dtemp" 0]]
+                    (filter #(uses? (str body tail) (second %)))
+                    (map (fn [[type name value]]
+                           (str "  " type " " name " = " value ";\n")))
+                    (apply str))]
+    (str "\n/// aot_execute, translated by lt64-asm ///\n"
+         "size_t aot_execute(LT64_VM* vm) {\n"
+         "  if (DEBUGGING || PROFILING)\n"
+         "    return lt64_run(vm, 0);\n"
+         "\n"
+         "  ADDRESS dsp = vm->dsp, rsp = vm->rsp, pc = vm->pc;\n"
+         "  WORD* data_stack = vm->data_stack;\n"
+         "  (void)data_stack;\n"
+         locals
+         "#ifdef LT64_TOS\n"
+         "  WORD tos = data_stack[dsp], popped = 0;\n"
+         "  (void)popped;\n"
+         "#endif\n"
+         "\n"
+         body
+         tail
+         "}\n")))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+;; push 5, jump, static word 99, push 7, wprn, halt
+(def test-words [0x01 5 0x3d 99 0 0x01 7 0x45 0x00])
+(decode test-words)
+(dispatch-targets (decode test-words))
+; #{5}
+
+(instr->c {:addr 5 :op :push :flag 0 :args [7] :next 7} #{})
+(instr->c {:addr 9 :op :jumpi :flag 0 :args [5] :next 11} #{5})
+
+(println (translate (b/->bytes [1 0 5 0 0x3d 0 99 0 0 0 1 0 7 0 0x45 0 0 0])))
+;
+),
@@ -95,6 +95,11 @@
   [op]
   (num->bytes (sym/op->code op) {:kind :word}))
 
+(defn op->word
+  "Given an op symbol returns the word for its op code."
+  [op]
+  (nums/num->word (sym/op->code op)))
+
 (defn ->bytes
   "Turn a sequence of numbers representing bytes to an actual byte array.
   If numbers in the byte-seq are to large or small they will wrap around
@@ -102,6 +107,17 @@
   [byte-seq]
   (byte-array (map unchecked-byte byte-seq)))
 
+(defn words->bytes
+  "Turn a short array of words into a byte array with the low byte of each
+  word first, the order the VM loads them in."
+  [^shorts words]
+  (let [out (byte-array (* word-size (alength words)))]
+    (dotimes [i (alength words)]
+      (let [word (aget words i)]
+        (aset out (* 2 i) (unchecked-byte word))
+        (aset out (inc (* 2 i)) (unchecked-byte (bit-shift-right word 8)))))
+    out))
+
 (defn write-bytes
   "Given a filename and a byte array from ->bytes writes the bytes to the
   file as binary data."
@@ -109,6 +125,17 @@
     (with-open [out (jio/output-stream (jio/file filename))]
       (.write out bytes_)))
 
+(defn bytes->words
+  "Given an assembled byte array for a program pairs up its little endian
+  bytes into the signed words the VM will load them as. An odd last byte is
+  padded with 0."
+  [program-bytes]
+  (->> (concat program-bytes (when (odd? (count program-bytes)) [0]))
+       (partition 2)
+       (map (fn [[lo hi]]
+              (unchecked-short (bit-or (bit-and lo 0xff)
+                                       (bit-shift-left (bit-and hi 0xff) 8)))))))
+
 ;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (comment
   
@@ -4,10 +4,17 @@
             [lt64-asm.bytes :as b]
             [lt64-asm.program :as prog]
             [lt64-asm.files :as files]
+            [lt64-asm.profile :as profile]
+            [lt64-asm.pgo :as pgo]
+            [lt64-asm.module :as module]
+            [lt64-asm.shake :as shake]
+            [lt64-asm.inline :as inline]
+            [lt64-asm.verify :as verify]
             [clojure.edn :as edn]
             [clojure.tools.cli :refer [parse-opts]]
             [clojure.java.shell :refer [sh]]
             [clojure.java.io :as jio])
+  (:import [java.util.concurrent Executors Future])
   (:gen-class))
 
 ;;; Command Line Arg Parsing ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -22,9 +29,95 @@
          " to an executable that does not depend on the VM directly."
          " Of course this is because the VM is included in the C file.\n"
          "C file will be named with given path with a .c extension."
-         "I.e. -c some/path  ->  some/path.c\n"
-         "If no output path is given the file will be named a.c")
-    :default "a.c"]
+         "I.e. -c some/path  ->  some/path.c")]
+   ["-n"
+    "--no-fuse"
+    (str "Assemble ops exactly as written. By default common op sequences,"
+         " like :push followed by :load-lb, :branch, or :call, are fused"
+         " into single VM ops.")]
+   [nil
+    "--no-shake"
+    (str "Assemble every proc, even ones that are never used. By default"
+         " procs that main can't reach through the labels it uses, or that"
+         " the procs it reaches use, are left out.")]
+   [nil
+    "--no-peephole"
+    (str "Assemble the ops as written after fusing them. By default calls"
+         " to small procs are inlined, constants are folded, ops that cancel"
+         " out are removed, jumps to jumps go straight to where the last one"
+         " goes, and calls before a :ret become jumps. -n also turns this"
+         " off.")]
+   ["-v"
+    "--verbose"
+    (str "Print reports of what the assembler changed in the program to"
+         " stderr, i.e. the calls it inlined, the unused procs it left out,"
+         " and the peephole rules it applied, and with -c where the program"
+         " could not be verified.")]
+   ["-a"
+    "--aot"
+    (str "With -c, also translate the program ahead of time into C that"
+         " runs in place of the VM's interpreter. Jumps and calls to labels"
+         " become gotos. Anything else is handed back to the interpreter.")]
+   [nil
+    "--no-verify"
+    (str "With -c, always build the VM with its stack and jump checks. By"
+         " default the C file for a program that can be shown to never take"
+         " its stacks out of bounds or jump outside its code is run without"
+         " them.")]
+   ["-s"
+    "--subset"
+    (str "With -c, only include the VM's handlers for the ops the program"
+         " uses. Any other op is reported as unknown, so it should not be"
+         " used by programs that write ops into their own code.")]
+   ["-e"
+    "--emit MODE"
+    (str "How the program is written into the C file made with -c. One of"
+         " words, a WORD array copied into memory in one go, bytes, a char"
+         " array with a number for each byte, incbin, an .incbin of the"
+         " assembled binary for GCC and Clang, or embed, a C23 #embed of the"
+         " binary. incbin and embed also write the binary next to the C"
+         " file, i.e. -c some/path.c -> some/path.ltb")
+    :default "words"
+    :validate [files/emit-modes
+               (str "Must be one of: "
+                    (clojure.string/join ", " (sort files/emit-modes)))]]
+   ["-g"
+    "--pgo SAMPLE_PATH"
+    (str "With -c, also build the C file with profile guided and link time"
+         " optimization, trained by running it with SAMPLE_PATH as its"
+         " input. Can be given more than once. The executable is written"
+         " next to the C file, i.e. -c some/path.c -> some/path, and the"
+         " time it takes on the samples is compared to a plain build. Uses"
+         " gcc, or CC, with CFLAGS, which is -O2 by default.")
+    :assoc-fn (fn [m k v] (update m k (fnil conj []) v))]
+   [nil
+    "--cache-dir DIR"
+    (str "Where included modules are cached once they are assembled, so"
+         " programs that include them only have to link them. Defaults to"
+         " LT64_ASM_CACHE, or ~/.cache/lt64-asm if it is not set.")]
+   [nil
+    "--no-cache"
+    (str "Expand included modules into every program that includes them"
+         " instead of using cached objects.")]
+   ["-p"
+    "--profile PROFILE_PATH"
+    (str "Print the profile written by a VM built with -DLT64_PROFILE, i.e."
+         " lt64.prof, with its addresses named by the labels and procs of"
+         " FILE. FILE should be assembled with the same options as the"
+         " program that was profiled, so the addresses match.")]
+   ["-b"
+    "--batch"
+    (str "Assemble many programs in one run, in parallel. The arguments are"
+         " pairs of input and output paths, i.e. a.lta a.ltb b.lta b.c. An"
+         " output path ending in .c is made into a standalone C file like"
+         " with -c, using -e, -a, and -s.")]
+   [nil
+    "--server"
+    (str "Assemble programs for requests read from stdin until it closes."
+         " Each line is a request with the arguments of a batch run, i.e."
+         " a.lta a.ltb b.lta b.c -a, and is answered with a line on stdout,"
+         " ok or error and the errors. Saves starting the JVM for every"
+         " file in a build.")]
    ["-h" "--help"]])
 
 (defn help-text
@@ -49,55 +142,206 @@
     {:bytes words
      :counter (count words)
      :labels {}
-     :user-macros {}}))
+     :user-macros {}
+     :fuse true}))
 
 (defn setup-bytes
-  "Given program data returns the bytes as a byte array in the correct order
-  and format for the VM.
-  This reverses and flattens the bytes returned from all the byte functions
-  to get them in the right order. It also sets up the address for the initial
-  jump to get past the static data and combines all bytes together. Finally
-  returning them as a byte array."
+  "Given program data from the second pass returns the words it assembled
+  as a byte array in the order the VM loads them, without the zeroed static
+  data, see stat/remove-bss."
   [program-data]
-  (let [start (reverse
-                (concat
-                  (b/num->bytes
-                    (:start-address program-data)
-                    {:kind :word})
-                  (b/op->bytes :push)))]
-    (->> program-data
-         :bytes
-         flatten
-         reverse
-         (drop 4)
-         (concat start)
-         b/->bytes)))
+  (b/words->bytes (stat/remove-bss (:words program-data) program-data)))
+
+(defn prepare
+  "Given a list representing an lt64-asm program returns its main, its
+  procs, and the program data after processing the static data and
+  includes. Included modules are loaded from the cache as objects unless
+  :no-cache is set, see lt64-asm.module. Unless :no-fuse or :no-peephole
+  is set, calls to small procs are inlined, see lt64-asm.inline. Unused
+  procs are then removed unless :no-shake is set, see lt64-asm.shake, and
+  the peephole rules are run over main and the procs that are left.
+  Options are the parsed command line options, only :no-fuse, :no-cache,
+  :cache-dir, :no-shake, and :no-peephole are used."
+  [file options]
+  (let [[static main & procs-and-includes] (files/lt64-program file)
+        cache (when-not (:no-cache options)
+                (or (:cache-dir options) (module/default-cache-dir)))
+        peephole (not (or (:no-fuse options) (:no-peephole options)))
+        {:keys [procs data]} (files/expand-all
+                               procs-and-includes
+                               (assoc initial-prog-data
+                                      :fuse (not (:no-fuse options))
+                                      :peephole peephole
+                                      :cache cache))
+        {:keys [procs data]} (module/load-all procs data)
+        [main procs data] (if (:peephole data)
+                            (inline/inline main procs data)
+                            [main procs data])
+        {:keys [procs data]} (if (:no-shake options)
+                               {:procs procs :data data}
+                               (shake/shake main procs data))
+        [main procs data] (if (:peephole data)
+                            (prog/optimize main procs data)
+                            [main procs data])]
+    [main procs (stat/process-static static data)]))
+
+(defn print-reports
+  "Print the reports of the passes that changed the program to stderr."
+  [program-data]
+  (binding [*out* *err*]
+    (when-let [inlined (:inlined program-data)]
+      (print (inline/report inlined)))
+    (when-let [shaken (:shaken program-data)]
+      (print (shake/report shaken)))
+    (when-let [optimized (:optimized program-data)]
+      (print (prog/optimize-report optimized)))
+    (flush)))
+
+(defn print-verify-report
+  "Print the report of verifying a program for its C file to stderr, given
+  the errors create-standalone-cfile returned."
+  [errors options]
+  (when (and errors (:verbose options))
+    (binding [*out* *err*]
+      (print (verify/report errors))
+      (flush))))
 
 (defn assemble
   "Given a list representing an lt64-asm program return the assembled
-  byte array."
-  [file]
-  (let [[static main & procs-and-includes] (files/lt64-program file)
-        {:keys [procs data]} (files/expand-all procs-and-includes
-                                               initial-prog-data)]
-    (->> data
-         (stat/process-static static)
-         (prog/first-pass main procs)
-         (prog/second-pass main procs)
-         setup-bytes)))
+  byte array.
+  Options are the parsed command line options, see prepare. With
+  :verbose the reports of the passes that changed it are printed."
+  ([file] (assemble file {}))
+  ([file options]
+   (let [[main procs data] (prepare file options)
+         data (->> data
+                   (prog/first-pass main procs)
+                   (prog/second-pass main procs))]
+     (when (:verbose options)
+       (print-reports data))
+     (setup-bytes data))))
+
+(defn build-pgo
+  "Build the C file at cfile with profile guided optimization trained on
+  the samples in :pgo and print how long it takes on them."
+  [cfile options]
+  (try
+    (print (pgo/build cfile (:pgo options)))
+    (catch Exception e
+      (binding [*out* *err*]
+        (println)
+        (println "*** Build Failed ***")
+        (println (.getMessage e))))))
 
 (defn assemble-cfile
-  [infile outfile]
+  [infile outfile options]
   (try
-    (files/create-standalone-cfile
-      (assemble (files/get-program infile))
-      outfile)
+    (-> (assemble (files/get-program infile) options)
+        (files/create-standalone-cfile outfile options)
+        (print-verify-report options))
+    (when (:pgo options)
+      (build-pgo outfile options))
     (catch Exception e
       (binding [*out* *err*]
         (println)
         (println "*** Assembly Failed ***")
         (println (.getMessage e))))))
 
+(defn print-profile
+  "Print the profile at profile-path with its addresses named by the labels
+  and procs of the program in infile."
+  [infile profile-path options]
+  (try
+    (let [[main procs data] (prepare (files/get-program infile) options)]
+      (print (profile/report (profile/read-profile profile-path)
+                             (prog/first-pass main procs data)
+                             (concat (map second procs)
+                                     (mapcat :procs (:objects data))))))
+    (catch Exception e
+      (binding [*out* *err*]
+        (println)
+        (println "*** Profile Failed ***")
+        (println (.getMessage e))))))
+
+
+;;; Batch and Server ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn assemble-file
+  "Assemble the program in infile and write it to outfile, as a standalone
+  C file if outfile ends in .c and as a binary otherwise. Every program is
+  assembled from initial-prog-data and nothing else is shared, so no labels
+  or macros carry over from one program to the next.
+  Throws if the program cannot be assembled."
+  [infile outfile options]
+  (let [program (assemble (files/get-program infile) options)]
+    (if (clojure.string/ends-with? outfile ".c")
+      (-> (files/create-standalone-cfile program outfile options)
+          (print-verify-report options))
+      (b/write-bytes outfile program))))
+
+(defn assemble-batch
+  "Given pairs of input and output paths assemble each with assemble-file
+  on a pool with a thread for each processor. Returns the errors of the
+  pairs that failed, in order, or an empty list if they all worked."
+  [pairs options]
+  (let [pool (Executors/newFixedThreadPool
+               (.availableProcessors (Runtime/getRuntime)))]
+    (try
+      (->> pairs
+           (mapv (fn [[infile outfile]]
+                   (.submit pool
+                            ^Callable
+                            (fn []
+                              (try
+                                (assemble-file infile outfile options)
+                                nil
+                                (catch Exception e
+                                  (str infile ": " (.getMessage e))))))))
+           (keep #(.get ^Future %))
+           vec)
+      (finally
+        (.shutdown pool)))))
+
+(defn batch-errors
+  "Given the parsed options and arguments of a batch run assemble each pair
+  of input and output paths in the arguments. Returns the errors for any
+  that failed."
+  [options arguments]
+  (if (odd? (count arguments))
+    ["Error: Batch arguments must be pairs of input and output paths"]
+    (assemble-batch (partition 2 arguments) options)))
+
+(defn run-batch
+  "Assemble the pairs of input and output paths in the arguments and print
+  the errors for any that failed."
+  [options arguments]
+  (when-let [errors (seq (batch-errors options arguments))]
+    (binding [*out* *err*]
+      (println)
+      (println "*** Assembly Failed ***")
+      (doseq [error errors]
+        (println error)))))
+
+(defn serve
+  "Answer assembly requests read from stdin until it closes. Each line is
+  the arguments of a batch run and is answered with a line on stdout, ok
+  if every program was assembled and otherwise error followed by the
+  errors. Requests are handled one at a time, but the programs in each are
+  assembled in parallel."
+  []
+  (doseq [line (line-seq (jio/reader *in*))
+          :when (not (clojure.string/blank? line))]
+    (let [{:keys [options arguments errors]}
+          (parse-opts (clojure.string/split (clojure.string/trim line) #"\s+")
+                      cli-opts)
+          errors (or errors (batch-errors options arguments))]
+      (println (if (empty? errors)
+                 "ok"
+                 (str "error "
+                      (clojure.string/join
+                        " | " (map #(clojure.string/replace % #"\s+" " ")
+                                   errors)))))
+      (flush))))
+
 
 ;;; Main ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (defn -main
@@ -114,11 +358,18 @@
                  (println (str "  " (clojure.string/join "\n  " errors)))
                  (println "\nRun with --help for usage and examples"))
       (:help options) (help-text summary)
+      (:server options) (serve)
       (empty? arguments) (println "Error: No input file given")
+      (:batch options) (run-batch options arguments)
+      (:profile options) (print-profile (first arguments)
+                                        (:profile options)
+                                        options)
       (:cfile options) (assemble-cfile (first arguments)
-                                       (:cfile options))
+                                       (:cfile options)
+                                       options)
       :else (b/write-bytes (:output-path options)
-                            (assemble (files/get-program (first arguments)))))))
+                            (assemble (files/get-program (first arguments))
+                                      options)))))
 
 ;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (comment
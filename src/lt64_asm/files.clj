@@ -2,6 +2,10 @@
   (:require 
     [lt64-asm.symbols :as sym]
     [lt64-asm.stdlib :as stdlib]
+    [lt64-asm.bytes :as b]
+    [lt64-asm.aot :as aot]
+    [lt64-asm.subset :as subset]
+    [lt64-asm.verify :as verify]
     [clojure.java.io :as jio]
     [clojure.edn :as edn]))
 
@@ -69,16 +73,26 @@
 (declare expand-all)
 (defn include
   "Loads and expands the file in an include directive.
-  The expansion may load and expand submodules in the included file.
+  When program-data has a :cache directory the file is only added to its
+  :modules, to be loaded as a pre-assembled object by lt64-asm.module.
+  Otherwise it is added to its :deps and its procs are expanded in place,
+  which may load and expand submodules in the included file.
   Throws if the file cannot be processed or is not a valid lt64-asm module."
   [[_ filename & proc-names] program-data]
-  (if (= filename "stdlib")
+  (cond
+    (= filename "stdlib")
     {:procs (include-stdlib proc-names) :data program-data}
+
+    (:cache program-data)
+    {:procs '()
+     :data (update program-data :modules (fnil conj []) filename)}
+
+    :else
     (expand-all
       (->> filename
            get-program
            lt64-module)
-      program-data)))
+      (update program-data :deps (fnil conj []) filename))))
 
 (defn process-includes
   [includes program-data]
@@ -117,29 +131,93 @@
                     "Most likely there are circular dependencies."))))))
 
 ;;; C file creation ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; The ways the program can be written into a standalone C file
+(def emit-modes #{"words" "bytes" "incbin" "embed"})
+
+(defn blob-path
+  "Given the path for a C file returns the path for the program binary that
+  is written next to it by the incbin and embed modes.
+  I.e. some/path.c -> some/path.ltb"
+  [path]
+  (str (clojure.string/replace path #"\.c$" "") ".ltb"))
+
 (defn wrap-prog
   "Given an assembled byte array for a program converts it to a string
   and wraps it in the C code necessary to append it to the end of the single
-  file VM."
-  [program-bytes]
-  (str "size_t prog_length() { return " (count program-bytes) ";  }\n"
-       "void set_program(WORD* mem, size_t length) {\n"
-       "  char program[] = { "
-       (clojure.string/join ", " program-bytes)
-       " };\n"
-       "  memcpy(mem, program, length);\n"
-       "}\n"))
+  file VM.
+  The emit mode picks how the program is written:
+  - words: a static WORD array copied into memory with one memcpy
+  - bytes: a decimal char array for each byte, the original format
+  - incbin: an .incbin of the binary at blob-path, needs the GNU assembler
+  - embed: a C23 #embed of the binary at blob-path
+  For incbin and embed the binary must be written to blob-path separately."
+  ([program-bytes] (wrap-prog program-bytes "words" "a.c"))
+  ([program-bytes mode path]
+   (str "size_t prog_length() { return " (count program-bytes) ";  }\n"
+        (case mode
+          "bytes"
+          (str "void set_program(WORD* mem, size_t length) {\n"
+               "  char program[] = { "
+               (clojure.string/join ", " program-bytes)
+               " };\n")
+          "words"
+          (str "static const WORD program[] = {\n"
+               (->> (b/bytes->words program-bytes)
+                    (partition-all 16)
+                    (map #(str "  " (clojure.string/join "," %) ",\n"))
+                    (apply str))
+               "};\n"
+               "void set_program(WORD* mem, size_t length) {\n")
+          "incbin"
+          (str "__asm__(\".section .rodata\\n\"\n"
+               "        \".balign 2\\n\"\n"
+               "        \"lt64_program:\\n\"\n"
+               "        \".incbin \\\""
+               (.getAbsolutePath (jio/file (blob-path path)))
+               "\\\"\\n\"\n"
+               "        \".previous\\n\");\n"
+               "extern const WORD lt64_program[];\n"
+               "void set_program(WORD* mem, size_t length) {\n"
+               "  const WORD* program = lt64_program;\n")
+          "embed"
+          (str "static const unsigned char program[] = {\n"
+               "#embed \"" (.getName (jio/file (blob-path path))) "\"\n"
+               "};\n"
+               "void set_program(WORD* mem, size_t length) {\n"))
+        "  memcpy(mem, program, length);\n"
+        "}\n")))
 
 (defn create-standalone-cfile
   "Given an assembled byte array for a program combines it with the single
   file VM to create a standalone single file C program.
   The produced program does not need a compiled VM to run, as it contains the
   VM inside of it. Greatly increases program size in order to package the VM
-  and program, but allows easier portability of the program."
-  [program-bytes path]
-  (spit path
-        (str (slurp (jio/resource "lt64.c"))
-             (wrap-prog program-bytes))))
+  and program, but allows easier portability of the program.
+  Options are the parsed command line options, only :emit, :aot, :subset,
+  and :no-verify are used. The incbin and embed modes also write the
+  program binary next to the C file. With :aot the program is also
+  translated to C by aot/translate and the VM is set to run that instead of
+  interpreting it. With :subset the VM only has the handlers for the ops
+  the program uses. Unless :no-verify is set the program is checked by
+  verify/verify, and if it is verified the VM is set to run it without
+  checking its registers.
+  Returns the errors from verify/verify, or nil with :no-verify."
+  ([program-bytes path] (create-standalone-cfile program-bytes path {}))
+  ([program-bytes path options]
+   (let [mode (:emit options "words")
+         errors (when-not (:no-verify options)
+                  (verify/verify program-bytes))]
+     (when (#{"incbin" "embed"} mode)
+       (with-open [out (jio/output-stream (jio/file (blob-path path)))]
+         (.write out program-bytes)))
+     (spit path
+           (str (when (:aot options) "#define LT64_AOT\n")
+                (when (and errors (empty? errors)) "#define LT64_VERIFIED\n")
+                (cond-> (slurp (jio/resource "lt64.c"))
+                  (:subset options) (subset/specialize program-bytes))
+                (wrap-prog program-bytes mode path)
+                (when (:aot options) (aot/translate program-bytes))))
+     errors)))
 
 ;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (comment
@@ -0,0 +1,173 @@
+(ns lt64-asm.inline
+  (:require [lt64-asm.symbols :as sym]
+            [lt64-asm.program :as prog]
+            [lt64-asm.shake :as shake]
+            [clojure.string :as string]))
+
+;; The most words a proc's body can take, without its :ret, to be inlined.
+;; A call takes 2 words and 2 dispatches with its :ret, so a body this size
+;; adds at most 6 words for each call it replaces.
+(def inline-limit 8)
+
+;; Ops that use the return stack or the address they are at, so they would
+;; do something else without the call
+(def call-ops #{:call :calli :rpush :rpop :rgrab :drpush :drpop :drgrab :pc})
+
+;;; Finding Procs To Inline ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn leaf-labels
+  "Given the ops of a proc without its final :ret returns the set of labels
+  it declares if every jump and branch in it goes to one of them, and it
+  makes no calls and does not use the return stack. Otherwise nil."
+  [ops]
+  (let [n (count ops)]
+    (loop [i 0
+           declares #{}
+           targets #{}]
+      (if (>= i n)
+        (when (every? declares targets)
+          declares)
+        (let [op (nth ops i)
+              [jump label length] (prog/transfer (subvec ops i))]
+          (cond
+            (#{:jump :branch} jump)
+            (recur (+ i length) declares (conj targets label))
+
+            (or (contains? call-ops op)
+                (#{:jump :branch :jumpi :branchi} op))
+            nil
+
+            (sym/label? op)
+            (recur (+ i 2) (conj declares (get ops (inc i))) targets)
+
+            :else
+            (recur (+ i (prog/op-length op)) declares targets)))))))
+
+(defn inline-body
+  "Given a proc and its ops with macros expanded returns a map of the :ops
+  to inline in place of a call to it and the :labels they declare, or nil
+  if it can't be inlined. A proc can be inlined if it is not marked
+  :no-inline, ends with :ret, is a leaf, see leaf-labels, and is no bigger
+  than inline-limit. A :ret before the end becomes a jump to the end."
+  [proc ops program-data]
+  (when (and (= :ret (peek ops))
+             (not-any? sym/annotation? (drop 2 proc)))
+    (let [body (pop ops)
+          labels (leaf-labels body)]
+      (when (and labels
+                 (<= (prog/ops-size body program-data) inline-limit))
+        {:ops body :labels labels}))))
+
+(defn inline-copy
+  "Given the map from inline-body for a proc and a number that is unique to
+  the call being replaced, returns the ops for the call. Its labels are
+  renamed with the number so each copy has its own."
+  [{:keys [ops labels]} n]
+  (let [rename #(if (contains? labels %) (symbol (str % "#" n)) %)
+        end (symbol (str "inline-end#" n))
+        length (count ops)]
+    (loop [i 0
+           out (transient [])
+           ends? false]
+      (if (>= i length)
+        (persistent! (cond-> out ends? (conj! :label) ends? (conj! end)))
+        (let [op (nth ops i)]
+          (cond
+            (= op :ret)
+            (recur (inc i) (conj! (conj! (conj! out :push) end) :jump) true)
+
+            (= 2 (prog/op-length op))
+            (recur (+ i 2)
+                   (conj! (conj! out op) (rename (get ops (inc i))))
+                   ends?)
+
+            :else
+            (recur (inc i) (conj! out op) ends?)))))))
+
+;;; Inlining ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn inline-calls
+  "Replace every call in a vector of ops to a proc in inlinable, a map of
+  their names to the maps from inline-body, with a copy of its body. Adds
+  the name of the proc to the volatile vector inlined for each one."
+  [ops inlinable inlined]
+  (let [n (count ops)]
+    (loop [i 0
+           out (transient [])]
+      (if (>= i n)
+        (persistent! out)
+        (let [[op label length] (prog/transfer (subvec ops i))]
+          (if (and (= op :call) (contains? inlinable label))
+            (recur (+ i length)
+                   (reduce conj!
+                           out
+                           (inline-copy (get inlinable label)
+                                        (count (vswap! inlined conj label)))))
+            (let [length (prog/op-length (nth ops i))]
+              (recur (+ i length)
+                     (reduce conj!
+                             out
+                             (subvec ops i (min n (+ i length))))))))))))
+
+(defn inline
+  "Replace the calls in main and the procs to small leaf procs with their
+  bodies, see inline-body. The procs are left in place for anything else
+  that uses them, like a call from the object of a cached module, and
+  removed by lt64-asm.shake if nothing does. Labels in a proc that any
+  other code uses keep it from being inlined. Leaves everything as it is
+  if there is something that is not a proc, for the first pass to report.
+  Returns main, the procs with their macros expanded, and the program data
+  with the number of calls inlined for each proc in :inlined."
+  [main procs program-data]
+  (if-not (every? sym/proc? procs)
+    [main procs program-data]
+    (let [expand #(prog/expand-macros % (:user-macros program-data))
+          bodies (mapv expand (cons (rest main) (map #(drop 2 %) procs)))
+          used (mapv #(:uses (shake/op-labels %)) bodies)
+          used-elsewhere? (fn [labels i]
+                            (some #(some labels %)
+                                  (concat (subvec used 0 i)
+                                          (subvec used (inc i)))))
+          inlinable (into {}
+                          (for [[i proc] (map-indexed vector procs)
+                                :let [body (inline-body proc
+                                                        (nth bodies (inc i))
+                                                        program-data)]
+                                :when (and body
+                                           (not (used-elsewhere?
+                                                  (:labels body) (inc i))))]
+                            [(second proc) body]))
+          inlined (volatile! [])
+          bodies (mapv #(inline-calls % inlinable inlined) bodies)]
+      [(cons 'main (first bodies))
+       (map #(list* 'proc (second %1) %2) procs (rest bodies))
+       (assoc program-data :inlined (frequencies @inlined))])))
+
+(defn report
+  "Given the :inlined map from inline returns a report of the calls that
+  were inlined."
+  [inlined]
+  (str "Inlined " (reduce + (vals inlined)) " calls"
+       (when (seq inlined)
+         (->> (sort-by (comp str key) inlined)
+              (map (fn [[proc n]] (str proc " x" n)))
+              (string/join " ")
+              (str ": ")))
+       "\n"))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(def test-procs
+  '[(proc std/odd? :push 2 :mod :push 1 :eq :ret)
+    (proc abs :first :push 0 :lt :push abs/pos :branch :push -1 :mult
+          :label abs/pos :ret)
+    (proc kept :no-inline :push 1 :add :ret)])
+
+(leaf-labels [:push 2 :mod :push 1 :eq])
+(leaf-labels [:push 2 :call])
+(inline-copy {:ops '[:push a :branch :ret :label a] :labels #{'a}} 3)
+(inline '(main :push 3 :push std/odd? :call :push abs :call :push kept :call)
+        test-procs
+        {:user-macros {}})
+
+;
+)
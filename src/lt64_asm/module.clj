@@ -0,0 +1,156 @@
+(ns lt64-asm.module
+  (:require [lt64-asm.files :as files]
+            [lt64-asm.program :as prog]
+            [lt64-asm.inline :as inline]
+            [clojure.edn :as edn]
+            [clojure.java.io :as jio])
+  (:import [java.io File]
+           [java.nio.file CopyOption Files StandardCopyOption]
+           [java.security MessageDigest]))
+
+;; Changed whenever objects or the way they are assembled change, so the
+;; objects cached by another version of the assembler are not used.
+(def object-version 3)
+
+(defn default-cache-dir
+  "The directory objects are cached in when none is given. LT64_ASM_CACHE
+  if it is set, otherwise ~/.cache/lt64-asm"
+  []
+  (or (System/getenv "LT64_ASM_CACHE")
+      (str (System/getProperty "user.home") "/.cache/lt64-asm")))
+
+;;; Hashing ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn sha-256
+  "The SHA-256 hash of a byte array as a hex string."
+  [^bytes data]
+  (->> (.digest (MessageDigest/getInstance "SHA-256") data)
+       (map #(format "%02x" %))
+       (apply str)))
+
+(defn file-hash
+  "The SHA-256 hash of the contents of a file as a hex string."
+  [path]
+  (sha-256 (Files/readAllBytes (.toPath (jio/file path)))))
+
+(defn object-key
+  "The name the object for the module at path is cached under. A hash of
+  the module and of the flags that change how it is assembled, see
+  assembly-flags."
+  [path flags]
+  (sha-256 (.getBytes (str "lt64-asm object " object-version
+                           " " (pr-str (into (sorted-map) flags))
+                           " " (file-hash path)))))
+
+;;; Assembling Modules ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn assembly-flags
+  "The flags in program data that change how a module is assembled."
+  [program-data]
+  (select-keys program-data [:fuse :peephole]))
+
+(defn assemble-module
+  "Assemble the module at path into a relocatable object. Its procs are
+  assembled from address 0 with every label used as an argument left for
+  prog/link-object! to fill in, so it can be placed anywhere.
+  The object is a map of the module's :words, the offsets of its :labels,
+  the names of its :procs, its :relocs from prog/write-ops!, the :macros it
+  declares, and its :deps, the files it was assembled from with a hash of
+  each. Submodules it includes are expanded into it. Only its own macros
+  are used, so the object is the same whatever program includes it.
+  The flags are the ones from assembly-flags for the program including it.
+  Throws if the module cannot be assembled on its own."
+  [path flags]
+  (let [{:keys [procs data]} (files/expand-all
+                               (files/lt64-module (files/get-program path))
+                               (merge {:labels {} :counter 0 :user-macros {}}
+                                      flags))
+        [_ procs data] (if (:peephole data)
+                         (->> [procs data]
+                              (apply inline/inline '(main))
+                              (apply prog/optimize))
+                         [nil procs data])
+        data (prog/get-proc-labels procs data)
+        words (short-array (:counter data))
+        relocs (volatile! [])]
+    (reduce #(prog/write-ops! words %1 (prog/prepare-ops (drop 2 %2) data)
+                              (:labels data) relocs)
+            0
+            procs)
+    {:version object-version
+     :words (vec words)
+     :labels (:labels data)
+     :procs (mapv second procs)
+     :relocs @relocs
+     :macros (map (fn [[macro-name body]] (list* 'macro macro-name body))
+                  (:user-macros data))
+     :deps (mapv #(vector % (file-hash %)) (cons path (:deps data)))}))
+
+;;; Cache ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn read-object
+  "Read the object cached at path. Returns nil if there is none, it is from
+  another version, or any file it was assembled from has changed."
+  [path]
+  (try
+    (let [object (edn/read-string (slurp path))]
+      (when (and (= object-version (:version object))
+                 (every? (fn [[dep hash]] (= hash (file-hash dep)))
+                         (:deps object)))
+        object))
+    (catch Exception _ nil)))
+
+(defn write-object
+  "Cache an object at path. It is written to a temporary file and moved
+  into place, so programs assembled in parallel never read half of one."
+  [path object]
+  (let [file (jio/file path)]
+    (jio/make-parents file)
+    (let [tmp (File/createTempFile "object" ".tmp" (.getParentFile file))]
+      (spit tmp (pr-str object))
+      (Files/move (.toPath tmp) (.toPath file)
+                  (into-array CopyOption [StandardCopyOption/ATOMIC_MOVE])))))
+
+(defn load-object
+  "The object for the module at path, from the cache in cache-dir if it is
+  up to date and otherwise assembled and cached. A cache that cannot be
+  written is not an error. Returns nil if the module cannot be assembled
+  on its own, i.e. it uses a macro from the program that includes it."
+  [path flags cache-dir]
+  (try
+    (let [cached (str cache-dir "/" (object-key path flags) ".edn")]
+      (or (read-object cached)
+          (let [object (assemble-module path flags)]
+            (try
+              (write-object cached object)
+              (catch Exception _ nil))
+            object)))
+    (catch Exception _ nil)))
+
+(defn load-all
+  "Given procs and program data from files/expand-all, loads the objects
+  for the :modules the program includes into its :objects and declares
+  their macros. A module without an object is expanded in place, as it is
+  without a cache, adding its procs to the ones given and raising any
+  errors it has. Returns a map of the :procs and the updated :data."
+  [procs program-data]
+  (reduce (fn [{:keys [procs data]} path]
+            (if-let [object (load-object path (assembly-flags data)
+                                         (:cache data))]
+              {:procs procs
+               :data (update (files/process-macros (:macros object) data)
+                             :objects (fnil conj []) object)}
+              (let [included (files/include (list 'include path)
+                                            (assoc data :cache nil))]
+                {:procs (concat procs (:procs included))
+                 :data (assoc (:data included) :cache (:cache data))})))
+          {:procs procs :data program-data}
+          (:modules program-data)))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(def test-module "test/lt64_asm/lta_programs/mathlib.lta")
+(assemble-module test-module {:fuse true :peephole true})
+(object-key test-module {:fuse true :peephole true})
+(load-object test-module {:fuse true} "test-cache")
+
+;
+)
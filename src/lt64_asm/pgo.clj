@@ -0,0 +1,118 @@
+(ns lt64-asm.pgo
+  (:require [clojure.string :as string]
+            [clojure.java.shell :refer [sh]]
+            [clojure.java.io :as jio])
+  (:import [java.nio.file Files]
+           [java.nio.file.attribute FileAttribute]))
+
+;; The compiler and flags are taken from CC and CFLAGS like bench/dispatch.sh
+(def compiler (or (System/getenv "CC") "gcc"))
+(def cflags (string/split (or (System/getenv "CFLAGS") "-O2") #"\s+"))
+
+;; Number of times each sample is run when timing, the fastest is reported
+(def timing-runs 3)
+
+;;; Building ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn exe-path
+  "Given the path for a C file returns the path for the executable built
+  from it. I.e. some/path.c -> some/path and some/path -> some/path.out"
+  [path]
+  (if (string/ends-with? path ".c")
+    (subs path 0 (- (count path) 2))
+    (str path ".out")))
+
+(defn compile-c
+  "Compile the C file at c-path to an executable at out-path with CFLAGS
+  and any extra flags. Throws with the compiler's errors if it fails."
+  [c-path out-path & flags]
+  (let [args (concat cflags flags [c-path "-o" out-path])
+        {:keys [exit err]} (apply sh compiler args)]
+    (when-not (zero? exit)
+      (throw (Exception.
+               (str "Error: Could not compile " c-path "\n" err))))))
+
+(defn run-sample
+  "Run an executable with the sample file at sample-path as its input.
+  Returns its output and the time it took in ms."
+  [exe sample-path]
+  (let [start (System/nanoTime)
+        {:keys [out]} (sh exe :in (jio/file sample-path))]
+    {:out out
+     :ms (/ (- (System/nanoTime) start) 1e6)}))
+
+(defn time-sample
+  "The fastest of timing-runs runs of an executable on a sample, with its
+  output."
+  [exe sample-path]
+  (let [runs (repeatedly timing-runs #(run-sample exe sample-path))]
+    {:out (:out (first runs))
+     :ms (apply min (map :ms runs))}))
+
+(defn delete-tree
+  "Delete a directory and everything in it."
+  [dir]
+  (doseq [f (reverse (file-seq (jio/file dir)))]
+    (.delete f)))
+
+;;; Profile Guided Build ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn report
+  "Given the timings of the plain and tuned builds on each sample returns a
+  report of them and their totals."
+  [timings]
+  (let [total #(reduce + (map % timings))]
+    (with-out-str
+      (println (format "%12s %12s  %s" "plain (ms)" "tuned (ms)" "sample"))
+      (doseq [{:keys [sample plain tuned]} timings]
+        (println (format "%12.1f %12.1f  %s" plain tuned sample)))
+      (println (format "%12.1f %12.1f  total, %.2fx"
+                       (total :plain) (total :tuned)
+                       (/ (total :plain) (max (total :tuned) 0.001)))))))
+
+(defn build
+  "Given the path of a standalone C file and the paths of sample inputs for
+  it, builds it with profile guided optimization and link time optimization
+  into an executable at exe-path. The program is built with
+  -fprofile-generate and run on every sample, then rebuilt in the same place
+  with -fprofile-use, as GCC names the profile after the executable.
+  Returns a report of the time a plain build and the tuned build take on
+  each sample. Throws if a sample does not exist or the builds give
+  different output for it."
+  [c-path samples]
+  (doseq [sample samples]
+    (when-not (.isFile (jio/file sample))
+      (throw (Exception. (str "Error: Sample input not found: " sample)))))
+  (let [exe (.getAbsolutePath (jio/file (exe-path c-path)))
+        work (.toFile (Files/createTempDirectory "lt64-pgo"
+                                                 (make-array FileAttribute 0)))
+        plain (str work "/plain")
+        profile-dir (str work "/profile")]
+    (try
+      (compile-c c-path plain)
+      (compile-c c-path exe "-flto" (str "-fprofile-generate=" profile-dir))
+      (doseq [sample samples]
+        (run-sample exe sample))
+      (compile-c c-path exe "-flto" (str "-fprofile-use=" profile-dir))
+      (report
+        (doall
+          (for [sample samples]
+            (let [before (time-sample plain sample)
+                  after (time-sample exe sample)]
+              (when (not= (:out before) (:out after))
+                (throw (Exception.
+                         (str "Error: The tuned build gave different output"
+                              " for " sample))))
+              {:sample sample :plain (:ms before) :tuned (:ms after)}))))
+      (finally
+        (delete-tree work)))))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(exe-path "some/path.c")
+(exe-path "some/path")
+
+(print (report [{:sample "a.in" :plain 100.0 :tuned 80.0}
+                {:sample "b.in" :plain 50.0 :tuned 45.0}]))
+
+;
+)
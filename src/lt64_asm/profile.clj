@@ -0,0 +1,133 @@
+(ns lt64-asm.profile
+  (:require [clojure.string :as string]
+            [clojure.java.io :as jio]))
+
+;; Number of addresses shown in a report. The VM writes every one it ran.
+(def top-addresses 20)
+
+;;; Reading Profiles ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn parse-line
+  "Adds one line of a profile written by a VM built with -DLT64_PROFILE to
+  the profile so far. Lines are one of
+    op <code> <name> <count> <ticks>
+    pc <address> <count>
+    call <address> <count>
+  with codes and addresses in hex."
+  [profile line]
+  (let [[kind & fields] (string/split (string/trim line) #"\s+")
+        hex #(Long/parseLong % 16)
+        number #(Long/parseLong %)]
+    (case kind
+      "op" (let [[code op-name n ticks] fields]
+             (update profile :ops conj {:code (hex code)
+                                        :name op-name
+                                        :count (number n)
+                                        :ticks (number ticks)}))
+      "pc" (assoc-in profile [:pcs (hex (first fields))]
+                     (number (second fields)))
+      "call" (assoc-in profile [:calls (hex (first fields))]
+                       (number (second fields)))
+      "" profile
+      (throw (Exception. (str "Error: Invalid profile line: " line))))))
+
+(defn read-profile
+  "Read the profile file at path into a map of :ops, a list of maps with
+  :code :name :count and :ticks, and :pcs and :calls, maps of address to
+  count."
+  [path]
+  (with-open [reader (jio/reader path)]
+    (reduce parse-line
+            {:ops [] :pcs {} :calls {}}
+            (line-seq reader))))
+
+;;; Naming Addresses ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn region-names
+  "Sorted map of the address each part of the program starts at to its
+  name. main starts at the start address and each proc at its label."
+  [program-data proc-names]
+  (into (sorted-map (:start-address program-data) "main")
+        (map #(vector (get (:labels program-data) %) (str %)) proc-names)))
+
+(defn label-names
+  "Sorted map of address to the name of a label at that address. Where a
+  label and a proc share an address the proc is used."
+  [program-data proc-names]
+  (merge (into (sorted-map)
+               (map (fn [[label addr]] [addr (str label)])
+                    (:labels program-data)))
+         (region-names program-data proc-names)))
+
+(defn locate
+  "Name an address from a sorted map of names as the closest name at or
+  before it, with the offset from it when it is not exact. Addresses before
+  every name are given in hex."
+  [names addr]
+  (if-let [[start label] (first (rsubseq names <= addr))]
+    (if (= start addr)
+      label
+      (str label "+" (- addr start)))
+    (format "%x" addr)))
+
+(defn region-counts
+  "Total the counts in a map of address to count by the part of the
+  program each address is in. The jump over the static data is start."
+  [regions counts]
+  (reduce (fn [totals [addr n]]
+            (update totals
+                    (or (second (first (rsubseq regions <= addr))) "start")
+                    (fnil + 0) n))
+          {}
+          counts))
+
+;;; Report ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn percent
+  "n as a percent of total, or 0 when there is no total."
+  [n total]
+  (if (zero? total) 0.0 (/ (* 100.0 n) total)))
+
+(defn report
+  "Given a profile from read-profile and the first pass program data for
+  the program that was profiled, returns a report of the profile with
+  addresses named by the labels and procs of the program."
+  [profile program-data proc-names]
+  (let [labels (label-names program-data proc-names)
+        regions (region-names program-data proc-names)
+        total (reduce + (map :count (:ops profile)))
+        ticks (reduce + (map :ticks (:ops profile)))]
+    (with-out-str
+      (println (format "%d instructions, %d ticks" total ticks))
+
+      (println (format "\n%14s %6s %16s  %s" "count" "%" "ticks" "op"))
+      (doseq [op (sort-by :count > (:ops profile))]
+        (println (format "%14d %6.2f %16d  %s"
+                         (:count op) (percent (:count op) total)
+                         (:ticks op) (:name op))))
+
+      (println (format "\n%14s %6s  %s" "count" "%" "proc"))
+      (doseq [[region n] (sort-by val > (region-counts regions
+                                                       (:pcs profile)))]
+        (println (format "%14d %6.2f  %s" n (percent n total) region)))
+
+      (println (format "\n%14s %6s  %s" "count" "%" "address"))
+      (doseq [[addr n] (take top-addresses (sort-by val > (:pcs profile)))]
+        (println (format "%14d %6.2f  %x %s"
+                         n (percent n total) addr (locate labels addr))))
+
+      (when (seq (:calls profile))
+        (println (format "\n%14s  %s" "calls" "target"))
+        (doseq [[addr n] (sort-by val > (:calls profile))]
+          (println (format "%14d  %x %s" n addr (locate labels addr))))))))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(parse-line {:ops [] :pcs {} :calls {}} "op 2b DADD 100 2000")
+(parse-line {:ops [] :pcs {} :calls {}} "pc 1f 100")
+
+(locate (sorted-map 10 "main" 40 "fib") 45)
+(locate (sorted-map 10 "main" 40 "fib") 2)
+
+(region-counts (sorted-map 10 "main" 40 "fib") {1 1, 12 5, 41 100})
+
+;
+)
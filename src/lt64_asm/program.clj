@@ -2,60 +2,110 @@
   (:require [lt64-asm.symbols :as sym]
             [lt64-asm.files :as files]
             [lt64-asm.bytes :as b]
+            [lt64-asm.numbers :as nums]
             [clojure.edn :as edn]))
 
-;;; First Pass ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-(defn get-label-from-ops
-  "Given first pass program data records any labels with the current
-  counter value or increments the counter according to the op.
-  Returns a new map which updates labels, drops the op and any arguments,
-  and updates the counter."
-  [{:keys [ops counter labels user-macros]}]
-  (cond
-    (sym/label? (first ops))
-    {:ops (drop 2 ops)
-     :labels (sym/set-label (second ops) counter labels)
-     :counter counter
-     :user-macros user-macros}
-
-    (sym/dpush-op? (first ops))
-    {:ops (drop 2 ops)
-     :labels labels
-     :counter (+ 3 counter)
-     :user-macros user-macros}
-
-    (contains? user-macros (first ops))
-    {:ops (rest ops)
-     :labels labels
-     :counter (+ (count (get user-macros (first ops))) counter)
-     :user-macros user-macros}
-
-    (sym/builtin-macro? (first ops))
-    {:ops (rest ops)
-     :labels labels
-     :counter (+ (count (sym/get-macro-ops (first ops))) counter)
-     :user-macros user-macros}
-
-    :else
-    {:ops (rest ops)
-     :labels labels
-     :counter (inc counter)
-     :user-macros user-macros})) 
+;;; Op Preparation ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn expand-macros
+  "Replace all user and builtin macros in a list of ops with their bodies.
+  User macros are checked first so that they can shadow builtin macros.
+  Macro bodies are expanded again so macros can use other macros.
+  Annotations, like :no-inline, are removed."
+  [ops user-macros]
+  (loop [ops ops
+         out (transient [])]
+    (let [op (first ops)]
+      (cond
+        (empty? ops) (persistent! out)
+
+        (or (sym/label? op) (sym/push-op? op) (sym/imm-op? op))
+        (recur (drop 2 ops) (conj! (conj! out op) (second ops)))
+
+        (contains? user-macros op)
+        (recur (concat (get user-macros op) (rest ops)) out)
+
+        (sym/annotation? op)
+        (recur (rest ops) out)
+
+        (sym/builtin-macro? op)
+        (recur (concat (sym/get-macro-ops op) (rest ops)) out)
+
+        :else
+        (recur (rest ops) (conj! out op))))))
+
+(defn match-fused-seq
+  "Returns the fused op and the length of the sequence it replaces if the
+  ops start with one of the sequences in sym/fused-seqs, otherwise nil."
+  [ops]
+  (some (fn [[pattern fused-op]]
+          (when (= pattern (take (count pattern) ops))
+            [fused-op (count pattern)]))
+        sym/fused-seqs))
+
+(defn fuse-ops
+  "Peephole pass that replaces common op sequences with a single fused op
+  so the VM does the same work in fewer dispatches.
+  `:push X` followed by an op in sym/fusion-map becomes the fused op with X
+  as its argument, and the sequences in sym/fused-seqs become their op.
+  Labels are left in place, so an op that is the target of a label is never
+  fused with the one before it. Expects macros to already be expanded."
+  [ops]
+  (loop [ops ops
+         out (transient [])]
+    (let [[op arg next-op] ops
+          fused-seq (match-fused-seq ops)]
+      (cond
+        (empty? ops) (persistent! out)
+
+        (and (= op :push) (contains? sym/fusion-map next-op))
+        (recur (drop 3 ops)
+               (conj! (conj! out (get sym/fusion-map next-op)) arg))
+
+        fused-seq
+        (recur (drop (second fused-seq) ops) (conj! out (first fused-seq)))
+
+        (or (sym/label? op) (sym/push-op? op) (sym/imm-op? op))
+        (recur (drop 2 ops) (conj! (conj! out op) arg))
+
+        :else
+        (recur (rest ops) (conj! out op))))))
+
+(defn prepare-ops
+  "Expand the macros in a list of ops and fuse them unless fusing has been
+  turned off with :fuse in program-data.
+  Both passes prepare their ops with this so the addresses given to labels
+  in the first pass match the ops assembled in the second."
+  [ops program-data]
+  (cond-> (expand-macros ops (:user-macros program-data))
+    (:fuse program-data) fuse-ops))
 
+;;; First Pass ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (defn get-op-labels
   "Given a list of ops and program data processes the ops for labels and
   returns updated program data with new labels added and the counter
-  increased to the position after the final op."
+  increased to the position after the final op.
+  The prepared ops are walked by index, so each op costs the same however
+  long the program is. Every element left after prepare-ops is a word,
+  except for labels and dword arguments."
   [ops program-data]
-  (loop [args {:ops ops
-               :labels (:labels program-data)
-               :counter (:counter program-data)
-               :user-macros (:user-macros program-data)}]
-    (if (empty? (:ops args))
-      (assoc program-data
-             :labels (:labels args)
-             :counter (:counter args))
-      (recur (get-label-from-ops args)))))
+  (let [ops (prepare-ops ops program-data)
+        n (count ops)]
+    (loop [i 0
+           counter (:counter program-data)
+           labels (:labels program-data)]
+      (if (>= i n)
+        (assoc program-data :labels labels :counter counter)
+        (let [op (nth ops i)]
+          (cond
+            (sym/label? op)
+            (recur (+ i 2) counter (sym/set-label (get ops (inc i)) counter
+                                                  labels))
+
+            (sym/dpush-op? op)
+            (recur (+ i 2) (+ counter 3) labels)
+
+            :else
+            (recur (inc i) (inc counter) labels)))))))
 
 (defn proc-label-accumulator
   "Accumulator for reducing subroutines to find their labels.
@@ -82,100 +132,428 @@
           program-data
           procs))
 
+(defn object-label-accumulator
+  "Accumulator for reducing the objects of included modules to find their
+  labels. Each object is placed at the counter, so its labels are added at
+  their offset from there, and the counter is moved past it."
+  [program-data object]
+  (assoc program-data
+         :labels (reduce (fn [labels [label offset]]
+                           (sym/set-label label
+                                          (+ (:counter program-data) offset)
+                                          labels))
+                         (:labels program-data)
+                         (:labels object))
+         :counter (+ (:counter program-data) (count (:words object)))))
+
 (defn first-pass
-  "Process all labels in the main program and all subroutine directives.
+  "Process all labels in the main program, all subroutine directives, and
+  the objects of included modules, which are placed after them.
   Returns the updated program data with all all labels and accociated
   addresses along with a the counter pointing past the final instruction."
   [main procs program-data]
-  (->> program-data
-       (get-op-labels (rest main))
-       (get-proc-labels procs)))
-
-;;; Second Pass ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-(defn replace-push
-  "Replace a push op and its value with byte lists and cons them onto the
-  :bytes member of program data and return it."
-  [[op value] program-data]
-  (let [out-op (if (= op :fpush) :dpush op)
-        num-type (case op
-                   :push :word
-                   :dpush :dword
-                   :fpush :fword
-                   :word)]
-    (->> (:bytes program-data)
-         (cons (b/op->bytes out-op))
-         (cons (b/num->bytes value {:kind num-type}))
-         (assoc program-data :bytes))))
-
-(defn replace-op
-  "Replace an op symbol with the byte of its associated address and cons it
-  onto :bytes member of program data and return it."
-  [op program-data]
-  (->> (:bytes program-data)
-       (cons (b/op->bytes op))
-       (assoc program-data :bytes)))
-
-(defn replace-labels
-  "Filters all labels declarations out of a list of program operations and
-  replaces any used labels with their numeric addres value.
-  Since the only place labels are used is with push ops to push the address
-  onto the stack the numbers will get converted to bytes in the replace-ops
-  pass from replace-push-op."
-  [ops program-data]
-  (cond
-    (empty? ops) '()
-
-    (sym/label? (first ops))
-    (lazy-seq
-      (replace-labels (drop 2 ops) program-data))
-
-    (symbol? (first ops))
-    (cons
-      (sym/get-label (first ops) (:labels program-data))
-      (lazy-seq
-        (replace-labels (rest ops) program-data)))
-
-    :else
-    (cons
-      (first ops)
-      (lazy-seq
-        (replace-labels (rest ops) program-data)))))
-
-(defn replace-ops
-  "Cons the bytes for each op symbol given onto the :bytes member of
-  program-data and return it."
-  [ops program-data]
-  (let [op (first ops)]
+  (let [program-data (->> program-data
+                          (get-op-labels (rest main))
+                          (get-proc-labels procs))]
+    (reduce object-label-accumulator program-data (:objects program-data))))
+
+;;; Peephole Optimization ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Rewrites main and the procs before the first pass lays them out. The rules
+;; work on ops with macros expanded but not fused, so :push L :jump is seen
+;; as a jump, and the passes fuse the result like any other ops. Like fusing
+;; they never match across a label, so code that is jumped into is only ever
+;; changed as a whole. They assume the program does not rely on a stack
+;; error, i.e. :swap :swap on an empty stack is removed.
+
+(defn word-arg?
+  "Checks if a push argument is a number in the range of a word."
+  [arg]
+  (and (integer? arg) (<= -32768 arg 32767)))
+
+(defn dword-arg?
+  "Checks if a dpush argument is a number in the range of a double word."
+  [arg]
+  (and (integer? arg) (<= Integer/MIN_VALUE arg Integer/MAX_VALUE)))
+
+(defn compare->num
+  "Turn a comparison into one that gives 1 or 0 like the VM."
+  [compare]
+  #(if (compare %1 %2) 1 0))
+
+;; Word ops on two constants and how to fold them. Results are wrapped to
+;; a word like the VM does.
+(def word-folds
+  {:add +
+   :sub -
+   :mult *
+   :and bit-and
+   :or bit-or
+   :eq (compare->num =)
+   :lt (compare->num <)
+   :gt (compare->num >)})
+
+(def dword-folds
+  {:dadd +
+   :dsub -
+   :dmult *
+   :dand bit-and
+   :dor bit-or
+   :deq (compare->num =)
+   :dlt (compare->num <)
+   :dgt (compare->num >)})
+
+;; Sequences that leave the stacks as they were
+(def no-op-seqs
+  #{[:push 0 :add] [:push 0 :sub] [:push 1 :mult] [:push 1 :div]
+    [:push 0 :or] [:push -1 :and]
+    [:dpush 0 :dadd] [:dpush 0 :dsub] [:dpush 1 :dmult] [:dpush 1 :ddiv]
+    [:dpush 0 :dor] [:dpush -1 :dand]
+    [:swap :swap] [:dswap :dswap] [:not :not] [:dnot :dnot]
+    [:first :pop] [:dfirst :dpop] [:rpush :rpop] [:drpush :drpop]})
+
+;; Fused jumps and the op they replace
+(def unfused-jumps {:jumpi :jump :branchi :branch :calli :call})
+
+(defn transfer
+  "If the ops start with a jump, branch, or call to a label, written as
+  :push L :jump or fused as :jumpi L, returns the unfused op, the label, and
+  the number of elements it takes. Otherwise nil."
+  [[op label op2]]
+  (when (symbol? label)
     (cond
-      (empty? ops) program-data
-
-      (sym/push-op? op)
-      (recur (drop 2 ops) (replace-push (take 2 ops) program-data))
-
-      (contains? (:user-macros program-data) op)
-      (recur (rest ops) (replace-ops (get (:user-macros program-data) op)
-                                     program-data))
+      (and (= op :push) (#{:jump :branch :call} op2)) [op2 label 3]
+      (contains? unfused-jumps op) [(unfused-jumps op) label 2])))
+
+(defn skip-labels
+  "Given a vector of ops returns the labels it starts with and the ops
+  after them."
+  [ops]
+  (loop [labels #{}
+         ops ops]
+    (if (and (sym/label? (first ops)) (>= (count ops) 2))
+      (recur (conj labels (second ops)) (subvec ops 2))
+      [labels ops])))
+
+(defn label-targets
+  "Given the ops of main and the procs returns a map of every label they
+  declare to the ops that run when it is jumped to."
+  [bodies]
+  (into {}
+        (for [ops bodies
+              i (range (dec (count ops)))
+              :when (sym/label? (nth ops i))]
+          [(nth ops (inc i)) (second (skip-labels (subvec ops i)))])))
+
+(defn jump-target
+  "Follow a label through the unconditional jumps it lands on to the label
+  where the chain ends. Stops if the chain loops."
+  [label targets]
+  (loop [label label
+         seen #{label}]
+    (let [[op next-label] (transfer (get targets label))]
+      (if (and (= op :jump) (not (contains? seen next-label)))
+        (recur next-label (conj seen next-label))
+        label))))
+
+;; Each rule is given the ops from the current position and the label
+;; targets. If it matches it returns its name, the number of elements it
+;; replaces, and what to replace them with.
+(defn fold-words
+  "Fold a word op on constants, i.e. :push 1 :push 2 :add -> :push 3"
+  [[op a op2 b op3] _]
+  (cond
+    (and (= op :push) (= op2 :push) (word-arg? a) (word-arg? b)
+         (contains? word-folds op3))
+    [:fold-words 5 [:push (long (unchecked-short ((word-folds op3) a b)))]]
 
-      (sym/builtin-macro? op)
-      (recur (rest ops) (replace-ops (sym/get-macro-ops op) program-data))
+    (and (= op :push) (word-arg? a) (= op2 :not))
+    [:fold-words 3 [:push (long (unchecked-short (bit-not a)))]]))
 
-      (keyword? op)
-      (recur (rest ops) (replace-op op program-data))
+(defn fold-dwords
+  "Fold a double word op on constants, i.e. :dpush 1 :dpush 2 :dadd ->
+  :dpush 3"
+  [[op a op2 b op3] _]
+  (cond
+    (and (= op :dpush) (= op2 :dpush) (dword-arg? a) (dword-arg? b)
+         (contains? dword-folds op3))
+    [:fold-dwords 5 [:dpush (long (unchecked-int ((dword-folds op3) a b)))]]
+
+    (and (= op :dpush) (dword-arg? a) (= op2 :dnot))
+    [:fold-dwords 3 [:dpush (long (unchecked-int (bit-not a)))]]))
+
+(defn add-amount
+  "The amount ops starting with :push n :add or :push n :sub add to the
+  top of the stack, or nil."
+  [[op n op2]]
+  (when (and (= op :push) (word-arg? n))
+    (case op2
+      :add n
+      :sub (- n)
+      nil)))
+
+(defn combine-adds
+  "Combine two adds or subs of constants, i.e. :!inc :!dec -> nothing and
+  :push 2 :add :push 3 :add -> :push 5 :add"
+  [ops _]
+  (let [first-amount (add-amount ops)
+        second-amount (add-amount (drop 3 ops))]
+    (when (and first-amount second-amount)
+      (let [amount (long (unchecked-short (+ first-amount second-amount)))]
+        [:combine-adds 6 (if (zero? amount) [] [:push amount :add])]))))
+
+(defn remove-no-ops
+  "Remove a sequence in no-op-seqs, or a push that is popped right away."
+  [[op arg op2 :as ops] _]
+  (cond
+    (or (and (= op :push) (= op2 :pop))
+        (and (= op :dpush) (= op2 :dpop)))
+    [:remove-no-ops 3 []]
+
+    (contains? no-op-seqs (vec (take 3 ops)))
+    [:remove-no-ops 3 []]
+
+    (contains? no-op-seqs (vec (take 2 ops)))
+    [:remove-no-ops 2 []]))
+
+(defn thread-jumps
+  "Send a jump, branch, or call to a label that only jumps on to where that
+  jump goes, i.e. :push a :jump ... :label a :push b :jump -> :push b :jump"
+  [ops targets]
+  (when-let [[op label n] (transfer ops)]
+    (let [target (jump-target label targets)]
+      (when (not= target label)
+        [:thread-jumps n [:push target op]]))))
+
+(defn remove-jumps-to-next
+  "Remove a jump to the op right after it. A branch there pops its
+  condition instead."
+  [ops _]
+  (when-let [[op label n] (transfer ops)]
+    (when (and (not= op :call)
+               (contains? (first (skip-labels (subvec (vec ops) n))) label))
+      [:remove-jumps-to-next n (if (= op :branch) [:pop] [])])))
+
+(defn tail-calls
+  "Turn a call right before a :ret into a jump, so the proc that is called
+  returns straight to the caller's caller and the return stack does not
+  grow, i.e. :push p :call :ret -> :push p :jump"
+  [ops _]
+  (when-let [[op label n] (transfer ops)]
+    (when (and (= op :call) (= :ret (get ops n)))
+      [:tail-calls (inc n) [:push label :jump]])))
+
+(def peephole-rules
+  [fold-words fold-dwords combine-adds remove-no-ops thread-jumps
+   remove-jumps-to-next tail-calls])
+
+(defn op-length
+  "The number of elements an op takes in a list of ops, 2 if it is
+  followed by an argument and 1 otherwise."
+  [op]
+  (if (or (sym/label? op) (sym/push-op? op) (sym/imm-op? op))
+    2
+    1))
+
+(defn peephole-pass
+  "Apply the peephole rules once across a vector of ops. Returns the new
+  ops and a list of the names of the rules that were applied."
+  [ops targets]
+  (let [n (count ops)]
+    (loop [i 0
+           out (transient [])
+           applied (transient [])]
+      (if (>= i n)
+        [(persistent! out) (persistent! applied)]
+        (let [window (subvec ops i)]
+          (if-let [[rule length replacement]
+                   (some #(% window targets) peephole-rules)]
+            (recur (+ i length)
+                   (reduce conj! out replacement)
+                   (conj! applied rule))
+            (let [length (op-length (nth ops i))]
+              (recur (+ i length)
+                     (reduce conj! out (subvec ops i (min n (+ i length))))
+                     applied))))))))
+
+(defn ops-size
+  "The number of words a list of ops is assembled into."
+  [ops program-data]
+  (:counter (get-op-labels ops (assoc program-data :counter 0 :labels {}))))
+
+(defn optimize
+  "Run the peephole rules over main and the procs until none of them apply.
+  Each pass works out where every label goes again, so jumps are threaded
+  through code that earlier passes have shrunk. Leaves everything as it is
+  if there is something that is not a proc, for the first pass to report.
+  Returns main, the procs, and the program data with a map of the number
+  of times each rule was applied and the words that saved in :optimized."
+  [main procs program-data]
+  (if-not (every? sym/proc? procs)
+    [main procs program-data]
+    (let [bodies (mapv #(expand-macros % (:user-macros program-data))
+                       (cons (rest main) (map #(drop 2 %) procs)))
+          size #(reduce + (map (fn [ops] (ops-size ops program-data)) %))
+          before (size bodies)]
+      (loop [bodies bodies
+             rules {}]
+        (let [targets (label-targets bodies)
+              results (map #(peephole-pass % targets) bodies)
+              applied (mapcat second results)]
+          (if (seq applied)
+            (recur (mapv first results)
+                   (merge-with + rules (frequencies applied)))
+            [(cons 'main (first bodies))
+             (map #(list* 'proc (second %1) %2) procs (rest bodies))
+             (assoc program-data
+                    :optimized {:rules rules
+                                :words (- before (size bodies))})]))))))
+
+(defn optimize-report
+  "Given the :optimized map from optimize returns a report of how many
+  times each rule was applied and the bytes that saved."
+  [{:keys [rules words]}]
+  (with-out-str
+    (println (str "Peephole rules saved " (* 2 words) " bytes"))
+    (doseq [[rule n] (sort-by key rules)]
+      (println (format "%8d  %s" n (name rule))))))
 
-      :else (throw
-              (Exception. (str "Error: Invalid operation: " op))))))
+;;; Second Pass ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; The second pass writes every word straight into a short array the size
+;; of the program, which the first pass has counted, so assembling takes
+;; time and memory in proportion to the program.
+(defn arg-word
+  "The word for the argument of a push or fused op. Labels are replaced by
+  their address, which can be anywhere in the VM's memory, so it is only
+  checked against the unsigned range. Throws if a number is out of range
+  or a label has not been declared."
+  [arg labels]
+  (if (symbol? arg)
+    (let [address (sym/get-label arg labels)]
+      (if (<= 0 address 0xffff)
+        (unchecked-short address)
+        (throw (Exception. (str "Error: Label address out of range: " arg
+                                " " address)))))
+    (nums/num->word arg)))
+
+(defn arg-dword
+  "The double word for the argument of a :dpush or :fpush. Labels are
+  replaced by their address."
+  [op arg labels]
+  (let [value (if (symbol? arg) (sym/get-label arg labels) arg)]
+    (if (= op :fpush)
+      (nums/num->fixed-point value nil)
+      (nums/num->dword value))))
+
+(defn write-dword!
+  "Write a double word into the short array words at pos, high word first
+  like the VM reads them."
+  [^shorts words pos dword]
+  (aset words pos (unchecked-short (bit-shift-right dword 16)))
+  (aset words (inc pos) (unchecked-short dword)))
+
+(defn write-ops!
+  "Write the words for a list of prepared ops into the short array words,
+  starting at pos, and return the position after them. Label declarations
+  are skipped and labels used as arguments replaced by their address.
+  Given a volatile vector of relocs, labels used as arguments are left as
+  0 instead and their position, label, and :word, :dword, or :fword kind
+  are added to it, so they can be filled in by link-object!.
+  Throws if an op is not valid."
+  ([words pos ops labels] (write-ops! words pos ops labels nil))
+  ([^shorts words pos ops labels relocs]
+   (let [ops (vec ops)
+         n (count ops)
+         relocate? #(and relocs (symbol? %))]
+     (loop [i 0
+            pos (long pos)]
+       (if (>= i n)
+         pos
+         (let [op (nth ops i)
+               arg (get ops (inc i))]
+           (cond
+             (sym/label? op)
+             (recur (+ i 2) pos)
+
+             (sym/dpush-op? op)
+             (do
+               (aset words pos (short (b/op->word :dpush)))
+               (if (relocate? arg)
+                 (vswap! relocs conj
+                         [(inc pos) arg (if (= op :fpush) :fword :dword)])
+                 (write-dword! words (inc pos) (arg-dword op arg labels)))
+               (recur (+ i 2) (+ pos 3)))
+
+             (or (sym/push-op? op) (sym/imm-op? op))
+             (do
+               (aset words pos (short (b/op->word op)))
+               (if (relocate? arg)
+                 (vswap! relocs conj [(inc pos) arg :word])
+                 (aset words (+ pos 1) (short (arg-word arg labels))))
+               (recur (+ i 2) (+ pos 2)))
+
+             (keyword? op)
+             (do
+               (aset words pos (short (b/op->word op)))
+               (recur (inc i) (inc pos)))
+
+             :else (throw
+                     (Exception. (str "Error: Invalid operation: " op))))))))))
+
+(defn write-start!
+  "Write the jump over the static data and the static data into the start
+  of the short array words. The static data is in the :bytes of program
+  data, in reverse after the bytes of the initial words. If it has zeroed
+  data the jump is flagged and followed by the number of zeroed words, see
+  static/process-bss."
+  [^shorts words program-data]
+  (aset words 0 (short (b/op->word :push)))
+  (aset words 1 (short (arg-word (:start-address program-data) {})))
+  (aset words 2 (short (b/op->word :jump)))
+  (loop [pos 3
+         static (seq (b/bytes->words
+                       (drop (* b/word-size (count (b/initial-words)))
+                             (reverse (flatten (:bytes program-data))))))]
+    (when static
+      (aset words pos (short (first static)))
+      (recur (inc pos) (next static))))
+  (when (pos? (:bss program-data 0))
+    (aset words 2 (short (bit-or (b/op->word :jump) 0x100)))
+    (aset words 3 (unchecked-short (:bss program-data)))))
+
+(defn link-object!
+  "Copy the words of a module's object into the short array words at pos
+  and fill in each label it uses with its address. This is all the work
+  an included module needs once it has been assembled, see lt64-asm.module.
+  Returns the position after the object."
+  [^shorts words pos object labels]
+  (let [code (short-array (:words object))]
+    (System/arraycopy code 0 words pos (alength code))
+    (doseq [[offset label kind] (:relocs object)]
+      (case kind
+        :word (aset words (+ pos offset) (short (arg-word label labels)))
+        :dword (write-dword! words (+ pos offset)
+                             (arg-dword :dpush label labels))
+        :fword (write-dword! words (+ pos offset)
+                             (arg-dword :fpush label labels))))
+    (+ pos (alength code))))
 
 (defn second-pass
-  "Replace all labels and op symbols with their bytes and cons them onto the
-  :bytes member of program-data. Return the updated program data."
+  "Assemble main and all procs into a short array of the program's words,
+  after the jump over the static data and the static data, and link the
+  objects of included modules after them. Expects program data from the
+  first pass, whose :counter is the length of the program.
+  Returns the updated program data with the array in :words."
   [main procs program-data]
-  (reduce #(-> (drop 2 %2)
-               (replace-labels program-data)
-               (replace-ops %1))
-          (-> (rest main)
-              (replace-labels program-data)
-              (replace-ops program-data))
-          procs))
+  (let [words (short-array (:counter program-data))
+        labels (:labels program-data)
+        write! #(write-ops! words %1 (prepare-ops %2 program-data) labels)]
+    (write-start! words program-data)
+    (reduce #(link-object! words %1 %2 labels)
+            (reduce #(write! %1 (drop 2 %2))
+                    (write! (:start-address program-data) (rest main))
+                    procs)
+            (:objects program-data))
+    (assoc program-data :words words)))
 
 ;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (comment
@@ -245,20 +623,11 @@
 (def test-prog-data
   {:bytes '()
    :counter 11
+   :start-address 11
    :labels {'A 0 'i 10}
    :user-macros {:!my-op [:push 1 :pop]}})
 
 ;;; First Pass Tests
-(get-label {:ops '(:label test-label :push 4)
-            :counter 3
-            :labels {}})
-; {:ops (:push 4), :labels {test-label 3}, :counter 3}
-
-(get-label {:ops '(:push 13 :label test-label :push 4)
-            :counter 3
-            :labels {}})
-; {:ops (13 :label test-label :push 4), :labels {}, :counter 4}
-
 (get-op-labels (rest test-main) test-prog-data)
 ; {:bytes (), :counter 42, :labels {A 0, i 10, loop 14, end-loop 37}}
 
@@ -283,30 +652,17 @@
 ;   inc-addr 48}}
 
 ;;; Second Pass Tests
-(replace-push '(:push 0xaa) test-prog-data)
-(replace-push '(:dpush 0x00bbccdd) test-prog-data)
-(replace-push '(:fpush 10.123) test-prog-data)
-(replace-op :branch test-prog-data)
-
-(rest test-main)
-(def main-replaced-labels
-  (replace-labels (rest test-main)
-                  labelled-prog-data))
-
-(replace-ops main-replaced-labels
-             labelled-prog-data)
-
-(second-pass test-main
-             test-procs
-             labelled-prog-data)
-
-(def test-ops-with-macro
-  '(:push 1 :!inc :pop))
-(replace-ops (:!inc sym/macro-map) test-prog-data)
-(replace-ops test-ops-with-macro test-prog-data)
-
-(def test-ops-with-user-macro
-  '(:push 1 :!my-op :pop))
-(replace-ops test-ops-with-user-macro test-prog-data)
+(arg-word 0xaa {})
+(arg-word 'max (:labels labelled-prog-data))
+(arg-dword :dpush 0x00bbccdd {})
+(arg-dword :fpush 10.123 {})
+
+(def test-words (short-array 8))
+(write-ops! test-words 0 [:push 1 :label here :dpush 0x00bbccdd :branch] {})
+(vec test-words)
+
+(vec (:words (second-pass test-main
+                          test-procs
+                          labelled-prog-data)))
 ;
 ),
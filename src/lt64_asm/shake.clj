@@ -0,0 +1,184 @@
+(ns lt64-asm.shake
+  (:require [lt64-asm.symbols :as sym]
+            [lt64-asm.program :as prog]
+            [lt64-asm.aot :as aot]
+            [clojure.string :as string]))
+
+;;; Label Graph ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Ops that never go on to the op after them. Code that ends with anything
+;; else runs into whatever is placed after it.
+(def exit-ops #{:ret :halt :jump :jumpi})
+
+(def exit-codes (set (map #(bit-and (sym/op->code %) 0xff) exit-ops)))
+
+(defn op-labels
+  "Given a list of prepared ops returns a map of the set of labels they
+  :declare, the set of labels they :use as arguments, the number of
+  :words they are assembled into, and whether they :fall through into the
+  code after them, see exit-ops."
+  [ops]
+  (let [ops (vec ops)
+        n (count ops)]
+    (loop [i 0
+           declares #{}
+           uses #{}
+           words 0
+           last-op nil]
+      (if (>= i n)
+        {:declares declares :uses uses :words words
+         :falls (not (contains? exit-ops last-op))}
+        (let [op (nth ops i)
+              arg (get ops (inc i))
+              use-arg #(if (symbol? arg) (conj uses arg) uses)]
+          (cond
+            (sym/label? op)
+            (recur (+ i 2) (conj declares arg) uses words last-op)
+
+            (sym/dpush-op? op)
+            (recur (+ i 2) declares (use-arg) (+ words 3) op)
+
+            (or (sym/push-op? op) (sym/imm-op? op))
+            (recur (+ i 2) declares (use-arg) (+ words 2) op)
+
+            :else
+            (recur (inc i) declares uses (inc words) op)))))))
+
+(defn words-fall?
+  "Given the assembled words of a proc returns true if its last op is not
+  one of exit-ops, so it runs into the code after it."
+  [words]
+  (loop [addr 0
+         code nil]
+    (if (>= addr (count words))
+      (not (contains? exit-codes code))
+      (let [code (bit-and (nth words addr) 0xff)]
+        (recur (+ addr (cond
+                         (= code aot/dpush-code) 3
+                         (contains? aot/imm-codes code) 2
+                         :else 1))
+               code)))))
+
+(defn proc-node
+  "Given a proc and program data returns its node in the label graph, the
+  labels it declares and uses, its size, and whether it falls through.
+  Throws if it is not a proc."
+  [proc program-data]
+  (if (sym/proc? proc)
+    (-> (op-labels (prog/prepare-ops (drop 2 proc) program-data))
+        (update :declares conj (second proc))
+        (assoc :name (second proc) :proc proc))
+    (throw (Exception.
+             (str "Error: Invalid procedure found after main: " proc)))))
+
+(defn split-object
+  "Split an object from lt64-asm.module into an object for each of its
+  procs, so that each can be kept or removed on its own. Labels and relocs
+  go with the proc whose words they are in."
+  [{:keys [words labels relocs procs]}]
+  (let [starts (mapv #(get labels %) procs)
+        ends (conj (vec (rest starts)) (count words))]
+    (map (fn [proc start end]
+           (let [in-proc? #(and (<= start %) (< % end))]
+             {:words (subvec (vec words) start end)
+              :procs [proc]
+              :labels (into {proc 0}
+                            (keep (fn [[label offset]]
+                                    (when (in-proc? offset)
+                                      [label (- offset start)])))
+                            labels)
+              :relocs (into []
+                            (keep (fn [[offset label kind]]
+                                    (when (in-proc? offset)
+                                      [(- offset start) label kind])))
+                            relocs)}))
+         procs
+         starts
+         ends)))
+
+(defn object-node
+  "Given an object for a single proc from split-object returns its node in
+  the label graph."
+  [object]
+  {:declares (set (keys (:labels object)))
+   :uses (set (map second (:relocs object)))
+   :words (count (:words object))
+   :falls (words-fall? (:words object))
+   :name (first (:procs object))
+   :object object})
+
+(defn reachable
+  "Given the labels used by main and a list of nodes in the order they are
+  placed returns the set of the indexes of the nodes main can reach, by
+  using a label a node declares, using a label declared by a node it
+  reaches, falling through from a node it reaches, and so on."
+  [roots nodes]
+  (let [owner (into {}
+                    (for [[i node] (map-indexed vector nodes)
+                          label (:declares node)]
+                      [label i]))]
+    (loop [todo (vec (keep owner roots))
+           seen #{}]
+      (if (empty? todo)
+        seen
+        (let [i (peek todo)]
+          (if (contains? seen i)
+            (recur (pop todo) seen)
+            (recur (cond-> (into (pop todo) (keep owner (:uses (nth nodes i))))
+                     (and (:falls (nth nodes i)) (< (inc i) (count nodes)))
+                     (conj (inc i)))
+                   (conj seen i))))))))
+
+;;; Tree Shaking ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn shake
+  "Given main, the procs, and program data with the :objects of included
+  modules, removes every proc that main can't reach through the labels it
+  uses, see reachable. Objects are split by proc so unused procs are
+  removed from them too. Main or a proc that can run off its end without a
+  :ret, :halt, or jump keeps the proc placed after it.
+  Returns a map of the :procs kept and the program :data with the :objects
+  kept and a :shaken map of the names of the :procs removed and the number
+  of :words they took."
+  [main procs program-data]
+  (let [nodes (vec (concat
+                     (map #(proc-node % program-data) procs)
+                     (map object-node
+                          (mapcat split-object (:objects program-data)))))
+        {:keys [uses falls]} (op-labels (prog/prepare-ops (rest main)
+                                                          program-data))
+        kept (reachable (cond-> uses
+                          (and falls (seq nodes)) (conj (:name (first nodes))))
+                        nodes)
+        live? #(contains? kept (first %))
+        live (map second (filter live? (map-indexed vector nodes)))
+        dead (map second (remove live? (map-indexed vector nodes)))]
+    {:procs (keep :proc live)
+     :data (assoc program-data
+                  :objects (vec (keep :object live))
+                  :shaken {:procs (mapv :name dead)
+                           :words (reduce + (map :words dead))})}))
+
+(defn report
+  "Given the :shaken map from shake returns a report of the procs removed
+  and the bytes that saved."
+  [{:keys [procs words]}]
+  (str "Removed " (count procs) " unused procs, saving " (* 2 words)
+       " bytes" (when (seq procs) (str ": " (string/join " " procs)))
+       "\n"))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(def test-procs
+  '[(proc used :push helper :call :ret)
+    (proc helper :label helper/loop :push helper/loop :branch :ret)
+    (proc unused :push helper :call :ret)])
+
+(op-labels '[:label a :push a :jump :push b :call :dpush 5])
+(shake '(main :push used :call :halt) test-procs {:user-macros {}})
+(shake '(main :push used :call :halt)
+       '[(proc used :push 1) (proc next :ret)]
+       {:user-macros {}})
+(print (report (:shaken (:data (shake '(main :halt) test-procs {})))))
+
+;
+)
@@ -97,6 +97,62 @@
   [[kind & _]]
   (throw (Exception. (str "Error: invalid static data type: " kind))))
 
+;;; Zeroed Data ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Static data that is all zeros (BSS) is not stored in the binary. It goes
+;; after the rest of the static data, and the VM's loader moves the code up
+;; past it when it loads the program. The jump over the static data gets a
+;; flag of 1 and the word after it is the number of zeroed words.
+
+(defn bss?
+  "Checks if a static allocation instruction is all zeros, i.e. it is for
+  numbers and has no initial values, or for characters and has no string."
+  [[kind _ size & args]]
+  (and (integer? size)
+       (case kind
+         (:word :dword :fword) (empty? args)
+         :fword-sc (empty? (rest args))
+         :char (empty? (first args))
+         false)))
+
+(defn bss-words
+  "The number of words allocate would give a zeroed static allocation
+  instruction, see bss?."
+  [[kind _ size]]
+  (case kind
+    :word size
+    (:dword :fword :fword-sc) (* size 2)
+    :char (quot (inc size) 2)))
+
+(defn process-bss
+  "Given a list of zeroed allocation instructions gives each a label after
+  the static data that has been processed, but does not add any bytes for
+  them. Returns the updated program data with the number of zeroed words
+  in :bss."
+  [instructions program-data]
+  (reduce (fn [{:keys [labels counter] :as data} instr]
+            (let [words (bss-words instr)]
+              (assoc data
+                     :labels (sym/set-label (second instr) counter labels)
+                     :counter (+ counter words)
+                     :bss (+ (:bss data) words))))
+          (assoc program-data :bss 0)
+          instructions))
+
+(defn remove-bss
+  "Given the short array of words a program was assembled into and its
+  program data, returns the words without the zeroed words before the
+  start address, if it has any."
+  [^shorts words program-data]
+  (let [{:keys [bss start-address]} program-data]
+    (if (pos? (or bss 0))
+      (let [from (- start-address bss)
+            out (short-array (- (alength words) bss))]
+        (System/arraycopy words 0 out 0 from)
+        (System/arraycopy words start-address out from
+                          (- (alength words) start-address))
+        out)
+      words)))
+
 ;;; Static Processing ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (defn process-all
   "Given a list of allocation instructions add the allocated byte lists to the
@@ -107,14 +163,14 @@
   [instructions program-data]
   (if (empty? instructions)
     program-data
-    (let [{:keys [bytes labels counter user-macros]} program-data
+    (let [{:keys [bytes labels counter]} program-data
           instr (first instructions)
           instr-data (allocate instr)]
         (recur (rest instructions)
-             {:bytes (concat (:bytes instr-data) bytes)
-              :labels (sym/set-label (second instr) counter labels)
-              :counter (+ counter (:words instr-data))
-              :user-macros user-macros}))))
+             (assoc program-data
+                    :bytes (concat (:bytes instr-data) bytes)
+                    :labels (sym/set-label (second instr) counter labels)
+                    :counter (+ counter (:words instr-data)))))))
 
 (defn set-prog-start
   "Set the starting address to the current counter value of program-data
@@ -125,10 +181,19 @@
 
 (defn process-static
   "Process the static portion of a program and return updated program data
-  with the static bytes and updated program counter."
+  with the static bytes and updated program counter. Zeroed allocations,
+  see bss?, are placed after the others with process-bss, and a word is
+  reserved before the static data for the number of them."
   [static program-data]
-  (set-prog-start
-    (process-all (rest static) program-data)))
+  (let [{zeroed true initialised false} (group-by bss? (rest static))]
+    (set-prog-start
+      (if (empty? zeroed)
+        (process-all initialised program-data)
+        (->> (-> program-data
+                 (update :bytes #(b/pad-zero b/word-size %))
+                 (update :counter inc))
+             (process-all initialised)
+             (process-bss zeroed))))))
 
 ;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (comment
@@ -153,6 +218,10 @@
 (allocate '(:fword name 5 10.123 5.456 20.789))
 (allocate '(:fword-sc name 5 100 10.123 5.456 20.789))
 
+(bss? '(:word name 60000))
+(bss? '(:char name 10 "Hello"))
+(process-bss '((:word A 100) (:char B 15)) {:counter 4 :labels {}})
+
 (process-static (rest test-static) test-data)
 
 ;
@@ -0,0 +1,171 @@
+(ns lt64-asm.subset
+  (:require [lt64-asm.symbols :as sym]
+            [lt64-asm.bytes :as b]
+            [lt64-asm.aot :as aot]
+            [clojure.string :as string]))
+
+;;; Ops Used ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn op-names
+  "Given the source of the single file VM returns the names in its OP_CODE
+  enum, indexed by op code."
+  [vm-source]
+  (if-let [[_ body] (re-find #"(?s)enum op_codes \{(.*?)\} OP_CODE;"
+                             vm-source)]
+    (->> (string/split (string/replace body #"//[^\n]*" "") #",")
+         (map #(string/trim (string/replace % #"=.*" "")))
+         (remove empty?)
+         vec)
+    (throw (Exception. "Error: No OP_CODE enum in the VM source"))))
+
+(defn used-ops
+  "Given an assembled byte array for a program returns a map of the code of
+  every op in it to the set of flags it is used with, i.e. :load and
+  :load-lb are both code 0x03, with flags 0 and 1. Unknown ops are left
+  out, the VM reports them either way."
+  [program-bytes]
+  (->> (aot/decode (b/bytes->words program-bytes))
+       (filter :op)
+       (reduce (fn [used {:keys [op flag]}]
+                 (update used
+                         (bit-and (sym/op->code op) 0xff)
+                         (fnil conj #{})
+                         flag))
+               {})))
+
+;;; Pruning The VM ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Lines of the interpreter's switch that start a handler or a group of them
+(def handler-line #"^      OP\((\w+)\):")
+(def group-line #"^      ///")
+
+(defn handler-groups
+  "Split the lines of the interpreter's switch into its groups. Each is a
+  map with the :header lines of its group comment and its :handlers, a list
+  of the op name and the lines of each handler."
+  [lines]
+  (reduce (fn [groups line]
+            (let [group (peek groups)]
+              (cond
+                (re-find group-line line)
+                (conj groups {:header [line] :handlers []})
+
+                (re-find handler-line line)
+                (conj (pop groups)
+                      (update group :handlers conj
+                              [(second (re-find handler-line line)) [line]]))
+
+                (empty? (:handlers group))
+                (conj (pop groups) (update group :header conj line))
+
+                :else
+                (conj (pop groups)
+                      (update-in group [:handlers (dec (count
+                                                         (:handlers group)))
+                                        1]
+                                 conj line)))))
+          [{:header [] :handlers []}]
+          lines))
+
+(defn drop-blank-tail
+  "Remove the blank lines at the end of a list of lines."
+  [lines]
+  (vec (reverse (drop-while string/blank? (reverse lines)))))
+
+(defn specialize-flag
+  "Given the lines of a handler and the set of flags its op is used with,
+  replaces reads of the flag with the flag when there is only one."
+  [lines flags]
+  (if (= 1 (count flags))
+    (map #(string/replace % "code[pc].flag" (str (first flags))) lines)
+    lines))
+
+(defn prune-group
+  "Given a group from handler-groups and a map of the names of the ops to
+  keep to their flags, returns the lines of the group with only the
+  handlers to keep, or nil if it had handlers and none are kept."
+  [{:keys [header handlers]} ops]
+  (let [kept (filter #(contains? ops (first %)) handlers)]
+    (when (or (empty? handlers) (seq kept))
+      (concat header
+              (->> kept
+                   (map (fn [[op-name body]]
+                          (specialize-flag body (get ops op-name))))
+                   (#(concat (butlast %) [(drop-blank-tail (last %))]))
+                   (apply concat))))))
+
+(defn prune-handlers
+  "Given the source of the single file VM and a map of the names of the ops
+  to keep to their flags, removes the handlers for every other op from the
+  interpreter's switch, along with the comments of groups left empty. An op
+  that is removed falls through to the unknown op error."
+  [vm-source ops]
+  (let [lines (string/split-lines vm-source)
+        start (inc (.indexOf lines "    switch (code[pc].op) {"))
+        end (.indexOf lines "      BAD_OP:")]
+    (when (or (zero? start) (neg? end))
+      (throw (Exception. "Error: No interpreter switch in the VM source")))
+    (->> (handler-groups (subvec lines start end))
+         (keep #(prune-group % ops))
+         (interpose [""])
+         (apply concat)
+         (#(concat (subvec lines 0 start) % (subvec lines end)))
+         (string/join "\n")
+         (#(str % "\n")))))
+
+(defn prune-dispatch-table
+  "Given the source of the single file VM and a map of the names of the ops
+  to keep, removes every other op from the threaded engine's dispatch_table,
+  so it is sent to op_BAD with the ops that were never there."
+  [vm-source ops]
+  (->> (string/split-lines vm-source)
+       (map (fn [line]
+              (let [pruned (string/replace
+                             line
+                             #" ?\[(\w+)\] = &&op_(\w+),"
+                             #(if (contains? ops (nth % 1)) (first %) ""))]
+                (when-not (and (string/blank? pruned)
+                               (not (string/blank? line)))
+                  pruned))))
+       (remove nil?)
+       (string/join "\n")
+       (#(str % "\n"))))
+
+(defn prune-op-names
+  "Given the source of the single file VM and a map of the names of the ops
+  to keep, removes every other op from display_op_name."
+  [vm-source ops]
+  (string/replace vm-source
+                  #"    case (\w+): fprintf\(stream, \"\w+\"\); break;\n"
+                  #(if (contains? ops (second %)) (first %) "")))
+
+(defn specialize
+  "Given the source of the single file VM and an assembled byte array for a
+  program returns the VM with only the handlers for the ops the program
+  uses. Ops used with a single flag, i.e. only :load-lb, have it filled in.
+  Any other op, including ones a program writes into its own code, is
+  reported by the VM as unknown."
+  [vm-source program-bytes]
+  (let [names (op-names vm-source)
+        ops (into {"OUT_OF_BOUNDS" #{}}
+                  (map (fn [[code flags]] [(get names code) flags]))
+                  (used-ops program-bytes))]
+    (-> vm-source
+        (prune-handlers ops)
+        (prune-dispatch-table ops)
+        (prune-op-names ops))))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+(def vm-source (slurp (clojure.java.io/resource "lt64.c")))
+(op-names vm-source)
+
+;; push 5, jump, static word 99, push 7, wprn, halt
+(def test-bytes (b/->bytes [0 1 0 5 0 0x3d 0 99 0 1 0 7 0 0x45 0 0]))
+(used-ops test-bytes)
+
+(= vm-source (prune-handlers vm-source (zipmap (op-names vm-source)
+                                               (repeat #{}))))
+(spit "subset.c" (specialize vm-source test-bytes))
+
+;
+)
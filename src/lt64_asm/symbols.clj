@@ -152,6 +152,24 @@
    ;; Late additions
    :prnpk          0x64
 
+   ;;; Fused ops, see fusion-map
+   :loadi          0x65
+   :loadi-lb       0x0165
+   :storei         0x66
+   :storei-lb      0x0166
+   :dloadi         0x67
+   :dloadi-lb      0x0167
+   :dstorei        0x68
+   :dstorei-lb     0x0168
+   :jumpi          0x69
+   :branchi        0x6a
+   :calli          0x6b
+   :dincr          0x6c
+   :nip            0x6d
+
+   ;; Marks where a program's setup ends, see the VM's snapshots
+   :snapshot       0x6e
+
    ;; Pseudo ops that will be replaced or signal an error
    :fpush          0xff
    :invalid        0xff})
@@ -177,6 +195,34 @@
    :!eat-ch        [:readch :pop]
    })
 
+;;; Fused Ops ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Map of ops that usually follow a :push to the fused op that does the same
+;; thing taking the pushed word as an immediate argument.
+;; I.e. `:push A :load-lb` becomes `:loadi-lb A`
+(def fusion-map
+  {:load           :loadi
+   :load-lb        :loadi-lb
+   :store          :storei
+   :store-lb       :storei-lb
+   :dload          :dloadi
+   :dload-lb       :dloadi-lb
+   :dstore         :dstorei
+   :dstore-lb      :dstorei-lb
+   :jump           :jumpi
+   :branch         :branchi
+   :call           :calli})
+
+(def imm-ops (set (vals fusion-map)))
+
+;; Fused ops that replace a sequence that does not need an argument
+(def fused-seqs
+  {[:dpush 1 :dadd]  :dincr
+   [:swap :pop]      :nip})
+
+;; Markers in a proc that change how it is assembled but are not ops.
+;; :no-inline keeps the proc from being inlined, see lt64-asm.inline
+(def annotations #{:no-inline})
+
 ;;; Predicates ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (defn lt64-prog?
   "Checks if a list is a valid lt64 assembly program."
@@ -230,6 +276,17 @@
   (or (= op :push)
       (dpush-op? op)))
 
+(defn annotation?
+  "Checks if an op is an annotation, see annotations."
+  [op]
+  (contains? annotations op))
+
+(defn imm-op?
+  "Checks if an op is a fused op that has a word argument following it in
+  the instruction list."
+  [op]
+  (contains? imm-ops op))
+
 (defn builtin-macro?
   [op]
   (contains? macro-map op))
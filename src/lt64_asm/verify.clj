@@ -0,0 +1,282 @@
+(ns lt64-asm.verify
+  (:require [lt64-asm.aot :as aot]
+            [lt64-asm.bytes :as b]))
+
+;; The highest dsp and rsp the VM allows, END_STACK and END_RETURN in
+;; lt64.c. Both stacks start empty, at 0.
+(def end-stack 0x1000)
+(def end-return 0x1000)
+
+;;; Stack Effects ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; The number of words each op takes from the top of the data stack, or
+;; reads from under the top, and the number it leaves in their place. :nth
+;; and :dnth read at a depth given at run time, which the VM does not check
+;; either, so only the word with the depth is counted.
+(def data-effects
+  (merge
+    (zipmap (keys aot/binary-exprs) (repeat [2 1]))
+    (into {} (for [[op [k _]] aot/dresult-exprs] [op [(+ k 2) 2]]))
+    {:halt [0 0]  :push [0 1]  :pop [1 0]  :load [1 1]  :store [2 0]
+     :first [1 2]  :second [2 3]  :nth [1 1]  :swap [2 2]  :rot [3 3]
+     :rpush [1 0]  :rpop [0 1]  :rgrab [0 1]
+     :dpush [0 2]  :dpop [2 0]  :dload [1 2]  :dstore [3 0]
+     :dfirst [2 4]  :dsecond [4 6]  :dnth [1 2]  :dswap [4 4]  :drot [6 6]
+     :drpush [2 0]  :drpop [0 2]  :drgrab [0 2]
+     :multu [2 2]  :not [1 1]
+     :jump [1 0]  :branch [2 0]  :call [1 0]  :ret [0 0]
+     :dsp [0 1]  :pc [0 1]  :bfp [0 1]  :fmp [0 1]
+     :wprn [1 0]  :dprn [2 0]  :wprnu [1 0]  :dprnu [2 0]  :fprn [2 0]
+     :fprnsc [3 0]  :prnch [1 0]  :prn [0 0]  :prnln [0 0]  :prnmem [1 0]
+     :wread [0 1]  :dread [0 2]  :fread [0 2]  :freadsc [1 2]
+     :readch [0 1]  :readln [0 0]
+     :bufstore [2 0]  :bufload [1 1]  :high [1 2]  :low [1 2]
+     :unpack [1 3]  :pack [2 1]
+     :fmult [4 2]  :fdiv [4 2]  :fmultsc [5 2]  :fdivsc [5 2]  :prnpk [1 0]
+     :loadi [0 1]  :storei [1 0]  :dloadi [0 2]  :dstorei [2 0]
+     :jumpi [0 0]  :branchi [1 0]  :calli [0 0]  :snapshot [0 0]}))
+
+;; The same for the return stack, for the ops that use it directly. Calls
+;; and returns are followed instead, see step.
+(def return-effects
+  {:rpush [0 1]  :rpop [1 0]  :rgrab [1 1]
+   :drpush [0 2]  :drpop [2 0]  :drgrab [2 2]})
+
+(defn data-effect
+  "The data stack effect of a decoded instruction, see data-effects. The
+  copies between memory and the buffer take a word less when their flag
+  is not one of the two they use."
+  [{:keys [op flag]}]
+  (case op
+    :mem-to-buf (if (#{0 1} flag) [2 0] [1 0])
+    :str-to-buf (if (#{0 1} flag) [1 0] [0 0])
+    (get data-effects op)))
+
+;;; Abstract Interpretation ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Code is walked from each address it is called at, main being called at
+;; 0, with the depths of the stacks relative to where they were at the call
+;; and the address on top of the data stack if a :push put it there. Every
+;; instruction has to be reached with the same depths each time, so loops
+;; can't grow or shrink the stacks. Each walk is summed up by the lowest
+;; and highest the data stack goes, the highest the return stack goes, and
+;; the depths it returns with, so a proc is only walked once however many
+;; places call it.
+
+(defn fail!
+  "Add the reason verification failed at addr to the errors in ctx.
+  Returns nil."
+  [ctx addr reason]
+  (vswap! (:errors ctx) conj [addr reason])
+  nil)
+
+(defn goto
+  "The state for jumping from instr to target, or nil after adding an error
+  if target is not the start of an instruction."
+  [ctx instr target state]
+  (if (contains? (:instrs ctx) target)
+    [target state]
+    (fail! ctx (:addr instr)
+           (str "jumps to " target ", which is not an instruction"))))
+
+(declare summarize)
+
+(defn step
+  "Given the context of a walk, a decoded instruction, the state it is
+  reached with, and whether the walk is main's, returns a map of the states
+  of the instructions run after it in :next, the depths it takes the data
+  stack to in :low and :high, the depth it takes the return stack to in
+  :rhigh, and the data stack depth it returns with in :ret.
+  Adds an error to ctx for anything that can't be verified."
+  [ctx {:keys [addr op args next] :as instr} {:keys [d r top]} main?]
+  (let [[in out] (data-effect instr)
+        [rin rout] (get return-effects op [0 0])
+        d0 (- d (or in 0))
+        d1 (+ d0 (or out 0))
+        r1 (+ (- r rin) rout)
+        imm (bit-and (or (first args) 0) 0xffff)
+        result {:low d0 :high (max d d1) :rhigh (max r r1)}
+        fall #(if (contains? (:instrs ctx) next)
+                [next %]
+                (fail! ctx addr "runs past the end of the program"))
+        call (fn [target]
+               (let [callee (when (goto ctx instr target nil)
+                              (summarize ctx target))]
+                 (cond
+                   (nil? callee)
+                   result
+
+                   (= :walking callee)
+                   (do (fail! ctx addr (str "calls " target " recursively"))
+                       result)
+
+                   (< 1 (count (:rets callee)))
+                   result
+
+                   :else
+                   (assoc result
+                          :low (min d0 (+ d0 (:low callee)))
+                          :high (max d (+ d0 (:high callee)))
+                          :rhigh (max r (+ r 1 (:rhigh callee)))
+                          :next (when-let [ret (first (:rets callee))]
+                                  [(fall {:d (+ d0 ret) :r r})])))))
+        jump (fn [target]
+               (or (when-let [state (goto ctx instr target {:d d0 :r r})]
+                     [state])
+                   []))]
+    (cond
+      ;; The VM stops at unused and unknown op codes
+      (nil? in)
+      result
+
+      (neg? (- r rin))
+      (do (fail! ctx addr "takes more from the return stack than it put there")
+          result)
+
+      :else
+      (case op
+        :halt result
+        :push (assoc result :next [(fall {:d d1 :r r1 :top imm})])
+        :jumpi (assoc result :next (jump imm))
+        :branchi (assoc result :next (concat (jump imm) [(fall {:d d0 :r r})]))
+        :calli (call imm)
+        (:jump :branch :call)
+        (cond
+          (nil? top)
+          (do (fail! ctx addr "goes to an address computed at run time")
+              result)
+
+          (= op :jump) (assoc result :next (jump top))
+          (= op :call) (call top)
+          :else (assoc result :next (concat (jump top)
+                                            [(fall {:d d0 :r r})])))
+        :ret
+        (cond
+          main? (do (fail! ctx addr "returns from main") result)
+          (pos? r) (do (fail! ctx addr (str "returns with " r " words of"
+                                            " its own on the return stack"))
+                       result)
+          :else (assoc result :ret d))
+        (assoc result :next [(fall {:d d1 :r r1})])))))
+
+(defn walk
+  "Walk the code called at entry, see step, and return its summary, a map
+  of the lowest and highest depths of the data stack in :low and :high,
+  the highest depth of the return stack in :rhigh, and the set of data
+  stack depths it returns with in :rets. The depths are relative to the
+  ones at the call. In main's summary they are [depth addr] pairs instead,
+  with the address the depth is reached at, for the report."
+  [ctx entry]
+  (let [main? (= entry 0)
+        by-addr (:instrs ctx)
+        note (fn [summary k f depth addr]
+               (if main?
+                 (update summary k #(if (= depth (f depth (first %)))
+                                      [depth addr]
+                                      %))
+                 (update summary k f depth)))]
+    (loop [todo [[entry {:d 0 :r 0}]]
+           seen {}
+           summary (if main?
+                     {:low [0 0] :high [0 0] :rhigh [0 0] :rets #{}}
+                     {:low 0 :high 0 :rhigh 0 :rets #{}})]
+      (if (empty? todo)
+        summary
+        (let [[addr state] (peek todo)
+              todo (pop todo)
+              before (get seen addr)]
+          (cond
+            (nil? state)
+            (recur todo seen summary)
+
+            (and before (not= (dissoc before :top) (dissoc state :top)))
+            (do (fail! ctx addr (str "is reached with stack depths "
+                                     [(:d before) (:r before)] " and "
+                                     [(:d state) (:r state)]))
+                (recur todo seen summary))
+
+            (and before (or (nil? (:top before))
+                            (= (:top before) (:top state))))
+            (recur todo seen summary)
+
+            :else
+            (let [state (cond-> state before (dissoc :top))
+                  result (step ctx (get by-addr addr) state main?)
+                  summary (-> summary
+                              (note :low min (:low result) addr)
+                              (note :high max (:high result) addr)
+                              (note :rhigh max (:rhigh result) addr)
+                              (cond-> (:ret result)
+                                (update :rets conj (:ret result))))]
+              (when (and (:ret result) (< 1 (count (:rets summary))))
+                (fail! ctx addr (str "returns with different stack depths"
+                                     " than the other returns from "
+                                     entry)))
+              (recur (into todo (:next result))
+                     (assoc seen addr state)
+                     summary))))))))
+
+(defn summarize
+  "The summary of the code called at entry, see walk, walked the first
+  time it is asked for. Returns :walking if it is still being walked, i.e.
+  for a recursive call."
+  [ctx entry]
+  (if-let [summary (get @(:summaries ctx) entry)]
+    summary
+    (do (vswap! (:summaries ctx) assoc entry :walking)
+        (let [summary (walk ctx entry)]
+          (vswap! (:summaries ctx) assoc entry summary)
+          summary))))
+
+;;; Verification ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(defn verify
+  "Given an assembled byte array for a program proves that it never takes
+  either stack out of bounds and that every jump, branch, call, and return
+  goes to the start of one of its instructions, so the VM can run it
+  without checking the registers. Jumps have to go to a label pushed right
+  before them, or be fused, and recursion and loops that change the depth
+  of the stacks can't be verified.
+  Returns the errors of the things that could not be verified, a list of
+  [address reason] pairs in address order, or an empty list if it is
+  verified."
+  [program-bytes]
+  (let [instrs (aot/decode (b/bytes->words program-bytes))
+        ctx {:instrs (into {} (map (juxt :addr identity)) instrs)
+             :summaries (volatile! {})
+             :errors (volatile! [])}
+        {[low low-at] :low [high high-at] :high [rhigh rhigh-at] :rhigh}
+        (summarize ctx 0)]
+    (when (neg? low)
+      (fail! ctx low-at "takes more from the data stack than is on it"))
+    (when (> high end-stack)
+      (fail! ctx high-at (str "can take the data stack to " high
+                              " words, past the end at " end-stack)))
+    (when (> rhigh end-return)
+      (fail! ctx rhigh-at (str "can take the return stack to " rhigh
+                               " words, past the end at " end-return)))
+    (sort-by first (distinct @(:errors ctx)))))
+
+(defn report
+  "Given the errors from verify returns a report of whether the program
+  was verified, and if not where and why."
+  [errors]
+  (if (empty? errors)
+    "Verified the stacks and jumps, the C file runs without checking them\n"
+    (str "Could not verify the stacks and jumps, the C file checks them:\n"
+         (->> errors
+              (map (fn [[addr reason]] (str "  " addr ": " reason "\n")))
+              (apply str)))))
+
+;;; REPL ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(comment
+
+;; push 5, jump, static word 99, push 7, wprn, halt
+(def test-words [0x01 5 0x3d 99 0 0x01 7 0x45 0x00])
+(verify (b/->bytes (mapcat #(vector (bit-and % 0xff) (bit-shift-right % 8))
+                           test-words)))
+; ()
+
+;; push 7, jump to the push, so every loop pushes another word
+(verify (b/->bytes [1 0 3 0 0x3d 0 1 0 7 0 0x69 0 3 0]))
+
+(print (report [[3 "is reached with stack depths [0 0] and [1 0]"]]))
+;
+)
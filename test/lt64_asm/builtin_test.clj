@@ -6,14 +6,15 @@
             [lt64-asm.files :refer :all]))
 
 ;; Helpers ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-(defn execute
-  "Create a standalone program with the given ops list as main,
-  compile, and run it. This is a little inefficient due to compiling a
-  full VM instance for a few instructions so all tests for simple macros should
-  be combined when possible."
-  [& ops] 
+(defn execute-with
+  "Create a standalone program with the given ops list as main, assembled
+  with the given options, compile, and run it. This is a little inefficient
+  due to compiling a full VM instance for a few instructions so all tests for
+  simple macros should be combined when possible."
+  [options & ops]
   (create-standalone-cfile
-    (assemble ['lt64-asm-prog '(static) (cons 'main ops) '(include "stdlib")])
+    (assemble ['lt64-asm-prog '(static) (cons 'main ops) '(include "stdlib")]
+              options)
     "test.c")
   (if (not (.exists (file "test.c")))
     "*** failed to assemble ***"
@@ -21,6 +22,11 @@
       (clojure.string/trim (:out (sh "./test.out")))
       "*** failed to compile ***")))
 
+(defn execute
+  "Like execute-with using the default assembler options."
+  [& ops]
+  (apply execute-with {} ops))
+
 (defn clean-up
   "Remove the testing files created by setup."
   []
@@ -73,6 +79,45 @@
                   :push 9 :dpush 2 :!->word :wprn :wprn :!prn-nl)))
   (clean-up))
 
+;; Fused Op Tests ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(def fusable-ops
+  [:push 7 :push 3 :store :push 3 :load :wprn :!prn-nl
+   :dpush 12345677 :push 4 :dstore :push 4 :dload :!dinc :dprn :!prn-nl
+   :push 1 :push 'skip :branch :push 0 :wprn :label 'skip
+   :push 0 :push 'skip2 :branch :push 1 :wprn :label 'skip2 :!prn-nl
+   :push 'over :jump :push 0 :wprn :label 'over
+   :push 5 :push 6 :!->word :wprn])
+
+(deftest fused-ops
+  (is (= (join-nl 7 12345678 1 6)
+         (apply execute fusable-ops)))
+  (is (= (join-nl 7 12345678 1 6)
+         (apply execute-with {:no-fuse true} fusable-ops))
+      "With fusing turned off")
+  (clean-up))
+
+;; Peephole Tests ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(def peephole-ops
+  [:push 1 :push 2 :add :!inc :!dec :wprn :!prn-nl
+   :dpush 5 :dpush -7 :dmult :dprn :!prn-nl
+   :push 3 :push 4 :swap :swap :sub :wprn :!prn-nl
+   :push 'hop :jump
+   :label 'hop :push 'end :jump
+   :label 'end :push 30000 :push 30000 :add :wprn
+   :halt])
+
+(deftest peephole
+  (is (= (join-nl 3 -35 -1 -5536)
+         (apply execute peephole-ops)
+         (apply execute-with {:no-peephole true} peephole-ops))
+      "Gives the same output as the ops as written")
+  (is (< (count (assemble ['lt64-asm-prog '(static) (cons 'main peephole-ops)]
+                          {}))
+         (count (assemble ['lt64-asm-prog '(static) (cons 'main peephole-ops)]
+                          {:no-peephole true})))
+      "Is smaller than the ops as written")
+  (clean-up))
+
 ;; STL tests ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (deftest odd-even
   (is (= (join-nl 1 0 0 1)
@@ -82,5 +127,30 @@
                   :push 8 :push 'std/even? :call :wprn)))
   (clean-up))
 
+(deftest unused-procs
+  (let [program #(vector 'lt64-asm-prog '(static)
+                         '(main :push 9 :push std/odd? :call :wprn :halt)
+                         %)]
+    (is (= (vec (assemble (program '(include "stdlib" odd?))
+                          {:no-shake true :no-peephole true}))
+           (vec (assemble (program '(include "stdlib"))
+                          {:no-peephole true})))
+        "Only the stdlib procs that are used are assembled")))
+
+(deftest fall-through-procs
+  (doseq [[program reason]
+          [['(lt64-asm-prog (static)
+               (main :push 3 :push add-one :call :wprn :halt)
+               (proc add-one :push 1 :add)
+               (proc twice :push 2 :mult :ret))
+            "A proc without a :ret keeps the proc it runs into"]
+           ['(lt64-asm-prog (static)
+               (main :push 3 :wprn)
+               (proc stop :halt))
+            "Main without a :halt keeps the proc it runs into"]]]
+    (is (= (vec (assemble program {:no-shake true :no-peephole true}))
+           (vec (assemble program {:no-peephole true})))
+        reason)))
+
 ;; Run Tests ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (run-tests 'lt64-asm.builtin-test)
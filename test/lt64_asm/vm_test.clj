@@ -2,22 +2,29 @@
   (:require [clojure.test :refer :all]
             [clojure.java.shell :refer [sh]]
             [clojure.java.io :refer [file]]
-            [lt64-asm.core :refer :all]))
+            [lt64-asm.core :refer :all]
+            [lt64-asm.files :as files]
+            [lt64-asm.verify :as verify]))
 
 ;;; Helpers ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (def prog-dir "test/lt64_asm/lta_programs/")
 
+(def ^:dynamic *cc-flags*
+  "Extra flags given to gcc when setup compiles the VM."
+  [])
+
 (defn setup
   "Assembler given file to a standalone .c file and compile it.
   Returns a function that takes a list of strings, where each string is
   a line of input for the program. When run this function returns the
   output of the program run on the input, but trimmed to remove trailing
-  whitespace."
-  [lta-file]
-  (-main lta-file "-c" "test.c"lta-file)
+  whitespace. Any flags are passed on to the assembler."
+  [lta-file & flags]
+  (apply -main lta-file "-c" "test.c" lta-file flags)
   (if (not (.exists (file "test.c")))
     (fn [_] "*** failed to assemble ***")
-    (if (= 0 (:exit (sh "gcc" "test.c" "-o" "test.out")))
+    (if (= 0 (:exit (apply sh "gcc" (concat *cc-flags*
+                                            ["test.c" "-o" "test.out"]))))
       (fn [input]
         (clojure.string/trim
           (:out (sh "./test.out"
@@ -73,5 +80,397 @@
   (clean-up)))
 
 
+;;; Reading Input ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Reads three words, a double word, a fixed point number and a char. The
+;; numbers are read the way scanf read them, except that a read that fails
+;; pushes 0.
+(deftest reading
+  (spit "test.lta" (pr-str '(lt64-asm-prog
+                              (static)
+                              (main :wread :wprn :push 32 :prnch
+                                    :wread :wprn :push 32 :prnch
+                                    :wread :wprn :push 32 :prnch
+                                    :dread :dprn :push 32 :prnch
+                                    :fread :fprn :push 32 :prnch
+                                    :readch :wprn :halt))))
+  (doseq [flags [[] ["-a"]]]
+    (let [execute (apply setup "test.lta" flags)]
+      (is (= "-7 12 4464 -1215752191 3.250 32"
+             (execute ["  -7 +12" "\t 70000" " -99999999999 3.25 z"]))
+          "Leading whitespace and signs, with numbers too big that wrap")
+      (is (= "-1 1 2 3 4.000 32"
+             (execute ["99999999999999999999 1 2 3 4 q"]))
+          "A number too big for a long is cut to the largest one")
+      (is (= "-5 -6 7 8 9.000 32" (execute ["-5-6 7 8 9 .5 q"]))
+          "A sign ends the number before it")
+      (is (= "0 5 6 7 8.000 32" (execute ["- 5 6 7 8 9 q"]))
+          "A sign without digits is a failed read")
+      (is (= "12 0 0 0 0.000 0" (execute ["12"]))
+          "Reads past the end of the input")))
+  (sh "rm" "-rf" "test.lta")
+  (clean-up))
+
+(defn check-kattis
+  "Check the Kattis programs on some of the inputs above, with the VM
+  compiled with cc-flags. Any flags are passed on to the assembler. For
+  checking that other ways of building them give the same output."
+  [cc-flags & flags]
+  (binding [*cc-flags* cc-flags]
+    (let [execute (apply setup (str prog-dir "coldputer.lta") flags)]
+      (is (= "3" (execute ["5" "2 -3 8 -1 -29"]))
+          "Coldputer when passing some negatives")
+      (is (= "50" (execute ["100" (str-range -1000000 1000000 20000)]))
+          "Coldputer with the max number of temps"))
+    (let [execute (apply setup (str prog-dir "stopwatch.lta") flags)]
+      (is (= "still running" (execute ["3" "0" "11" "1000000"]))
+          "Stopwatch when the watch will keep running")
+      (is (= "500000" (execute ["1000" (str-range-nl 0 1000000 1000)]))
+          "Stopwatch with the max number of temps"))
+    (let [execute (apply setup (str prog-dir "magic_trick.lta") flags)]
+      (is (= "1" (execute ["robust\n"]))
+          "Magic trick when we can tell for sure")
+      (is (= "0" (execute ["icpc\n"]))
+          "Magic trick when we can't tell")))
+  (clean-up))
+
+
+;;; Engines ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; The programs are verified, so the checks are only left in with --no-verify
+(deftest fast
+  (check-kattis ["-DLT64_FAST"] "--no-verify"))
+
+(deftest tos
+  (check-kattis ["-DLT64_TOS"])
+  (check-kattis ["-DLT64_TOS" "-DLT64_THREADED"] "--no-verify"))
+
+;;; VM Runner ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest runner
+  (-main (str prog-dir "coldputer.lta") "-o" "test.ltb")
+  (is (.exists (file "test.ltb"))
+      "-o writes the binary instead of a C file")
+  (sh "gcc" "-DLT64_RUNNER" "resources/lt64.c" "-o" "test.out")
+  (is (= "3" (clojure.string/trim
+               (:out (sh "./test.out" "test.ltb" :in "5\n2 -3 8 -1 -29"))))
+      "Coldputer mapped from its binary when passing some negatives")
+  (is (= 9 (:exit (sh "./test.out")))
+      "No program to run")
+  (is (= 3 (:exit (sh "./test.out" "missing.ltb")))
+      "A program that can't be opened")
+  (spit "test.ltb" "")
+  (is (= 3 (:exit (sh "./test.out" "test.ltb")))
+      "An empty program")
+  (spit "test.ltb" (apply str (repeat 200000 "a")))
+  (is (= 1 (:exit (sh "./test.out" "test.ltb")))
+      "A program too large for memory")
+  (sh "rm" "-rf" "test.ltb")
+  (clean-up))
+
+;;; Embedding ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Runs test.ltb with a budget that stops it part way, then to the end, and
+;; prints what both runs returned and the program's output.
+(def library-driver
+  (clojure.string/join
+    "\n"
+    ["#include <stdio.h>"
+     "#include <stdlib.h>"
+     "#include \"lt64.h\""
+     "int main() {"
+     "  static short words[1 << 15];"
+     "  FILE* file = fopen(\"test.ltb\", \"rb\");"
+     "  size_t length = fread(words, sizeof(short), 1 << 15, file);"
+     "  fclose(file);"
+     "  LT64_VM* vm = lt64_create();"
+     "  LT64_BUFFER in = { .data = \"5\\n2 -3 8 -1 -29\", .length = 15 };"
+     "  LT64_BUFFER out = { 0 };"
+     "  lt64_load(vm, words, length);"
+     "  lt64_set_input(vm, lt64_buffer_read, &in);"
+     "  lt64_set_output(vm, lt64_buffer_write, &out);"
+     "  size_t budget = lt64_run(vm, 10);"
+     "  size_t halted = lt64_run(vm, 0);"
+     "  printf(\"%zu %zu %.*s\", budget, halted, (int)out.length, out.data);"
+     "  lt64_destroy(vm);"
+     "  free(out.data);"
+     "  return 0;"
+     "}"]))
+
+(deftest library
+  (-main (str prog-dir "coldputer.lta") "-o" "test.ltb")
+  (spit "test.c" library-driver)
+  (is (= 0 (:exit (sh "gcc" "-DLT64_LIBRARY" "-Iresources" "resources/lt64.c"
+                      "test.c" "-o" "test.out")))
+      "The VM builds as a library and links with a program using lt64.h")
+  (is (= "12 0 3" (clojure.string/trim (:out (sh "./test.out"))))
+      "Coldputer stops at its budget and carries on from there")
+  (sh "rm" "-rf" "test.ltb")
+  (clean-up))
+
+;;; VM Batch Mode ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest vm-batch
+  (sh "mkdir" "-p" "test-inputs/stopwatch")
+  (spit "test-inputs/negatives.in" "5\n2 -3 8 -1 -29")
+  (spit "test-inputs/extremes.in" "2\n-1000000 1000000")
+  (spit "test-inputs/stopwatch/stops.in" "2\n7\n11")
+  (spit "test-inputs/stopwatch/running.in" "3\n0\n11\n1000000")
+  (-main (str prog-dir "coldputer.lta") "-c" "test.c")
+  (sh "gcc" "-pthread" "-DLT64_BATCH" "test.c" "-o" "test.out")
+  (let [{:keys [exit out]} (sh "./test.out" "test-outputs"
+                               "test-inputs/negatives.in"
+                               "test-inputs/extremes.in")]
+    (is (= 0 exit)
+        "Coldputer halts on every input in the batch")
+    (is (= 2 (count (clojure.string/split-lines out)))
+        "A line is printed for each input"))
+  (is (= "3" (clojure.string/trim (slurp "test-outputs/negatives.in.out")))
+      "Coldputer from the batch when passing some negatives")
+  (is (= "1" (clojure.string/trim (slurp "test-outputs/extremes.in.out")))
+      "Coldputer from the batch with just min and max values")
+  (-main (str prog-dir "stopwatch.lta") "-o" "test.ltb")
+  (sh "gcc" "-pthread" "-DLT64_BATCH" "-DLT64_RUNNER" "resources/lt64.c"
+      "-o" "test.out")
+  (is (= 0 (:exit (sh "./test.out" "test.ltb" "test-outputs"
+                      "test-inputs/stopwatch")))
+      "The runner runs the batch for every input in a directory")
+  (is (= "4" (clojure.string/trim (slurp "test-outputs/stops.in.out")))
+      "Stopwatch from the batch when the watch will stop")
+  (is (= "still running"
+         (clojure.string/trim (slurp "test-outputs/running.in.out")))
+      "Stopwatch from the batch when the watch will keep running")
+  (sh "rm" "-rf" "test-inputs" "test-outputs" "test.ltb")
+  (clean-up))
+
+;;; Run Limits ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest run-limits
+  (spit "test.lta" (pr-str '(lt64-asm-prog
+                              (static)
+                              (main :label loop :push loop :jump))))
+  (doseq [[cc-flag & flags] [["-DLT64_MAX_STEPS=1000"]
+                             ["-DLT64_MAX_MS=50"]
+                             ["-DLT64_MAX_STEPS=1000" "-a"]]]
+    (apply -main "test.lta" "-c" "test.c" flags)
+    (sh "gcc" cc-flag "test.c" "-o" "test.out")
+    (let [{:keys [exit err]} (sh "./test.out")]
+      (is (= 12 exit)
+          (str "A loop that never ends is stopped with " cc-flag " " flags))
+      (is (clojure.string/includes? err "ran out")
+          "The error says the limit ran out")))
+  (sh "rm" "-rf" "test.lta")
+  (clean-up))
+
+;;; Snapshots ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest snapshots
+  (spit "test.lta" (pr-str '(lt64-asm-prog
+                              (static)
+                              (main :push 7 :wprn :!prn-nl :snapshot
+                                    :wread :push 2 :mult :wprn :halt))))
+  (-main "test.lta" "-o" "test.ltb")
+  (sh "gcc" "-DLT64_SNAPSHOT" "-DLT64_RUNNER" "resources/lt64.c"
+      "-o" "test.out")
+  (is (= "7\n10" (clojure.string/trim (:out (sh "./test.out" "test.ltb"
+                                                :in "5"))))
+      "The program runs past its snapshot")
+  (is (= "8" (clojure.string/trim (:out (sh "./test.out" "lt64.snap"
+                                            :in "4"))))
+      "The snapshot carries on from the :snapshot with new input")
+  (-main "test.lta" "-c" "test.c")
+  (sh "gcc" "-DLT64_FORK" "test.c" "-o" "test.out")
+  (spit "test.in" "9")
+  (is (= 0 (:exit (sh "./test.out" "test-outputs" :in "test.in\n")))
+      "The fork server runs the input it is given")
+  (is (= "7\n18" (clojure.string/trim (slurp "test-outputs/test.in.out")))
+      "Runs from the fork server have the output from before the snapshot")
+  (spit "test.lta" (pr-str '(lt64-asm-prog
+                              (static)
+                              (main :label loop :push loop :jump
+                                    :snapshot :halt))))
+  (-main "test.lta" "-c" "test.c" "--no-peephole")
+  (sh "gcc" "-pthread" "-DLT64_BATCH" "-DLT64_MAX_STEPS=1000" "test.c"
+      "-o" "test.out")
+  (is (= 12 (:exit (sh "timeout" "10" "./test.out" "test-outputs" "test.in")))
+      "A batch stops a program that never gets to its snapshot")
+  (sh "rm" "-rf" "test.lta" "test.ltb" "test.in" "lt64.snap" "test-outputs")
+  (clean-up))
+
+;;; Ahead of Time Translation ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest aot
+  (check-kattis [] "-a"))
+
+;;; Op Subset ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; The VM only has the handlers for the ops each program uses, so these
+;; should give the same output as the full VM above.
+(deftest subset
+  (check-kattis ["-DLT64_THREADED"] "-s")
+  (check-kattis [] "-s" "-a"))
+
+;;; Profile Guided Optimization ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest pgo
+  (spit "test.in" (str "100\n" (str-range -1000000 1000000 20000)))
+  (-main (str prog-dir "coldputer.lta") "-c" "test.c" "-g" "test.in")
+  (is (= "50" (clojure.string/trim (:out (sh "./test" :in (file "test.in")))))
+      "Coldputer built with the sample as its profile")
+  (sh "rm" "-rf" "test" "test.in")
+  (clean-up))
+
+;;; Batch and Server ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest batch
+  (-main "-b"
+         (str prog-dir "coldputer.lta") "test.c"
+         (str prog-dir "stopwatch.lta") "test.ltb")
+  (is (= 0 (:exit (sh "gcc" "test.c" "-o" "test.out")))
+      "The .c output is a standalone C file")
+  (is (= "3" (clojure.string/trim
+               (:out (sh "./test.out" :in "5\n2 -3 8 -1 -29"))))
+      "Coldputer from the batch when passing some negatives")
+  (is (.exists (file "test.ltb"))
+      "The other output is a binary")
+  (sh "rm" "-rf" "test.ltb")
+  (clean-up))
+
+(deftest server
+  (let [answers (with-out-str
+                  (with-in-str (str (str prog-dir "magic_trick.lta") " test.c\n"
+                                    "missing.lta test.ltb\n")
+                    (-main "--server")))
+        [first-answer second-answer] (clojure.string/split-lines answers)]
+    (is (= "ok" first-answer)
+        "A program that assembles")
+    (is (clojure.string/starts-with? second-answer "error missing.lta")
+        "A program that does not exist")
+    (is (= "1" (clojure.string/trim
+                 (:out (do (sh "gcc" "test.c" "-o" "test.out")
+                           (sh "./test.out" :in "robust\n")))))
+        "Magic trick from the server when we can tell for sure"))
+  (clean-up))
+
+;;; Cached Modules ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Calls to the procs in an object are not inlined, so the programs are
+;; compared without the peephole pass
+(deftest cached-modules
+  (let [program (files/get-program (str prog-dir "max_prog.lta"))
+        options {:cache-dir "test-cache" :no-peephole true}
+        expanded (vec (assemble program {:no-cache true :no-peephole true}))
+        assembled (vec (assemble program options))]
+    (is (= 1 (count (.list (file "test-cache"))))
+        "The module is assembled into the cache")
+    (is (= expanded assembled)
+        "Linking the object gives the same program as expanding the module")
+    (is (= expanded (vec (assemble program options)))
+        "Linking the cached object gives the same program")
+    (let [execute (setup (str prog-dir "max_prog.lta")
+                         "--cache-dir" "test-cache")]
+      (is (= "7\n9" (execute ["3 7" "9 2"]))
+          "Max with the module's proc and its macro")))
+  (sh "rm" "-rf" "test-cache")
+  (clean-up))
+
+;;; Inlining ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest inlining
+  (let [program '(lt64-asm-prog
+                   (static)
+                   (main :push 3 :push odd :call :wprn :!prn-nl
+                         :push 3 :push kept :call :wprn :halt)
+                   (proc odd :push 2 :mod :ret)
+                   (proc kept :no-inline :push 3 :sub :ret))]
+    (is (< (count (assemble program {}))
+           (count (assemble program {:no-peephole true})))
+        "The program is smaller with odd inlined and its proc removed")
+    (spit "test.lta" (pr-str program))
+    (is (= "1\n0" ((setup "test.lta") []))
+        "A proc marked :no-inline is still called"))
+  (sh "rm" "-rf" "test.lta")
+  (clean-up))
+
+;;; Verification ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest verification
+  (let [execute (setup (str prog-dir "coldputer.lta"))]
+    (is (clojure.string/includes? (slurp "test.c") "#define LT64_VERIFIED")
+        "Coldputer is verified, so its C file runs without checks")
+    (is (= "3" (execute ["5" "2 -3 8 -1 -29"]))
+        "Coldputer without checks when passing some negatives"))
+  (let [program '(lt64-asm-prog
+                   (static)
+                   (main :push 1 :push grow :call :halt)
+                   (proc grow :push 1 :add :first :push grow :call :ret))]
+    (is (seq (verify/verify (assemble program {})))
+        "A proc that calls itself forever is not verified")
+    (is (seq (verify/verify (assemble program {:no-peephole true})))
+        "Nor is it without the tail call turned into a jump"))
+  (let [execute (setup (str prog-dir "stopwatch.lta") "--no-verify")]
+    (is (not (clojure.string/includes? (slurp "test.c") "LT64_VERIFIED"))
+        "The checks are left in with --no-verify")
+    (is (= "4" (execute ["2" "7" "11"]))
+        "Stopwatch with checks when the watch will stop"))
+  (clean-up))
+
+;;; Zeroed Static Data ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+(deftest zeroed-data
+  (let [program '(lt64-asm-prog
+                   (static
+                     (:word big 20000)
+                     (:word small 2 7 9))
+                   (main :push 5 :push big :push 19999 :add :store-lb
+                         :push big :push 19999 :add :load-lb :wprn :!prn-nl
+                         :push big :load-lb :wprn :!prn-nl
+                         :push small :push 1 :add :load-lb :wprn :halt))]
+    (is (< (count (assemble program {})) 200)
+        "The zeroed words are not in the binary")
+    (spit "test.lta" (pr-str program))
+    (is (= "5\n0\n9" ((setup "test.lta") []))
+        "The VM zeroes them and the data around them is where it was")
+    (is (= "5\n0\n9" ((setup "test.lta" "-a") []))
+        "The same translated ahead of time"))
+  (sh "rm" "-rf" "test.lta")
+  (clean-up))
+
+;;; JIT ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;; Compiles every block the first time it is jumped to, so the programs run
+;; almost all of their loops as machine code. It only builds on x86-64 Linux.
+(deftest jit
+  (when (and (= "amd64" (System/getProperty "os.arch"))
+             (= "Linux" (System/getProperty "os.name")))
+    (check-kattis ["-DLT64_JIT" "-DLT64_JIT_THRESHOLD=1"])
+    (let [program '(lt64-asm-prog
+                     (static)
+                     (main :push 3 :rpush
+                           :label loop
+                           :wread :wprn :!prn-nl
+                           :rpop :push 1 :sub :first :rpush
+                           :push loop :branch
+                           :dread :dprn :halt))]
+      (spit "test.lta" (pr-str program))
+      (is (= "5\n0\n0\n0" ((setup "test.lta") ["5"]))
+          "The interpreter pushes 0 for reads past the end of the input")
+      (binding [*cc-flags* ["-DLT64_JIT" "-DLT64_JIT_THRESHOLD=1"]]
+        (is (= "5\n0\n0\n0" ((setup "test.lta") ["5"]))
+            "And so does the JIT")))
+    (sh "rm" "-rf" "test.lta")
+    (clean-up)))
+
+;; Calls show, then stores a :prnch over its :wprn and calls it again, then
+;; stores a :push 66 over its :push 65 with one dstore and calls it again.
+;; With the JIT show has been compiled before each write. :mem-to-buf and
+;; :buf-to-mem address memory from fmp, so they can't write into the code.
+(deftest self-modifying
+  (spit "test.lta" (pr-str '(lt64-asm-prog
+                              (static)
+                              (main :push show :call
+                                    :push 75 :push show/op :store-lb
+                                    :push show :call
+                                    :push 1 :push 66 :push show :dstore-lb
+                                    :push show :call
+                                    :halt)
+                              (proc show :no-inline
+                                    :push 65 :label show/op :wprn :!prn-nl
+                                    :ret))))
+  (is (= "65\nA\nB" ((setup "test.lta") []))
+      "The interpreter runs the ops written into the program")
+  (when (and (= "amd64" (System/getProperty "os.arch"))
+             (= "Linux" (System/getProperty "os.name")))
+    (binding [*cc-flags* ["-DLT64_JIT" "-DLT64_JIT_THRESHOLD=1"]]
+      (is (= "65\nA\nB" ((setup "test.lta") []))
+          "The JIT throws away show each time it is written over")))
+  (sh "rm" "-rf" "test.lta")
+  (clean-up))
+
+
 ;; RUN ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (run-tests 'lt64-asm.vm-test)